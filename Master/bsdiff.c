@@ -0,0 +1,365 @@
+/**
+ * @file bsdiff.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "../Slave/patch.h"
+#include "bsdiff.h"
+
+#define DIFF_MIN_ZERO_RUN 3 /* shorter runs of unchanged bytes stay inside the difference bytes */
+
+/* Suffix array of the base : qsufsort (Larsson & Sadakane), as in bsdiff.
+   I : suffixes sorted (negative : length of a sorted group), V : group of each suffix */
+static void split(int32_t *I, int32_t *V, int32_t start, int32_t len, int32_t h)
+{
+    int32_t i, j, k, x, tmp, jj, kk;
+    if (len < 16)
+    {
+        for (k = start; k < start + len; k += j)
+        {
+            j = 1;
+            x = V[I[k] + h];
+            for (i = 1; k + i < start + len; i++)
+            {
+                if (V[I[k + i] + h] < x)
+                {
+                    x = V[I[k + i] + h];
+                    j = 0;
+                }
+                if (V[I[k + i] + h] == x)
+                {
+                    tmp = I[k + j];
+                    I[k + j] = I[k + i];
+                    I[k + i] = tmp;
+                    j++;
+                }
+            }
+            for (i = 0; i < j; i++)
+                V[I[k + i]] = k + j - 1;
+            if (j == 1)
+                I[k] = -1;
+        }
+        return;
+    }
+    x = V[I[start + len / 2] + h];
+    jj = 0;
+    kk = 0;
+    for (i = start; i < start + len; i++)
+    {
+        if (V[I[i] + h] < x)
+            jj++;
+        if (V[I[i] + h] == x)
+            kk++;
+    }
+    jj += start;
+    kk += jj;
+    i = start;
+    j = 0;
+    k = 0;
+    while (i < jj)
+    {
+        if (V[I[i] + h] < x)
+            i++;
+        else if (V[I[i] + h] == x)
+        {
+            tmp = I[i];
+            I[i] = I[jj + j];
+            I[jj + j] = tmp;
+            j++;
+        }
+        else
+        {
+            tmp = I[i];
+            I[i] = I[kk + k];
+            I[kk + k] = tmp;
+            k++;
+        }
+    }
+    while (jj + j < kk)
+    {
+        if (V[I[jj + j] + h] == x)
+            j++;
+        else
+        {
+            tmp = I[jj + j];
+            I[jj + j] = I[kk + k];
+            I[kk + k] = tmp;
+            k++;
+        }
+    }
+    if (jj > start)
+        split(I, V, start, jj - start, h);
+    for (i = 0; i < kk - jj; i++)
+        V[I[jj + i]] = kk - 1;
+    if (jj == kk - 1)
+        I[jj] = -1;
+    if (start + len > kk)
+        split(I, V, kk, start + len - kk, h);
+}
+
+static void qsufsort(int32_t *I, int32_t *V, const uint8_t *base, int32_t size)
+{
+    int32_t buckets[256] = {0};
+    int32_t i, h, len;
+    for (i = 0; i < size; i++)
+        buckets[base[i]]++;
+    for (i = 1; i < 256; i++)
+        buckets[i] += buckets[i - 1];
+    for (i = 255; i > 0; i--)
+        buckets[i] = buckets[i - 1];
+    buckets[0] = 0;
+    for (i = 0; i < size; i++)
+        I[++buckets[base[i]]] = i;
+    I[0] = size;
+    for (i = 0; i < size; i++)
+        V[i] = buckets[base[i]];
+    V[size] = 0;
+    for (i = 1; i < 256; i++)
+        if (buckets[i] == buckets[i - 1] + 1)
+            I[buckets[i]] = -1;
+    I[0] = -1;
+    for (h = 1; I[0] != -(size + 1); h += h)
+    {
+        len = 0;
+        for (i = 0; i < size + 1;)
+        {
+            if (I[i] < 0)
+            {
+                len -= I[i];
+                i -= I[i];
+            }
+            else
+            {
+                if (len)
+                    I[i - len] = -len;
+                len = V[I[i]] + 1 - i;
+                split(I, V, i, len, h);
+                i += len;
+                len = 0;
+            }
+        }
+        if (len)
+            I[i - len] = -len;
+    }
+    for (i = 0; i < size + 1; i++)
+        I[V[i]] = i;
+}
+
+static int32_t match_length(const uint8_t *a, int32_t a_size, const uint8_t *b, int32_t b_size)
+{
+    int32_t i = 0;
+    while (i < a_size && i < b_size && a[i] == b[i])
+        i++;
+    return i;
+}
+
+// Longest match of target in the base (binary search of the suffix array between st and en), pos gets its offset
+static int32_t search(const int32_t *I, const uint8_t *base, int32_t base_size, const uint8_t *target, int32_t target_size,
+                      int32_t st, int32_t en, int32_t *pos)
+{
+    while (en - st >= 2)
+    {
+        int32_t x = st + (en - st) / 2;
+        int32_t n = (base_size - I[x] < target_size) ? base_size - I[x] : target_size;
+        if (memcmp(base + I[x], target, n) < 0)
+            st = x;
+        else
+            en = x;
+    }
+    int32_t x = match_length(base + I[st], base_size - I[st], target, target_size);
+    int32_t y = match_length(base + I[en], base_size - I[en], target, target_size);
+    *pos = (x > y) ? I[st] : I[en];
+    return (x > y) ? x : y;
+}
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;
+    size_t capacity;
+    int failed;
+} PATCH_BUFFER;
+
+static uint8_t *reserve(PATCH_BUFFER *out, size_t count)
+{
+    if (out->size + count > out->capacity)
+    {
+        size_t capacity = (out->capacity + count) * 2;
+        uint8_t *buf = realloc(out->buf, capacity);
+        if (!buf)
+        {
+            out->failed = 1;
+            return NULL;
+        }
+        out->buf = buf;
+        out->capacity = capacity;
+    }
+    return out->buf + out->size;
+}
+
+static void put_varint(PATCH_BUFFER *out, uint64_t value)
+{
+    uint8_t *p = reserve(out, 10);
+    if (p)
+        out->size += patch_put_varint(p, value);
+}
+
+static void put_bytes(PATCH_BUFFER *out, const uint8_t *bytes, size_t count)
+{
+    uint8_t *p = reserve(out, count);
+    if (p)
+    {
+        memcpy(p, bytes, count);
+        out->size += count;
+    }
+}
+
+// Record : len bytes of target at target_pos against the base at base_pos, then extra_len new bytes, then seek
+static void put_record(PATCH_BUFFER *out, const uint8_t *base, int32_t base_pos, const uint8_t *target, int32_t target_pos,
+                       int32_t len, int32_t extra_len, int32_t seek)
+{
+    put_varint(out, len);
+    put_varint(out, extra_len);
+    put_varint(out, patch_zigzag(seek));
+    int32_t i = 0;
+    while (i < len)
+    {
+        // unchanged bytes
+        int32_t same = 0;
+        while (i + same < len && target[target_pos + i + same] == base[base_pos + i + same])
+            same++;
+        if (same >= DIFF_MIN_ZERO_RUN || i + same == len)
+        {
+            if (same)
+                put_varint(out, (uint64_t)same << 1);
+            i += same;
+            continue;
+        }
+        // difference bytes, up to the next run of unchanged bytes worth a token
+        int32_t n = same, run = 0;
+        while (i + n < len && run < DIFF_MIN_ZERO_RUN)
+        {
+            run = (target[target_pos + i + n] == base[base_pos + i + n]) ? run + 1 : 0;
+            n++;
+        }
+        if (run >= DIFF_MIN_ZERO_RUN)
+            n -= run;
+        put_varint(out, (uint64_t)n << 1 | 1);
+        uint8_t *p = reserve(out, n);
+        if (!p)
+            return;
+        for (int32_t k = 0; k < n; k++)
+            p[k] = target[target_pos + i + k] - base[base_pos + i + k];
+        out->size += n;
+        i += n;
+    }
+    put_bytes(out, target + target_pos + len, extra_len);
+}
+
+uint8_t *bsdiff_create(const uint8_t *base, uint32_t base_size, const uint8_t *target, uint32_t target_size, uint32_t *patch_size)
+{
+    int32_t old_size = base_size, new_size = target_size;
+    int32_t *I = malloc((old_size + 1) * sizeof(int32_t));
+    int32_t *V = malloc((old_size + 1) * sizeof(int32_t));
+    PATCH_BUFFER out = {0};
+    if (!I || !V)
+    {
+        free(I);
+        free(V);
+        return NULL;
+    }
+    qsufsort(I, V, base, old_size);
+    free(V);
+
+    int32_t scan = 0, len = 0, pos = 0;
+    int32_t last_scan = 0, last_pos = 0, last_offset = 0;
+    while (scan < new_size && !out.failed)
+    {
+        // next exact match clearly better than extending the previous one
+        int32_t old_score = 0;
+        int32_t scsc;
+        for (scsc = scan += len; scan < new_size; scan++)
+        {
+            len = search(I, base, old_size, target + scan, new_size - scan, 0, old_size, &pos);
+            for (; scsc < scan + len; scsc++)
+                if (scsc + last_offset < old_size && base[scsc + last_offset] == target[scsc])
+                    old_score++;
+            if ((len == old_score && len != 0) || len > old_score + 8)
+                break;
+            if (scan + last_offset < old_size && base[scan + last_offset] == target[scan])
+                old_score--;
+        }
+        if (len == old_score && scan != new_size)
+            continue;
+        // extend the previous match forwards and this one backwards while more than half the bytes agree
+        int32_t s = 0, sf = 0, lenf = 0;
+        for (int32_t i = 0; last_scan + i < scan && last_pos + i < old_size;)
+        {
+            if (base[last_pos + i] == target[last_scan + i])
+                s++;
+            i++;
+            if (s * 2 - i > sf * 2 - lenf)
+            {
+                sf = s;
+                lenf = i;
+            }
+        }
+        int32_t lenb = 0;
+        if (scan < new_size)
+        {
+            int32_t sb = 0;
+            s = 0;
+            for (int32_t i = 1; scan >= last_scan + i && pos >= i; i++)
+            {
+                if (base[pos - i] == target[scan - i])
+                    s++;
+                if (s * 2 - i > sb * 2 - lenb)
+                {
+                    sb = s;
+                    lenb = i;
+                }
+            }
+        }
+        // both extensions overlap : split where the most bytes agree
+        if (last_scan + lenf > scan - lenb)
+        {
+            int32_t overlap = (last_scan + lenf) - (scan - lenb);
+            int32_t ss = 0, lens = 0;
+            s = 0;
+            for (int32_t i = 0; i < overlap; i++)
+            {
+                if (target[last_scan + lenf - overlap + i] == base[last_pos + lenf - overlap + i])
+                    s++;
+                if (target[scan - lenb + i] == base[pos - lenb + i])
+                    s--;
+                if (s > ss)
+                {
+                    ss = s;
+                    lens = i + 1;
+                }
+            }
+            lenf += lens - overlap;
+            lenb -= lens;
+        }
+        put_record(&out, base, last_pos, target, last_scan, lenf, (scan - lenb) - (last_scan + lenf),
+                   (pos - lenb) - (last_pos + lenf));
+        last_scan = scan - lenb;
+        last_pos = pos - lenb;
+        last_offset = pos - scan;
+    }
+    free(I);
+    if (out.failed)
+    {
+        free(out.buf);
+        return NULL;
+    }
+    *patch_size = out.size;
+    return out.buf ? out.buf : malloc(1); // an empty target : an empty patch
+}
@@ -0,0 +1,30 @@
+/**
+ * @file bsdiff.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Patch of a base file into a new file (patch.h format) : the bsdiff matching (Colin Percival), a suffix
+ *         array of the base gives the longest match of each position of the new file, matches are extended into
+ *         approximate ones whose bytewise difference is mostly zeros (code moved by a few bytes : only the shifted
+ *         addresses change). The zero runs of the difference take a few bytes in the patch.
+ * @version 0.1
+ * @date 2023-12-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef BSDIFF_HEADER_H_
+#define BSDIFF_HEADER_H_
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /* Patch turning base into target, malloc'ed (NULL if out of memory), patch_size gets its size.
+       Memory : about 8 times the base size for the suffix array */
+    uint8_t *bsdiff_create(const uint8_t *base, uint32_t base_size, const uint8_t *target, uint32_t target_size, uint32_t *patch_size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // BSDIFF_HEADER_H_
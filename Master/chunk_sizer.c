@@ -0,0 +1,88 @@
+/**
+ * @file chunk_sizer.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-29
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "chunk_sizer.h"
+
+#define CHUNK_CLASS_COUNT 6 /* 128 .. 4096 bytes, CAP_CHUNK_CLASS */
+#define CHUNK_IDX_MAX 65535U /* chunks of a file : ChunkIdx and the ranges of the protocol frames are 16 bit */
+
+static uint16_t class_payload(int i)
+{
+    return 128 << i;
+}
+
+// Class i is allowed and indexes every chunk of the file (the last one included) with 16 bits
+static bool class_fits(const CHUNK_SIZER *sizer, int i)
+{
+    return (sizer->classes & (1 << i)) && ((uint64_t)sizer->file_size + class_payload(i) - 1) / class_payload(i) <= CHUNK_IDX_MAX;
+}
+
+void chunk_sizer_init(CHUNK_SIZER *sizer, uint16_t classes, uint16_t start_payload, uint32_t file_size)
+{
+    sizer->classes = classes;
+    sizer->target = 0;
+    sizer->clean = 0;
+    sizer->file_size = file_size;
+    for (int i = 0; i < CHUNK_CLASS_COUNT; i++)
+    {
+        if (!class_fits(sizer, i))
+        {
+            sizer->classes &= ~(1 << i);
+            continue;
+        }
+        if (class_payload(i) <= start_payload)
+            sizer->target = class_payload(i);
+    }
+    if (!sizer->target) // start_payload below every class : the smallest
+        for (int i = CHUNK_CLASS_COUNT - 1; i >= 0; i--)
+            if (sizer->classes & (1 << i))
+                sizer->target = class_payload(i);
+}
+
+uint16_t chunk_sizer_payload(const CHUNK_SIZER *sizer, uint32_t offset)
+{
+    uint16_t payload = sizer->target;
+    for (int i = CHUNK_CLASS_COUNT - 1; i >= 0; i--)
+    {
+        if (!(sizer->classes & (1 << i)) || class_payload(i) > sizer->target)
+            continue;
+        payload = class_payload(i);
+        if (offset % payload == 0)
+            break;
+    }
+    return payload;
+}
+
+bool chunk_sizer_ack(CHUNK_SIZER *sizer, uint32_t count)
+{
+    sizer->clean += count;
+    if (sizer->clean < CHUNK_GROW_AFTER)
+        return false;
+    for (int i = 0; i < CHUNK_CLASS_COUNT; i++)
+        if ((sizer->classes & (1 << i)) && class_payload(i) > sizer->target)
+        {
+            sizer->target = class_payload(i);
+            sizer->clean = 0;
+            return true;
+        }
+    return false;
+}
+
+bool chunk_sizer_loss(CHUNK_SIZER *sizer)
+{
+    sizer->clean = 0;
+    for (int i = CHUNK_CLASS_COUNT - 1; i >= 0; i--)
+        if (class_fits(sizer, i) && class_payload(i) < sizer->target)
+        {
+            sizer->target = class_payload(i);
+            return true;
+        }
+    return false;
+}
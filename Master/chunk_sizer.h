@@ -0,0 +1,47 @@
+/**
+ * @file chunk_sizer.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Adaptive chunk size : the master halves the chunk payload when chunks are lost
+ *         and doubles it again after a run of chunks acknowledged without loss, between
+ *         the chunk classes agreed with the slave (AIMD on the power of two classes).
+ * @version 0.1
+ * @date 2023-12-29
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef CHUNK_SIZER_HEADER_H_
+#define CHUNK_SIZER_HEADER_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define CHUNK_GROW_AFTER 16 /* chunks acknowledged in a row at one size before trying the next size up */
+
+    typedef struct
+    {
+        uint16_t classes; // CAP_CHUNK_CLASS bits usable
+        uint16_t target;  // chunk payload aimed at
+        uint32_t clean;   // chunks acknowledged since the last loss or size change
+        uint32_t file_size;
+    } CHUNK_SIZER;
+
+    /* Start at the largest class not above start_payload. Classes too small to index a file of
+       file_size bytes with the 16 bit ChunkIdx (more than 65535 chunks) are left out, target 0 : none is left */
+    void chunk_sizer_init(CHUNK_SIZER *sizer, uint16_t classes, uint16_t start_payload, uint32_t file_size);
+    /* Chunk payload once offset bytes are acknowledged : the target, or a smaller class until offset is
+       a multiple of it (the slave stores chunk idx at idx * payload) */
+    uint16_t chunk_sizer_payload(const CHUNK_SIZER *sizer, uint32_t offset);
+    // count chunks acknowledged without loss, returns true if the target grew
+    bool chunk_sizer_ack(CHUNK_SIZER *sizer, uint32_t count);
+    // A chunk or its answer was lost : halve the target, returns false if it is already the smallest class
+    bool chunk_sizer_loss(CHUNK_SIZER *sizer);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // CHUNK_SIZER_HEADER_H_
@@ -0,0 +1,154 @@
+/**
+ * @file event_loop.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-23
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "../Slave/serialport_layer.h"
+#include "../Slave/log.h"
+#include "../Slave/metrics.h"
+#include "../Slave/trace.h"
+#include "event_loop.h"
+
+static struct
+{
+    int epoll_fd;
+    int timer_fd;
+    int serial_fd;
+    FRAME_PARSER parser;
+    uint8_t rx[EVENT_LOOP_RX_BUFFER_SIZE];
+    uint16_t rx_len; // bytes in rx
+    uint16_t rx_pos; // bytes of rx already given to the parser
+    uint64_t armed_us;
+} loop = {.epoll_fd = -1, .timer_fd = -1, .serial_fd = -1};
+
+int event_loop_open(int fd, uint8_t peer_ID)
+{
+    loop.serial_fd = fd;
+    frame_parser_init(&loop.parser, peer_ID);
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop.epoll_fd < 0 || loop.timer_fd < 0)
+    {
+        LOG_ERROR("Error %d creating the event loop", errno);
+        event_loop_close();
+        return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        LOG_ERROR("Error %d watching the serial port", errno);
+        event_loop_close();
+        return -2;
+    }
+    ev.data.fd = loop.timer_fd;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.timer_fd, &ev) != 0)
+    {
+        LOG_ERROR("Error %d watching the deadline timer", errno);
+        event_loop_close();
+        return -3;
+    }
+    return 1;
+}
+
+void event_loop_close(void)
+{
+    if (loop.epoll_fd >= 0)
+        close(loop.epoll_fd);
+    if (loop.timer_fd >= 0)
+        close(loop.timer_fd);
+    loop.epoll_fd = loop.timer_fd = -1;
+}
+
+int event_loop_set_timeout_us(uint64_t timeout_us)
+{
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = timeout_us / 1000000ULL;
+    its.it_value.tv_nsec = (timeout_us % 1000000ULL) * 1000;
+    loop.armed_us = metrics_now_us();
+    return timerfd_settime(loop.timer_fd, 0, &its, NULL) == 0 ? 1 : -1;
+}
+
+void event_loop_flush(void)
+{
+    flushReceiver();
+    loop.rx_len = loop.rx_pos = 0;
+    frame_parser_init(&loop.parser, loop.parser.my_ID);
+}
+
+// Give the pending bytes to the parser, returns its verdict
+static int parse_pending(void)
+{
+    uint16_t used = 0;
+    int ret = frame_parser_feed(&loop.parser, loop.rx + loop.rx_pos, loop.rx_len - loop.rx_pos, &used);
+    loop.rx_pos += used;
+    return ret;
+}
+
+int event_loop_wait(void)
+{
+    uint64_t span = trace_begin();
+    int ret = 0;
+    while (1)
+    {
+        if (loop.rx_pos < loop.rx_len && (ret = parse_pending()) != 0)
+            break;
+
+        struct epoll_event events[2];
+        int n = epoll_wait(loop.epoll_fd, events, 2, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Error %d waiting for events", errno);
+            ret = 0;
+            break;
+        }
+        bool expired = false;
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.fd == loop.timer_fd)
+            {
+                uint64_t expirations;
+                expired = (read(loop.timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+            }
+            else if (events[i].data.fd == loop.serial_fd)
+            {
+                int got = readAvailable(loop.rx, sizeof(loop.rx));
+                loop.rx_len = (got > 0) ? got : 0;
+                loop.rx_pos = 0;
+            }
+        }
+        // Bytes that arrived together with the expiry still count
+        if (loop.rx_pos < loop.rx_len && (ret = parse_pending()) != 0)
+            break;
+        if (expired)
+        {
+            if (!frame_parser_idle(&loop.parser))
+            {
+                metrics_inc(METRIC_PARTIAL_TIMEOUTS);
+                if ((ret = frame_parser_expire(&loop.parser)) != 0) // a frame behind a false SOF
+                    break;
+            }
+            frame_parser_init(&loop.parser, loop.parser.my_ID);
+            ret = 0;
+            break;
+        }
+    }
+    if (ret == 0)
+        metrics_inc(METRIC_RESPONSE_TIMEOUTS);
+    else if (ret > 0)
+        metrics_observe_us(METRIC_HIST_RESPONSE_US, metrics_now_us() - loop.armed_us);
+    if (ret != 0)
+        event_loop_set_timeout_us(0); // answered : disarm the deadline
+    trace_end_arg("wait_response", span, "ret", ret);
+    return ret;
+}
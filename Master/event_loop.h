@@ -0,0 +1,39 @@
+/**
+ * @file event_loop.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  epoll based wait of the master : the serial port and a timerfd holding the
+ *         response deadline are watched together, the master sleeps only while a
+ *         response is outstanding and wakes up on the first byte that completes it.
+ * @version 0.1
+ * @date 2023-12-23
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef EVENT_LOOP_HEADER_H_
+#define EVENT_LOOP_HEADER_H_
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define EVENT_LOOP_RX_BUFFER_SIZE 512 /* bytes pulled from the serial port per wake up */
+
+    // Watch fd (the opened serial port), frames are accepted from peer_ID only
+    int event_loop_open(int fd, uint8_t peer_ID);
+    void event_loop_close(void);
+
+    // Arm the response deadline timeout_us from now (0 : disarm)
+    int event_loop_set_timeout_us(uint64_t timeout_us);
+    // Drop the received bytes not parsed yet (late response of a previous attempt)
+    void event_loop_flush(void);
+    /* Sleep until a response frame is in uart_buf (1), a frame is rejected by the parser (<0)
+       or the deadline expires (0) */
+    int event_loop_wait(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // EVENT_LOOP_HEADER_H_
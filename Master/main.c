@@ -13,16 +13,27 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "../Slave/serialport_layer.h"
 #include "../Slave/utilities.h"
 #include "../Slave/log.h"
 #include "../Slave/checksum.h"
+#include "../Slave/metrics.h"
+#include "../Slave/trace.h"
+#include "../Slave/capture.h"
+#include "../Slave/fec.h"
+#include "../Slave/hash_tree.h"
 #include "main.h"
+#include "rto.h"
+#include "chunk_sizer.h"
+#include "event_loop.h"
+#include "profile.h"
+#include "bsdiff.h"
 #define TAG "main"
 
 volatile bool quitApp = false;
-char msg_buf[1024];
 extern uint8_t uart_buf[MAX_UART_FRAME_SIZE];
+extern int serial_fd;
 BINARY_FILE_INFO binaryinfo;
 
 Version BL_Version = {
@@ -30,23 +41,1166 @@ Version BL_Version = {
     .minor = 0};
 #define SLAVE_ID_01 0x01
 
+#define REPAIR_STACK_SIZE 64 /* nodes waiting for the search : (HASH_TREE_FANOUT - 1) per level below the root */
+
+/* Hash tree node that differs on the slave, its children not searched yet */
+typedef struct
+{
+    uint8_t level;
+    uint16_t idx;
+} REPAIR_NODE;
+
+/* Transfer state shared by the request / response handlers */
+typedef struct
+{
+    uint8_t state;             // MASTER_STATE
+    uint8_t slave_id;
+    uint32_t baudrate;         // current rate (the one the port was opened at, then the rate switched to)
+    const char *file_contents;  // bytes sent : the file, or the patch while patching
+    const char *target_contents; // the file itself
+    BINARY_FILE_INFO target;     // size and crc32 of the file itself
+    PATCH_INFO patch;            // -p : base and target of the patch
+    bool patching;               // the file is sent as a patch of the slave's current file
+    bool trailer;                // TRAILER_CRC : binaryinfo.crc32 is sent after the chunks
+    uint32_t crc;                // CRC32 of the file bytes before crc_offset
+    uint32_t crc_offset;         // file bytes in crc
+    uint8_t open_attempts;     // unanswered session open requests
+    uint32_t start_baud;       // rate given on the command line, always the fallback
+    uint32_t max_baud;         // highest rate offered to the slave
+    uint32_t link_candidates;  // caps_baud_bit() of the faster rates not tried yet
+    uint8_t link_tries;        // rates tried
+    uint8_t link_attempts;     // unanswered requests at the current link step
+    uint8_t probe_seq;         // probes acknowledged at the new rate
+    uint32_t link_target;      // rate being tested
+    uint64_t last_response_us; // last valid response of the slave
+    uint16_t chunk_payload;    // chunk payload size of the chunks in flight
+    CHUNK_SIZER sizer;         // chunk payload size for the next burst, within the classes agreed with the slave
+    PROTOCOL_CAPS caps;        // configuration agreed with the slave
+    uint32_t bytes_sent;       // file bytes acknowledged by the slave
+    uint16_t chunk_idx;        // first chunk not acknowledged
+    bool flow_control;         // -f : RTS/CTS enabled, streaming offered at session open
+    bool fec;                  // -e : FEC offered at session open
+    bool cache;                // block cache references offered at session open
+    uint16_t max_chunk;        // largest chunk payload asked at session open
+    uint8_t max_window;        // window offered at session open with -f / -e
+    uint64_t chunks_start_us;  // first burst of the transfer
+    uint8_t window;            // chunks sent before waiting for an ACK (1 : stop and wait)
+    uint16_t burst;            // chunks in flight
+    bool fill;                 // the chunks in flight were sent as a UART_FILL_FRAME
+    uint8_t parity;            // FEC parity frames after the chunks in flight
+    uint32_t loss_ppm;         // chunks lost before FEC recovery (parts per million, moving average)
+    UARTChunk chunk;
+    FEC_PARITY parity_frame;
+    CACHE_QUERY cache_query;   // last block cache query, its hashes are the payload of the references
+    uint64_t cache_have;       // bit i : the slave holds chunk cache_query.first_idx + i
+    uint8_t repairs;           // failed verifies repaired
+    HASH_TREE tree;            // of the file sent, built at the first failed verify
+    REPAIR_NODE repair_stack[REPAIR_STACK_SIZE];
+    uint8_t repair_depth;      // nodes in repair_stack
+    HASH_QUERY hash_query;     // last hash tree query
+    uint8_t *repair_bad;       // bit i : chunk i differs on the slave, sent again
+    uint16_t repair_idx;       // first chunk of the repair burst in flight
+    bool retransmit;           // the chunks in flight were already sent
+    uint64_t sent_us;          // end of transmission of the chunks in flight
+    RTO_ESTIMATOR rto;         // chunk ACK timeout, commands keep the fixed timeout (CHECK_SPACE can take long)
+} MASTER_SESSION;
+
+static const char *const MASTER_STATE_NAMES[MASTER_STATE_COUNT] = {
+    [MASTER_STATE_ENTER_BOOTLOADER] = "enter_bootloader",
+    [MASTER_STATE_SEND_FILE_INFO] = "send_file_info",
+    [MASTER_STATE_CHECK_SPACE] = "check_space",
+    [MASTER_STATE_SEND_CHUNKS] = "send_chunks",
+    [MASTER_STATE_VERIFY_FILE] = "verify_file",
+    [MASTER_STATE_END_SESSION] = "end_session",
+    [MASTER_STATE_DONE] = "done",
+    [MASTER_STATE_OPEN_SESSION] = "open_session",
+    [MASTER_STATE_LINK_SWITCH] = "link_switch",
+    [MASTER_STATE_LINK_PROBE] = "link_probe",
+    [MASTER_STATE_LINK_COMMIT] = "link_commit",
+    [MASTER_STATE_NO_SPACE] = "no_space",
+    [MASTER_STATE_CACHE_QUERY] = "cache_query",
+    [MASTER_STATE_REPAIR_SEARCH] = "repair_search",
+    [MASTER_STATE_REPAIR_CHUNKS] = "repair_chunks",
+    [MASTER_STATE_SEND_TRAILER] = "send_trailer",
+};
+
+// Count a retransmission when the same request (state, chunk) is sent twice in a row
+static bool note_request_sent(uint8_t state, uint16_t chunk_idx)
+{
+    static int last_state = -1;
+    static uint16_t last_chunk_idx;
+    bool retransmit = (last_state == state && last_chunk_idx == chunk_idx);
+    if (retransmit)
+        metrics_inc(METRIC_RETRANSMITS);
+    last_state = state;
+    last_chunk_idx = chunk_idx;
+    return retransmit;
+}
+
+// Time to shift count bytes out at baudrate (8N1 : 10 bits per byte)
+static uint64_t frame_time_us(uint32_t count, uint32_t baudrate)
+{
+    return baudrate ? (uint64_t)count * 10 * 1000000ULL / baudrate : 0;
+}
+
+// Number of chunks of the file (an empty file is still sent as one empty chunk)
+static uint32_t chunk_count(const MASTER_SESSION *session)
+{
+    return binaryinfo.size ? (binaryinfo.size + session->chunk_payload - 1) / session->chunk_payload : 1;
+}
+
+// Trailer : the CRC32 grows over the file bytes up to end (the chunks just sent), each byte once and in order.
+// It runs while the slave answers, the file is read as the transfer goes
+static void crc_advance(MASTER_SESSION *session, uint32_t end)
+{
+    if (!session->trailer)
+        return;
+    if (end > binaryinfo.size)
+        end = binaryinfo.size;
+    if (end <= session->crc_offset)
+        return;
+    session->crc = crc32_update(session->crc, (unsigned char *)session->file_contents + session->crc_offset, end - session->crc_offset);
+    session->crc_offset = end;
+}
+
+// Send chunk idx of the file, flags are or'ed into ChLen (CHUNK_CACHE_REF : its hash instead of its data)
+static void send_chunk(MASTER_SESSION *session, uint16_t idx, uint8_t flags)
+{
+    UARTChunk *chunk = &session->chunk;
+    uint32_t offset = (uint32_t)idx * session->chunk_payload;
+    uint16_t size = (offset + session->chunk_payload <= binaryinfo.size) ? session->chunk_payload : (binaryinfo.size - offset);
+    if (size > sizeof(chunk->ChunkPayload))
+        LOG_ERROR("Buffer Overflow : Check your Code !!");
+    chunk->ChLen = encode_chunk_payload_max_size(session->chunk_payload) | flags;
+    chunk->ChunkIdx = idx;
+    if (flags & CHUNK_CACHE_REF)
+    {
+        size = SHA256_DIGEST_SIZE;
+        memcpy(chunk->ChunkPayload, session->cache_query.hashes[idx - session->cache_query.first_idx], size);
+        metrics_inc(METRIC_CACHE_REFS);
+    }
+    else
+        memcpy(chunk->ChunkPayload, session->file_contents + offset, size);
+    uint16_t dataSize2Send = sizeof(chunk->ChLen) + sizeof(chunk->ChunkIdx) + size;
+    if (session->window > 1 && !(flags & CHUNK_ACK_REQUEST))
+        Write_Stream_to_Slave(session->slave_id, UART_DATA_FRAME, (uint8_t *)chunk, dataSize2Send);
+    else // last frame before the answer : wait until it is on the line
+        Write_Info_to_Slave(session->slave_id, UART_DATA_FRAME, (uint8_t *)chunk, dataSize2Send);
+}
+
+// True if chunk idx holds a single byte value, value gets it
+static bool chunk_uniform(const MASTER_SESSION *session, uint32_t idx, uint8_t *value)
+{
+    uint32_t offset = idx * session->chunk_payload;
+    uint32_t size = (offset + session->chunk_payload <= binaryinfo.size) ? session->chunk_payload : (binaryinfo.size - offset);
+    const char *data = session->file_contents + offset;
+    if (!size)
+        return false;
+    *value = data[0];
+    return memcmp(data, data + 1, size - 1) == 0;
+}
+
+static bool fill_enabled(const MASTER_SESSION *session)
+{
+    return FILL_RUNS && session->caps.protocol_version >= 2 && (session->caps.codecs & CAP_CODEC_FILL);
+}
+
+// Chunks from idx on holding the same single byte value (0 : chunk idx does not), value gets it
+static uint16_t fill_run(const MASTER_SESSION *session, uint32_t idx, uint8_t *value)
+{
+    if (!fill_enabled(session))
+        return 0;
+    uint32_t max = FILL_MAX_BYTES / session->chunk_payload;
+    uint32_t end = chunk_count(session);
+    if (max > UINT16_MAX)
+        max = UINT16_MAX;
+    if (end - idx > max)
+        end = idx + max;
+    uint8_t next;
+    uint32_t count = 0;
+    while (idx + count < end && chunk_uniform(session, idx + count, &next) && (!count || next == *value))
+    {
+        *value = next;
+        count++;
+    }
+    return count;
+}
+
+static bool cache_enabled(const MASTER_SESSION *session)
+{
+    return BLOCK_CACHE_REFS && session->caps.protocol_version >= 2 && (session->caps.codecs & CAP_CODEC_CACHE);
+}
+
+// True if the last block cache query named chunk idx at the current chunk size
+static bool cache_covers(const MASTER_SESSION *session, uint32_t idx)
+{
+    const CACHE_QUERY *query = &session->cache_query;
+    return query->count && query->ChLen == encode_chunk_payload_max_size(session->chunk_payload) && idx >= query->first_idx &&
+           idx < (uint32_t)query->first_idx + query->count;
+}
+
+// True if the slave holds chunk idx in its block cache : it goes as a reference
+static bool cache_held(const MASTER_SESSION *session, uint32_t idx)
+{
+    return cache_enabled(session) && cache_covers(session, idx) && ((session->cache_have >> (idx - session->cache_query.first_idx)) & 1);
+}
+
+static size_t read_sent(void *ctx, uint32_t offset, uint8_t *buf, uint16_t length)
+{
+    memcpy(buf, (const char *)ctx + offset, length);
+    return length;
+}
+
+// Wait for a VERIFY answer : when it fails the slave hashes the file for the search first
+static uint64_t verify_hash_us(const MASTER_SESSION *session)
+{
+    if (!(session->caps.hashes & CAP_HASH_TREE) || session->caps.protocol_version < 2)
+        return 0;
+    return (uint64_t)binaryinfo.size * 1000ULL / REPAIR_HASH_KBPS;
+}
+
+static bool repair_is_bad(const MASTER_SESSION *session, uint32_t idx)
+{
+    return (session->repair_bad[idx / 8] >> (idx % 8)) & 1;
+}
+
+static void repair_mark(MASTER_SESSION *session, uint32_t first, uint32_t count, bool bad)
+{
+    for (uint32_t idx = first; idx < first + count; idx++)
+        if (bad)
+            session->repair_bad[idx / 8] |= 1 << (idx % 8);
+        else
+            session->repair_bad[idx / 8] &= ~(1 << (idx % 8));
+}
+
+// The chunks under node idx of a level differ : a leaf is whole chunks of any size
+static void repair_mark_node(MASTER_SESSION *session, uint8_t level, uint32_t idx)
+{
+    uint32_t first = idx, last = idx + 1;
+    for (uint8_t i = 0; i < level; i++)
+    {
+        first *= HASH_TREE_FANOUT;
+        last *= HASH_TREE_FANOUT;
+    }
+    if (last > session->tree.count[0])
+        last = session->tree.count[0];
+    uint32_t per_leaf = HASH_TREE_LEAF / session->chunk_payload;
+    uint32_t count = (last - first) * per_leaf;
+    if (first * per_leaf + count > chunk_count(session))
+        count = chunk_count(session) - first * per_leaf;
+    repair_mark(session, first * per_leaf, count, true);
+}
+
+// First chunk that differs from idx on, chunk_count() if none
+static uint32_t repair_next(const MASTER_SESSION *session, uint32_t idx)
+{
+    while (idx < chunk_count(session) && !repair_is_bad(session, idx))
+        idx++;
+    return idx;
+}
+
+/* Failed verify : the whole file is the range to search, unless the slave has no hash tree or the repairs ran out.
+   True if the search starts */
+static bool repair_start(MASTER_SESSION *session)
+{
+    if (!(session->caps.hashes & CAP_HASH_TREE) || session->caps.protocol_version < 2 || session->repairs >= REPAIR_ATTEMPTS)
+        return false;
+    free(session->repair_bad);
+    session->repair_bad = calloc(chunk_count(session) / 8 + 1, 1);
+    if (!session->repair_bad)
+        return false;
+    // the file sent does not change : its tree serves every repair
+    if (!session->tree.levels && hash_tree_build(&session->tree, read_sent, (void *)session->file_contents, binaryinfo.size) <= 0)
+    {
+        LOG_ERROR("Error building the hash tree of %u bytes", binaryinfo.size);
+        return false;
+    }
+    session->repairs++;
+    LOG_WARNING("Verify failed, searching the chunks that differ (repair %u of %u)", session->repairs, REPAIR_ATTEMPTS);
+    if (session->tree.levels == 1) // a single leaf : nothing to search
+    {
+        repair_mark_node(session, 0, 0);
+        session->repair_idx = 0;
+        session->state = MASTER_STATE_REPAIR_CHUNKS;
+        return true;
+    }
+    session->repair_stack[0] = (REPAIR_NODE){.level = session->tree.levels - 1, .idx = 0};
+    session->repair_depth = 1;
+    session->state = MASTER_STATE_REPAIR_SEARCH;
+    return true;
+}
+
+// Apply the chunk size of the sizer, chunk_idx is counted again in chunks of the new size
+static void chunk_size_update(MASTER_SESSION *session)
+{
+    uint16_t payload = chunk_sizer_payload(&session->sizer, session->bytes_sent);
+    if (payload == session->chunk_payload)
+        return;
+    LOG_INFO("Chunk size %u -> %u at offset %u", session->chunk_payload, payload, session->bytes_sent);
+    session->chunk_payload = payload;
+    session->chunk_idx = session->bytes_sent / payload;
+}
+
+// Parity frames for the next burst : FEC_PARITY_MARGIN times the chunks expected lost, none on a clean link
+static uint8_t fec_parity_count(const MASTER_SESSION *session)
+{
+    if (!(session->caps.codecs & CAP_CODEC_FEC) || session->window <= 1 ||
+        offsetof(FEC_PARITY, parity) + session->chunk_payload > session->caps.max_frame_payload)
+        return 0;
+    uint64_t expected = (uint64_t)session->loss_ppm * session->burst * FEC_PARITY_MARGIN;
+    uint64_t parity = (expected + 999999) / 1000000;
+    return (parity > FEC_MAX_PARITY) ? FEC_MAX_PARITY : parity;
+}
+
+// lost of count chunks did not reach the slave
+static void fec_loss_sample(MASTER_SESSION *session, uint32_t lost, uint32_t count)
+{
+    uint32_t sample = (count && lost < count) ? lost * 1000000ULL / count : 1000000;
+    session->loss_ppm = session->loss_ppm - (session->loss_ppm + 7) / 8 + sample / 8;
+}
+
+// Send parity row of the chunks in flight, the last row is the checkpoint
+static void send_parity(MASTER_SESSION *session, uint8_t row, bool checkpoint)
+{
+    FEC_PARITY *frame = &session->parity_frame;
+    frame->ChLen = encode_chunk_payload_max_size(session->chunk_payload) | (checkpoint ? CHUNK_ACK_REQUEST : 0);
+    frame->first_idx = session->chunk_idx;
+    frame->data_count = session->burst;
+    frame->parity_count = session->parity;
+    frame->row = row;
+    memset(frame->parity, 0, session->chunk_payload);
+    for (uint8_t i = 0; i < session->burst; i++)
+    {
+        uint32_t offset = (uint32_t)(session->chunk_idx + i) * session->chunk_payload;
+        uint16_t size = (offset + session->chunk_payload <= binaryinfo.size) ? session->chunk_payload : (binaryinfo.size - offset);
+        fec_mul_add(frame->parity, (const uint8_t *)session->file_contents + offset, size, fec_coef(row, i));
+    }
+    uint16_t dataSize2Send = offsetof(FEC_PARITY, parity) + session->chunk_payload;
+    metrics_inc(METRIC_FEC_PARITY_FRAMES);
+    if (!checkpoint)
+        Write_Stream_to_Slave(session->slave_id, UART_FEC_FRAME, (uint8_t *)frame, dataSize2Send);
+    else
+        Write_Info_to_Slave(session->slave_id, UART_FEC_FRAME, (uint8_t *)frame, dataSize2Send);
+}
+
+// The slave cannot apply the patch (older slave, other current file) : send the file itself
+static void patch_fallback(MASTER_SESSION *session)
+{
+    session->patching = false;
+    session->file_contents = session->target_contents;
+    binaryinfo = session->target;
+}
+
+// Send the request of the current state, returns the time allowed for the response (0 : no response expected)
+static uint64_t send_request(MASTER_SESSION *session)
+{
+    uint8_t Slave_ID = session->slave_id;
+    uint64_t command_timeout_us = UART_TIMEOUT_MICROSECONDS + frame_time_us(sizeof(UARTFrame), session->baudrate);
+    event_loop_flush(); // drop a late response of a previous attempt
+    switch (session->state)
+    {
+    case MASTER_STATE_OPEN_SESSION: // bootloader entry, file info and space check in one exchange
+    {
+        SESSION_OPEN_REQUEST req = {.file = binaryinfo, .chunk_payload = session->max_chunk};
+        caps_local(&req.caps, session->max_chunk);
+        caps_limit_baud(&req.caps, session->max_baud);
+        if (session->fec)
+            req.caps.codecs |= CAP_CODEC_FEC;
+        if (session->flow_control || session->fec)
+            req.caps.window = session->max_window;
+        if (session->patching)
+            req.caps.codecs |= CAP_CODEC_PATCH;
+        if (session->cache)
+            req.caps.codecs |= CAP_CODEC_CACHE;
+        uint8_t frame[sizeof(req) + sizeof(PATCH_INFO)];
+        memcpy(frame, &req, sizeof(req));
+        memcpy(frame + sizeof(req), &session->patch, sizeof(PATCH_INFO));
+        note_request_sent(session->state, 0);
+        Write_Info_to_Slave(Slave_ID, UART_SESSION_FRAME, frame, session->patching ? sizeof(frame) : sizeof(req));
+        return command_timeout_us + frame_time_us(sizeof(UARTFrame) + sizeof(SESSION_OPEN_RESPONSE), session->baudrate);
+    }
+    case MASTER_STATE_LINK_SWITCH: // ask the slave to move to a faster baud rate
+    {
+        LINK_REQUEST req = {.op = LINK_OP_SWITCH, .baud = session->link_target};
+        Write_Info_to_Slave(Slave_ID, UART_LINK_FRAME, (uint8_t *)&req, sizeof(req));
+        return command_timeout_us;
+    }
+    case MASTER_STATE_LINK_PROBE: // test burst at the new rate
+    {
+        uint8_t probe[sizeof(LINK_REQUEST) + LINK_PROBE_BYTES];
+        LINK_REQUEST req = {.op = LINK_OP_PROBE, .seq = session->probe_seq};
+        memcpy(probe, &req, sizeof(req));
+        link_probe_pattern(probe + sizeof(req), LINK_PROBE_BYTES, req.seq);
+        Write_Info_to_Slave(Slave_ID, UART_LINK_FRAME, probe, sizeof(probe));
+        return command_timeout_us + frame_time_us(sizeof(probe), session->baudrate);
+    }
+    case MASTER_STATE_LINK_COMMIT: // keep the new rate
+    {
+        LINK_REQUEST req = {.op = LINK_OP_COMMIT};
+        Write_Info_to_Slave(Slave_ID, UART_LINK_FRAME, (uint8_t *)&req, sizeof(req));
+        return command_timeout_us;
+    }
+    case MASTER_STATE_ENTER_BOOTLOADER: // ask slave to enter bootloader App
+        note_request_sent(session->state, 0);
+        Write_Command_to_Slave(Slave_ID, UART_CMD_ENTER_BOOTLOADER);
+        return command_timeout_us;
+    case MASTER_STATE_SEND_FILE_INFO: // send file info(size and crc32)
+        note_request_sent(session->state, 0);
+        Write_Info_to_Slave(Slave_ID, UART_HEADER_FRAME, (uint8_t *)&binaryinfo, sizeof(binaryinfo));
+        return command_timeout_us;
+    case MASTER_STATE_CHECK_SPACE: // Ask Slave to check space availabilty
+        note_request_sent(session->state, 0);
+        Write_Command_to_Slave(Slave_ID, UART_CMD_CHECK_SPACE);
+        return command_timeout_us;
+    case MASTER_STATE_SEND_CHUNKS: // send file as chunks
+    {
+        chunk_size_update(session);
+        // streaming : up to window chunks back to back (RTS/CTS paces them), the last one asks for the ACK.
+        // After a session open every burst (a single chunk in stop and wait) ends with such a checkpoint :
+        // the answer names the next chunk expected, a late answer to a retransmitted chunk cannot pass for the next one
+        uint32_t left = chunk_count(session) - session->chunk_idx;
+        session->burst = (left < session->window) ? left : session->window;
+        session->retransmit = note_request_sent(session->state, session->chunk_idx);
+        // a run of chunks holding one byte value (zero padding, erased flash) is a burst of its own : a single fill frame
+        uint8_t value;
+        uint16_t run = fill_run(session, session->chunk_idx, &value);
+        // the slave has a block cache : which of the next chunks it holds, asked once per CACHE_QUERY_MAX chunks
+        if (!run && cache_enabled(session) && !cache_covers(session, session->chunk_idx))
+        {
+            session->state = MASTER_STATE_CACHE_QUERY;
+            return send_request(session);
+        }
+        session->fill = run > 0;
+        if (session->fill)
+        {
+            FILL_CHUNKS fill = {.ChLen = encode_chunk_payload_max_size(session->chunk_payload) | CHUNK_ACK_REQUEST,
+                                .first_idx = session->chunk_idx,
+                                .count = run,
+                                .value = value};
+            session->burst = run;
+            session->parity = 0;
+            metrics_inc(METRIC_FILL_FRAMES);
+            Write_Info_to_Slave(Slave_ID, UART_FILL_FRAME, (uint8_t *)&fill, sizeof(fill));
+            session->sent_us = monotonic_us();
+            crc_advance(session, (uint32_t)(session->chunk_idx + run) * session->chunk_payload);
+            // the slave may write the run : the wait covers it like a command
+            return rto_timeout_us(&session->rto) + UART_TIMEOUT_MICROSECONDS;
+        }
+        for (uint16_t i = 1; i < session->burst; i++)
+            if (fill_enabled(session) && chunk_uniform(session, session->chunk_idx + i, &value))
+                session->burst = i; // the burst ends before the next run
+        if (cache_enabled(session) && session->chunk_idx + session->burst > session->cache_query.first_idx + session->cache_query.count)
+            session->burst = session->cache_query.first_idx + session->cache_query.count - session->chunk_idx; // and before the next query
+        // FEC : parity frames follow the chunks, the slave rebuilds up to that many lost chunks itself
+        uint8_t parity = fec_parity_count(session);
+        if (parity != session->parity)
+            LOG_INFO("FEC : %u parity frames per %u chunks (loss %u ppm)", parity, session->burst, session->loss_ppm);
+        session->parity = parity;
+        for (uint8_t i = 0; i < session->burst; i++)
+        {
+            bool checkpoint = session->caps.protocol_version >= 2 && i == session->burst - 1 && !parity;
+            uint8_t flags = checkpoint ? CHUNK_ACK_REQUEST : 0;
+            if (cache_held(session, session->chunk_idx + i))
+                flags |= CHUNK_CACHE_REF;
+            send_chunk(session, session->chunk_idx + i, flags);
+        }
+        for (uint8_t row = 0; row < parity; row++)
+            send_parity(session, row, row == parity - 1);
+        session->sent_us = monotonic_us();
+        crc_advance(session, (uint32_t)(session->chunk_idx + session->burst) * session->chunk_payload);
+        return rto_timeout_us(&session->rto);
+    }
+    case MASTER_STATE_CACHE_QUERY: // which chunks of the next bursts the slave holds in its block cache
+    {
+        CACHE_QUERY *query = &session->cache_query;
+        uint32_t left = chunk_count(session) - session->chunk_idx;
+        uint32_t max = (session->caps.max_frame_payload - offsetof(CACHE_QUERY, hashes)) / SHA256_DIGEST_SIZE;
+        if (max > CACHE_QUERY_MAX)
+            max = CACHE_QUERY_MAX;
+        query->ChLen = encode_chunk_payload_max_size(session->chunk_payload);
+        query->first_idx = session->chunk_idx;
+        query->count = (left < max) ? left : max;
+        for (uint8_t i = 0; i < query->count; i++)
+        {
+            uint32_t offset = (uint32_t)(query->first_idx + i) * session->chunk_payload;
+            uint16_t size = (offset + session->chunk_payload <= binaryinfo.size) ? session->chunk_payload : (binaryinfo.size - offset);
+            sha256(session->file_contents + offset, size, query->hashes[i]);
+        }
+        session->cache_have = 0;
+        uint16_t dataSize2Send = offsetof(CACHE_QUERY, hashes) + query->count * SHA256_DIGEST_SIZE;
+        note_request_sent(session->state, session->chunk_idx);
+        Write_Info_to_Slave(Slave_ID, UART_CACHE_FRAME, (uint8_t *)query, dataSize2Send);
+        return command_timeout_us + frame_time_us(dataSize2Send, session->baudrate);
+    }
+    case MASTER_STATE_REPAIR_SEARCH: // hashes of the children of the last node that differs
+    {
+        HASH_QUERY *query = &session->hash_query;
+        const REPAIR_NODE *node = &session->repair_stack[session->repair_depth - 1];
+        query->level = node->level - 1;
+        query->first = node->idx * HASH_TREE_FANOUT;
+        uint32_t children = session->tree.count[query->level] - query->first;
+        query->count = children < HASH_TREE_FANOUT ? children : HASH_TREE_FANOUT;
+        note_request_sent(session->state, query->first);
+        Write_Info_to_Slave(Slave_ID, UART_HASH_FRAME, (uint8_t *)query, sizeof(*query));
+        // the slave hashed its file at the verify : the answer is read from its tree
+        return command_timeout_us + frame_time_us(sizeof(HASH_ANSWER), session->baudrate);
+    }
+    case MASTER_STATE_REPAIR_CHUNKS: // the chunks that differ, a burst of consecutive ones at a time
+    {
+        session->repair_idx = repair_next(session, session->repair_idx);
+        session->burst = 0;
+        while (session->burst < session->window && session->repair_idx + session->burst < chunk_count(session) &&
+               repair_is_bad(session, session->repair_idx + session->burst))
+            session->burst++;
+        session->retransmit = note_request_sent(session->state, session->repair_idx);
+        for (uint16_t i = 0; i < session->burst; i++)
+            send_chunk(session, session->repair_idx + i, i == session->burst - 1 ? CHUNK_ACK_REQUEST : 0);
+        session->sent_us = monotonic_us();
+        return rto_timeout_us(&session->rto);
+    }
+    case MASTER_STATE_SEND_TRAILER: // file info again, with the CRC32 computed during the transfer
+        crc_advance(session, binaryinfo.size);
+        binaryinfo.crc32 = session->crc;
+        note_request_sent(session->state, 0);
+        Write_Info_to_Slave(Slave_ID, UART_HEADER_FRAME, (uint8_t *)&binaryinfo, sizeof(binaryinfo));
+        return command_timeout_us;
+    case MASTER_STATE_VERIFY_FILE: // ask slave to check CRC32 , File size , File ELF Header
+        note_request_sent(session->state, 0);
+        Write_Command_to_Slave(Slave_ID, UART_CMD_VERIFY_FILE_PARAMS);
+        return command_timeout_us + verify_hash_us(session);
+    case MASTER_STATE_END_SESSION: // Ask Slave to end & exit from Bootloader App
+        Write_Command_to_Slave(Slave_ID, UART_CMD_END_SESSION);
+        /*here, There is no point in waiting for a response from the Slave;
+         his response may be subject to noise.*/
+        session->state = MASTER_STATE_DONE;
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+static void set_link_baud(MASTER_SESSION *session, uint32_t baud)
+{
+    if (setBaudRate(baud) <= 0)
+        LOG_ERROR("Error setting %u bps", baud);
+    session->baudrate = baud;
+    usleep(LINK_SETTLE_US);
+    event_loop_flush();
+}
+
+// Test the fastest rate both sides support and not tried yet, or start the transfer
+static void link_next(MASTER_SESSION *session)
+{
+    session->state = MASTER_STATE_SEND_CHUNKS;
+    if (!session->link_candidates || session->link_tries >= LINK_CANDIDATES)
+        return;
+    PROTOCOL_CAPS candidates = {.bauds = session->link_candidates};
+    session->link_target = caps_best_baud(&candidates);
+    session->link_candidates &= ~caps_baud_bit(session->link_target);
+    session->link_tries++;
+    session->link_attempts = 0;
+    session->probe_seq = 0;
+    session->state = MASTER_STATE_LINK_SWITCH;
+}
+
+// The new rate failed : back to the start rate, once the slave is surely there too
+static void link_failed(MASTER_SESSION *session, bool slave_switched)
+{
+    LOG_WARNING("Link test at %u bps failed, back to %u bps", session->link_target, session->start_baud);
+    // a rate just below a failing one usually fails too : next try at half the rate or less
+    for (int i = 0; i < CAPS_BAUD_RATE_COUNT; i++)
+        if (caps_baud_rate(i) > session->link_target / 2)
+            session->link_candidates &= ~(1UL << i);
+    if (session->baudrate != session->start_baud)
+        set_link_baud(session, session->start_baud);
+    if (slave_switched)
+    {
+        usleep((LINK_IDLE_REVERT_MS + LINK_REVERT_GUARD_MS) * 1000);
+        event_loop_flush();
+    }
+    link_next(session);
+}
+
+// The slave stored every chunk before next
+static void chunks_acked(MASTER_SESSION *session, uint16_t next)
+{
+    uint64_t acked = (uint64_t)next * session->chunk_payload;
+    uint32_t bytes_sent = (acked < binaryinfo.size) ? acked : binaryinfo.size;
+    if (next - session->chunk_idx == 1)
+        LOG_INFO("Send Chunk[%d]", session->chunk_idx);
+    else
+        LOG_INFO("Send Chunks[%d..%d]", session->chunk_idx, next - 1);
+    metrics_add(METRIC_CHUNKS, next - session->chunk_idx);
+    metrics_add(METRIC_PAYLOAD_BYTES, bytes_sent - session->bytes_sent);
+    session->chunk_idx = next;
+    session->bytes_sent = bytes_sent;
+    if (session->chunk_idx >= chunk_count(session))
+        session->state = session->trailer ? MASTER_STATE_SEND_TRAILER : MASTER_STATE_VERIFY_FILE;
+}
+
+// A driver lost bytes during the last window (either side) : smaller chunks first, then a slower rate
+static void error_backoff(MASTER_SESSION *session, uint32_t errors)
+{
+    if (session->sizer.target > BACKOFF_MIN_CHUNK_PAYLOAD && chunk_sizer_loss(&session->sizer))
+    {
+        LOG_WARNING("%u UART receive errors, chunk size lowered to %u", errors, session->sizer.target);
+        return;
+    }
+    // half the rate or less, as after a failed link test
+    uint32_t slower = 0;
+    if (session->caps.protocol_version >= 2) // 3 step setup : the slave may not know UART_LINK_FRAME
+        for (int i = 0; i < CAPS_BAUD_RATE_COUNT; i++)
+            if ((session->caps.bauds & (1UL << i)) && caps_baud_rate(i) <= session->baudrate / 2)
+                slower |= 1UL << i;
+    if (!slower)
+        return;
+    LOG_WARNING("%u UART receive errors at %u bps, moving to a slower rate", errors, session->baudrate);
+    session->link_candidates = slower;
+    session->link_tries = 0;
+    link_next(session);
+}
+
+/* The response of the slave is in uart_buf, returns -1 to abort the session,
+   0 if it is a late answer to an earlier request (the answer to this one is still awaited) */
+static int on_response(MASTER_SESSION *session)
+{
+    UARTFrame *Uart_Buf = (UARTFrame *)uart_buf;
+    // command answers are a single byte : a late STREAM_ACK of a retransmitted chunk is not one
+    if (session->state != MASTER_STATE_OPEN_SESSION && session->state != MASTER_STATE_SEND_CHUNKS &&
+        session->state != MASTER_STATE_CACHE_QUERY && session->state != MASTER_STATE_REPAIR_SEARCH &&
+        session->state != MASTER_STATE_REPAIR_CHUNKS && Uart_Buf->len != 1)
+        return 0;
+    switch (session->state)
+    {
+    case MASTER_STATE_OPEN_SESSION:
+    {
+        SESSION_OPEN_RESPONSE resp;
+        if (Uart_Buf->type != UART_SESSION_FRAME || Uart_Buf->len < sizeof(resp))
+            break;
+        memcpy(&resp, &Uart_Buf->data, sizeof(resp));
+        if (resp.bl_status != UART_RESPOND_ACK)
+            break;
+        LOG_INFO("Session open: bootloader %u.%u , space %s , protocol v%u , chunk %u , window %u , framing %s", resp.bl_version >> 4, resp.bl_version & 0x0F,
+                 (resp.space == UART_RESPOND_ACK ? "ACK" : "NACK"), resp.caps.protocol_version, resp.chunk_payload, resp.caps.window,
+                 (FRAMING_COBS && (resp.caps.codecs & CAP_CODEC_COBS)) ? "COBS" : "SOF");
+        if (!resp.chunk_payload)
+        {
+            LOG_WARNING("No common configuration with the slave, falling back to the 3 step setup");
+            session->state = MASTER_STATE_ENTER_BOOTLOADER;
+            break;
+        }
+        if (session->patching && !(resp.caps.codecs & CAP_CODEC_PATCH))
+        {
+            LOG_WARNING("Slave cannot apply the patch (other current file or older slave), sending the whole file");
+            patch_fallback(session);
+            session->open_attempts = 0;
+            break; // open again for the file itself
+        }
+        session->caps = resp.caps;
+        session->chunk_payload = chunk_payload_floor(resp.chunk_payload);
+        chunk_sizer_init(&session->sizer, resp.caps.chunk_classes, session->chunk_payload, binaryinfo.size);
+        if (!session->sizer.target)
+        {
+            LOG_ERROR("File of %u bytes is more than %u chunks at every chunk size agreed, the chunk index is 16 bit", binaryinfo.size, UINT16_MAX);
+            return -1;
+        }
+        session->chunk_payload = chunk_sizer_payload(&session->sizer, 0);
+        session->window = resp.caps.window ? resp.caps.window : 1;
+        frame_tx_cobs(FRAMING_COBS && (resp.caps.codecs & CAP_CODEC_COBS));
+        session->chunk_idx = 0;
+        session->bytes_sent = 0;
+        session->cache_query.count = 0;
+        if (resp.space != UART_RESPOND_ACK)
+        {
+            session->state = MASTER_STATE_NO_SPACE;
+            break;
+        }
+        // faster rates both sides support (a calibration session of -T starts at the rate of the previous one)
+        session->link_candidates = resp.caps.bauds;
+        for (int i = 0; i < CAPS_BAUD_RATE_COUNT; i++)
+            if (caps_baud_rate(i) <= session->baudrate)
+                session->link_candidates &= ~(1UL << i);
+        link_next(session);
+        break;
+    }
+    case MASTER_STATE_LINK_SWITCH:
+        if (Uart_Buf->data != UART_RESPOND_ACK)
+        {
+            link_failed(session, false);
+            break;
+        }
+        set_link_baud(session, session->link_target);
+        session->state = MASTER_STATE_LINK_PROBE;
+        break;
+    case MASTER_STATE_LINK_PROBE:
+        if (Uart_Buf->data != UART_RESPOND_ACK)
+            link_failed(session, true);
+        else if (++session->probe_seq >= LINK_PROBE_FRAMES)
+        {
+            session->link_attempts = 0;
+            session->state = MASTER_STATE_LINK_COMMIT;
+        }
+        break;
+    case MASTER_STATE_LINK_COMMIT:
+        if (Uart_Buf->data != UART_RESPOND_ACK)
+        {
+            link_failed(session, true);
+            break;
+        }
+        LOG_INFO("Link at %u bps (driver: %u bps)", session->baudrate, getBaudRate());
+        session->state = MASTER_STATE_SEND_CHUNKS;
+        break;
+    case MASTER_STATE_ENTER_BOOTLOADER:
+        LOG_INFO("Slave in Bootloader Mode");
+        if (Uart_Buf->data != UART_RESPOND_ACK)
+            break;
+        // 3 step setup : LEGACY_CHUNK_PAYLOAD chunks, the 16 bit chunk index has to reach the last one
+        if ((binaryinfo.size + LEGACY_CHUNK_PAYLOAD - 1ULL) / LEGACY_CHUNK_PAYLOAD > UINT16_MAX)
+        {
+            LOG_ERROR("File of %u bytes is more than %u chunks of %u bytes, too large for the 3 step setup", binaryinfo.size,
+                      UINT16_MAX, LEGACY_CHUNK_PAYLOAD);
+            return -1;
+        }
+        session->state = MASTER_STATE_SEND_FILE_INFO;
+        break;
+    case MASTER_STATE_SEND_FILE_INFO:
+        if (Uart_Buf->data == UART_RESPOND_ACK)
+            session->state = MASTER_STATE_CHECK_SPACE;
+        LOG_INFO("Send file info: size %u , crc32 %08X", binaryinfo.size, binaryinfo.crc32);
+        break;
+    case MASTER_STATE_SEND_TRAILER:
+        if (Uart_Buf->data == UART_RESPOND_ACK)
+            session->state = MASTER_STATE_VERIFY_FILE;
+        LOG_INFO("Send file trailer: size %u , crc32 %08X", binaryinfo.size, binaryinfo.crc32);
+        break;
+    case MASTER_STATE_CHECK_SPACE:
+        caps_local(&session->caps, LEGACY_CHUNK_PAYLOAD);
+        chunk_sizer_init(&session->sizer, session->caps.chunk_classes, LEGACY_CHUNK_PAYLOAD, binaryinfo.size);
+        if (!session->sizer.target)
+        {
+            LOG_ERROR("File of %u bytes is more than %u chunks at every chunk size agreed, the chunk index is 16 bit", binaryinfo.size, UINT16_MAX);
+            return -1;
+        }
+        session->chunk_payload = chunk_sizer_payload(&session->sizer, 0);
+        session->caps.protocol_version = 1;
+        session->window = 1;
+        session->chunk_idx = 0;
+        session->bytes_sent = 0;
+        if (Uart_Buf->data == UART_RESPOND_ACK)
+            session->state = MASTER_STATE_SEND_CHUNKS;
+        else
+            session->state = MASTER_STATE_NO_SPACE; // Unavailable space enough for the binary file !!!
+        break;
+    case MASTER_STATE_SEND_CHUNKS:
+    {
+        uint32_t errors = uart_errors_poll();
+        uint16_t next = session->chunk_idx; // first chunk not acknowledged
+        if (session->caps.protocol_version >= 2)
+        {
+            STREAM_ACK ack;
+            if (Uart_Buf->len < sizeof(ack)) // late answer to a command
+                return 0;
+            memcpy(&ack, &Uart_Buf->data, sizeof(ack));
+            // answer to an earlier burst (sent again after a timeout). The slave may be past the burst :
+            // it stored a burst of larger chunks whose answer was lost
+            if (ack.checkpoint != session->chunk_idx + session->burst - 1 || ack.next_expected < session->chunk_idx)
+                return 0;
+            if (ack.status != UART_RESPOND_ACK)
+                LOG_WARNING("Slave could not store Chunk[%d]", ack.next_expected);
+            metrics_add(METRIC_PEER_UART_ERRORS, ack.rx_errors);
+            errors += ack.rx_errors;
+            next = ack.next_expected; // go-back-N : the chunks after it are sent again
+            // a reference the slave could not resolve (block replaced since the query, or the frame was lost) : data next time
+            if (next < session->chunk_idx + session->burst && cache_held(session, next))
+                session->cache_have &= ~(1ULL << (next - session->cache_query.first_idx));
+            metrics_add(METRIC_FEC_RECOVERED, ack.recovered);
+            if (!session->fill)
+                fec_loss_sample(session, ack.lost, session->burst);
+            // a retransmitted burst already counted its loss at the timeout
+            if (next < session->chunk_idx + session->burst && !session->retransmit)
+                chunk_sizer_loss(&session->sizer);
+            else if (next >= session->chunk_idx + session->burst)
+                chunk_sizer_ack(&session->sizer, session->burst);
+        }
+        else if (Uart_Buf->data == UART_RESPOND_ACK)
+        {
+            next = session->chunk_idx + 1; // 3 step setup : the ACK is taken for the chunk in flight
+            chunk_sizer_ack(&session->sizer, 1);
+        }
+        if (next > session->chunk_idx)
+        {
+            // Karn : the ACK of a retransmitted chunk is ambiguous. A fill measures the slave's writes, not the link
+            if (!session->retransmit && !session->fill)
+                rto_sample(&session->rto, monotonic_us() - session->sent_us);
+            else
+                rto_ack(&session->rto); // but it proves the link is alive : keep the backoff for consecutive losses
+            chunks_acked(session, next);
+        }
+        if (errors && session->state == MASTER_STATE_SEND_CHUNKS)
+            error_backoff(session, errors);
+        break;
+    }
+    case MASTER_STATE_CACHE_QUERY:
+    {
+        CACHE_ANSWER answer;
+        const CACHE_QUERY *query = &session->cache_query;
+        if (Uart_Buf->type != UART_CACHE_FRAME || Uart_Buf->len < sizeof(answer))
+            return 0;
+        memcpy(&answer, &Uart_Buf->data, sizeof(answer));
+        if (answer.ChLen != query->ChLen || answer.first_idx != query->first_idx || answer.count != query->count)
+            return 0; // answer to an earlier query
+        session->cache_have = answer.have;
+        if (answer.have)
+            LOG_INFO("Chunks[%u..%u] : %d in the slave's block cache", query->first_idx, query->first_idx + query->count - 1,
+                     __builtin_popcountll(answer.have));
+        session->state = MASTER_STATE_SEND_CHUNKS;
+        break;
+    }
+    case MASTER_STATE_REPAIR_SEARCH:
+    {
+        HASH_ANSWER answer;
+        const HASH_QUERY *query = &session->hash_query;
+        if (Uart_Buf->type != UART_HASH_FRAME || Uart_Buf->len != sizeof(answer.query) + query->count * SHA256_DIGEST_SIZE)
+            return 0;
+        memcpy(&answer, &Uart_Buf->data, Uart_Buf->len);
+        if (memcmp(&answer.query, query, sizeof(*query)) != 0)
+            return 0; // answer to an earlier query
+        session->repair_depth--;
+        for (uint8_t i = 0; i < query->count; i++)
+        {
+            uint32_t idx = query->first + i;
+            if (memcmp(hash_tree_node(&session->tree, query->level, idx), answer.hashes[i], SHA256_DIGEST_SIZE) == 0)
+                continue;
+            if (query->level == 0 || session->repair_depth >= REPAIR_STACK_SIZE)
+                repair_mark_node(session, query->level, idx);
+            else
+                session->repair_stack[session->repair_depth++] = (REPAIR_NODE){.level = query->level, .idx = idx};
+        }
+        if (session->repair_depth)
+            break;
+        uint32_t bad = 0;
+        for (uint32_t idx = 0; idx < chunk_count(session); idx++)
+            bad += repair_is_bad(session, idx);
+        if (!bad)
+        {
+            LOG_ERROR("Verify failed but every chunk matches on the slave");
+            return -1;
+        }
+        LOG_WARNING("%u chunks differ on the slave, sending them again", bad);
+        session->repair_idx = 0;
+        session->state = MASTER_STATE_REPAIR_CHUNKS;
+        break;
+    }
+    case MASTER_STATE_REPAIR_CHUNKS:
+    {
+        STREAM_ACK ack;
+        if (Uart_Buf->len < sizeof(ack))
+            return 0;
+        memcpy(&ack, &Uart_Buf->data, sizeof(ack));
+        if (ack.checkpoint != session->repair_idx + session->burst - 1)
+            return 0;
+        if (ack.status != UART_RESPOND_ACK)
+        {
+            LOG_WARNING("Slave could not store Chunks[%u..%u]", session->repair_idx, ack.checkpoint);
+            break; // sent again
+        }
+        if (!session->retransmit)
+            rto_sample(&session->rto, monotonic_us() - session->sent_us);
+        LOG_INFO("Repaired Chunks[%u..%u]", session->repair_idx, ack.checkpoint);
+        metrics_add(METRIC_REPAIRED_CHUNKS, session->burst);
+        repair_mark(session, session->repair_idx, session->burst, false);
+        session->repair_idx += session->burst;
+        if (repair_next(session, session->repair_idx) >= chunk_count(session))
+            session->state = MASTER_STATE_VERIFY_FILE;
+        break;
+    }
+    case MASTER_STATE_VERIFY_FILE:
+        if (Uart_Buf->data == UART_RESPOND_ACK)
+            session->state = MASTER_STATE_END_SESSION;
+        else if (!repair_start(session))
+        {
+            LOG_INFO("Faild File updated , unmatched CRC32 and Length");
+            return -1;
+        }
+        break;
+    default:
+        break;
+    }
+    return 1;
+}
+
+// No response before the deadline : the request is sent again
+static void on_timeout(MASTER_SESSION *session)
+{
+    if (session->state == MASTER_STATE_REPAIR_CHUNKS)
+        rto_backoff(&session->rto);
+    if (session->state == MASTER_STATE_SEND_CHUNKS)
+    {
+        rto_backoff(&session->rto);
+        fec_loss_sample(session, 1, session->burst + session->parity); // at least the checkpoint frame or its answer
+        chunk_sizer_loss(&session->sizer);
+    }
+    if (session->state == MASTER_STATE_LINK_PROBE ||
+        ((session->state == MASTER_STATE_LINK_SWITCH || session->state == MASTER_STATE_LINK_COMMIT) && ++session->link_attempts >= LINK_ATTEMPTS))
+    {
+        link_failed(session, true);
+        return;
+    }
+    // The faster rate stopped working : the slave goes back to the start rate after LINK_IDLE_REVERT_MS
+    if (session->baudrate != session->start_baud && session->state != MASTER_STATE_LINK_SWITCH &&
+        monotonic_us() - session->last_response_us > (LINK_IDLE_REVERT_MS + LINK_REVERT_GUARD_MS) * 1000ULL)
+    {
+        LOG_WARNING("No answer at %u bps, back to %u bps", session->baudrate, session->start_baud);
+        set_link_baud(session, session->start_baud);
+        rto_init(&session->rto, UART_TIMEOUT_MICROSECONDS);
+    }
+    if (session->state == MASTER_STATE_OPEN_SESSION && ++session->open_attempts >= SESSION_OPEN_ATTEMPTS)
+    {
+        LOG_WARNING("No answer to the session open request, falling back to the 3 step setup");
+        session->state = MASTER_STATE_ENTER_BOOTLOADER;
+        if (session->patching)
+            patch_fallback(session);
+    }
+}
+
+/* Run the state machine until the session ends : 1 file verified, 0 no space on the slave, -1 verify failed.
+   calibration (-T) : stop once the file is verified, without ending the session, -1 if not done within limit_us */
+static int run_session(MASTER_SESSION *session, bool calibration, uint64_t limit_us)
+{
+    uint64_t start_us = monotonic_us();
+    while (!quitApp)
+    {
+        metrics_enter_phase(session->state);
+        metrics_poll();
+        if (session->state == MASTER_STATE_DONE || (calibration && session->state == MASTER_STATE_END_SESSION))
+            return 1;
+        if (session->state == MASTER_STATE_NO_SPACE)
+            return 0;
+        if (limit_us && monotonic_us() - start_us > limit_us)
+            return -1;
+        if (session->state == MASTER_STATE_SEND_CHUNKS && !session->chunks_start_us)
+            session->chunks_start_us = monotonic_us();
+        uint64_t timeout_us = send_request(session);
+        if (!timeout_us) // no response expected
+            continue;
+        event_loop_set_timeout_us(timeout_us);
+        uint64_t deadline_us = monotonic_us() + timeout_us;
+        int ret, verdict = 1;
+        while ((ret = event_loop_wait()) > 0)
+        {
+            session->last_response_us = monotonic_us();
+            verdict = on_response(session);
+            uint64_t now_us = monotonic_us();
+            if (verdict != 0 || now_us >= deadline_us)
+                break;
+            // late answer to an earlier request : keep waiting for the answer to this one
+            event_loop_set_timeout_us(deadline_us - now_us);
+        }
+        if (verdict < 0)
+            return -1;
+        if (ret == 0 || (ret > 0 && verdict == 0))
+            on_timeout(session);
+        // ret < 0 : rejected frame, the request is sent again
+    }
+    return -1;
+}
+
+/* One calibration transfer of the file of base with the settings of trial, the slave stays in bootloader mode.
+   Returns the goodput (bytes per second of the chunk phase, 0 if the transfer failed), rto_us gets the ACK timeout reached */
+static uint32_t tune_run(MASTER_SESSION *base, const TUNING_PROFILE *trial, uint64_t *rto_us)
+{
+    MASTER_SESSION session = *base;
+    session.max_chunk = trial->chunk_payload;
+    session.max_window = trial->window;
+    session.cache = false; // the calibration file would come from the slave's cache after the first run
+    rto_init(&session.rto, UART_TIMEOUT_MICROSECONDS);
+    frame_tx_guard_us(trial->guard_us);
+    int ret = run_session(&session, true, TUNE_RUN_TIMEOUT_MS * 1000ULL);
+    free(session.repair_bad);
+    hash_tree_free(&session.tree);
+    base->baudrate = session.baudrate; // the first session moved the link to the fastest rate, the next ones start there
+    uint64_t elapsed_us = monotonic_us() - session.chunks_start_us;
+    if (ret <= 0 || !session.chunks_start_us || !elapsed_us)
+        return 0;
+    *rto_us = rto_timeout_us(&session.rto);
+    return (uint64_t)binaryinfo.size * 1000000ULL / elapsed_us;
+}
+
+// Measure trial (the best of TUNE_RUNS transfers), it replaces best if faster
+static void tune_try(MASTER_SESSION *base, TUNING_PROFILE *trial, TUNING_PROFILE *best)
+{
+    trial->goodput = 0;
+    for (int run = 0; run < TUNE_RUNS && !quitApp; run++)
+    {
+        uint64_t rto_us = trial->rto_us;
+        uint32_t goodput = tune_run(base, trial, &rto_us);
+        if (goodput > trial->goodput)
+        {
+            trial->goodput = goodput;
+            trial->rto_us = rto_us;
+        }
+    }
+    LOG_INFO("Tune: chunk %u , window %u , guard %uus : %u B/s", trial->chunk_payload, trial->window, trial->guard_us, trial->goodput);
+    if (trial->goodput > best->goodput)
+        *best = *trial;
+}
+
+/* -T : search the chunk size, then the window (with -f / -e), then the TX guard, each search keeps the fastest value
+   of the previous ones. Returns 1 if a setting worked, best gets it */
+static int tune(MASTER_SESSION *base, TUNING_PROFILE *best)
+{
+    static const uint16_t chunks[] = {4096, 2048, 1024, 512};
+    static const uint8_t windows[] = {STREAM_WINDOW, STREAM_WINDOW / 2, STREAM_WINDOW / 4, 1};
+    static const uint32_t guards_us[] = {TX_GUARD_US, TX_GUARD_US / 3, 0};
+    *best = (TUNING_PROFILE){.chunk_payload = base->max_chunk, .window = base->max_window, .guard_us = TX_GUARD_US,
+                             .rto_us = UART_TIMEOUT_MICROSECONDS};
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        TUNING_PROFILE trial = *best;
+        trial.chunk_payload = chunks[i];
+        tune_try(base, &trial, best);
+    }
+    for (size_t i = 0; (base->flow_control || base->fec) && i < sizeof(windows) / sizeof(windows[0]); i++)
+    {
+        TUNING_PROFILE trial = *best;
+        trial.window = windows[i];
+        tune_try(base, &trial, best);
+    }
+    for (size_t i = 0; i < sizeof(guards_us) / sizeof(guards_us[0]); i++)
+    {
+        TUNING_PROFILE trial = *best;
+        trial.guard_us = guards_us[i];
+        tune_try(base, &trial, best);
+    }
+    frame_tx_guard_us(best->guard_us);
+    return best->goodput ? 1 : -1;
+}
+
+// Calibration file of -T : pseudo-random bytes, neither COBS nor FEC get an easy case
+static char *tune_payload(size_t size)
+{
+    char *buf = malloc(size);
+    uint32_t x = 0x2545F491;
+    for (size_t i = 0; buf && i < size; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = (char)x;
+    }
+    return buf;
+}
+
+static void free_file_contents(char *contents, size_t size, bool mapped)
+{
+    if (mapped)
+        unmap_binary_file(contents, size);
+    else
+        free(contents);
+}
+
+static void usage(const char *app)
+{
+    printf("Usage: %s [-m <metrics_file>] [-t <trace_file>] [-c <capture_file>] [-b <max_baudrate>] [-r <before_ms>,<after_ms>] [-f] [-e] [-P <profile_file>] [-p <base_file>] <filename> <UART_port> <UART_baudrate>\n", app);
+    printf("       %s -T [options] <UART_port> <UART_baudrate>\n", app);
+    printf("  -m <metrics_file> : export transfer metrics (JSON, Prometheus textfile if it ends with .prom)\n");
+    printf("  -t <trace_file>   : record frame level spans as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)\n");
+    printf("  -c <capture_file> : record every byte sent and received with timestamps (decode / replay with uartcap)\n");
+    printf("  -b <max_baudrate> : highest rate to switch to after the handshake (default 6000000, UART_baudrate : no switch)\n");
+    printf("  -r <before_ms>,<after_ms> : RS-485, the driver drives RTS with these delays around each frame (TIOCSRS485)\n");
+    printf("  -f : RTS/CTS flow control, chunks are streamed with an ACK every %u chunks (if the slave runs with -f too)\n", STREAM_WINDOW);
+    printf("  -e : forward error correction, chunks are streamed with parity frames sized on the loss rate (if the slave runs with -e too)\n");
+    printf("  -T : tune, send a %u byte calibration file with each chunk size / window / TX guard and save the fastest settings\n", TUNE_PAYLOAD_BYTES);
+    printf("       of this adapter and rate in the profile file, later transfers on it start with them\n");
+    printf("  -P <profile_file> : tuning profiles (default %s)\n", PROFILE_FILE);
+    printf("  -p <base_file> : send a binary patch from base_file, the file the slave holds now (the whole file if it holds another one)\n");
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 4)
+    const char *metrics_file = NULL;
+    const char *trace_file = NULL;
+    const char *capture_file = NULL;
+    const char *profile_file = PROFILE_FILE;
+    const char *base_file = NULL;
+    int opt;
+    uint32_t max_baudrate = 6000000;
+    bool rs485 = false;
+    bool flow_control = false;
+    bool fec = false;
+    bool tuning = false;
+    unsigned int rs485_before_ms = 0, rs485_after_ms = 0;
+    while ((opt = getopt(argc, argv, "m:t:c:b:r:feTP:p:")) != -1)
     {
-        printf("Usage: %s <filename> <UART_port> <UART_baudrate>\n", argv[0]);
+        switch (opt)
+        {
+        case 'm':
+            metrics_file = optarg;
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'c':
+            capture_file = optarg;
+            break;
+        case 'b':
+            max_baudrate = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%u,%u", &rs485_before_ms, &rs485_after_ms) != 2)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            rs485 = true;
+            break;
+        case 'f':
+            flow_control = true;
+            break;
+        case 'e':
+            fec = true;
+            break;
+        case 'T':
+            tuning = true;
+            break;
+        case 'P':
+            profile_file = optarg;
+            break;
+        case 'p':
+            base_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < (tuning ? 2 : 3))
+    {
+        usage(argv[0]);
         return 1;
     }
-    // argv[1] is the filename
-    const char *binaryfilename = argv[1];
+    // 1st positional argument is the filename (none with -T)
+    const char *binaryfilename = tuning ? NULL : argv[optind++];
 
-    // argv[2] is the UART port
-    const char *uart_port = argv[2];
+    // 2nd positional argument is the UART port
+    const char *uart_port = argv[optind];
 
-    // argv[3] is the UART baud rate
-    int uart_baudrate = atoi(argv[3]);
+    // 3rd positional argument is the UART baud rate
+    int uart_baudrate = atoi(argv[optind + 1]);
+    if (uart_baudrate <= 0)
+    {
+        LOG_ERROR("Invalid UART baudrate %s", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
 
     log_set_level(INFO_LOG_LEVEL);
+    metrics_init("master", MASTER_STATE_NAMES, MASTER_STATE_COUNT);
+    if (metrics_file)
+        metrics_set_export_path(metrics_file);
+    if (trace_file)
+        trace_open(trace_file, "master");
+    if (capture_file)
+        capture_open(capture_file, CAPTURE_ROLE_MASTER);
     /* 1. Open Serial Port */
     int ret = (int)openDevice(uart_port, uart_baudrate);
     if (ret <= 0)
@@ -54,124 +1208,176 @@ int main(int argc, char *argv[])
         LOG_ERROR("failed to open serial port");
         return EXIT_FAILURE;
     }
+    if (rs485 && setRS485(true, rs485_before_ms, rs485_after_ms) <= 0)
+    {
+        LOG_ERROR("%s does not support kernel RS-485 mode", uart_port);
+        return EXIT_FAILURE;
+    }
+    if (flow_control && setFlowControl(true) <= 0)
+    {
+        LOG_ERROR("Error enabling RTS/CTS flow control");
+        return EXIT_FAILURE;
+    }
+    uart_errors_poll();
 
     /* 2. Set WatchDog timer */
     /* ... */
     /* 3. Open the binary file , calculate its CRC32 and length*/
 
     size_t size_ = 0;
-    char *file_contents = read_binary_file(binaryfilename, &size_);
+    bool mapped = false; // the file pages are read as the chunks go out
+    char *file_contents = NULL;
+    if (tuning)
+        file_contents = tune_payload(size_ = TUNE_PAYLOAD_BYTES);
+    else if ((file_contents = map_binary_file(binaryfilename, &size_)) != NULL)
+        mapped = true;
+    else
+        file_contents = read_binary_file(binaryfilename, &size_);
     if (!file_contents)
     {
         LOG_ERROR("Error reading binary file");
         return EXIT_FAILURE;
     }
     binaryinfo.size = size_;
-    binaryinfo.crc32 = crc_32((uint8_t *)file_contents, size_);
+    // TRAILER_CRC : the CRC32 follows the chunks, the session opens without reading the file first
+    bool trailer = TRAILER_CRC && !(base_file && !tuning);
+    binaryinfo.crc32 = trailer ? 0 : crc_32((uint8_t *)file_contents, size_);
+
+    // -p : patch from the file the slave holds, sent instead of the file when smaller
+    uint8_t *patch_contents = NULL;
+    PATCH_INFO patch = {.target = binaryinfo};
+    if (base_file && !tuning)
+    {
+        size_t base_size = 0;
+        char *base_contents = read_binary_file(base_file, &base_size);
+        uint32_t patch_size = 0;
+        uint64_t start_us = monotonic_us();
+        if (base_contents)
+        {
+            patch.base.size = base_size;
+            patch.base.crc32 = crc_32((uint8_t *)base_contents, base_size);
+            patch_contents = bsdiff_create((uint8_t *)base_contents, base_size, (uint8_t *)file_contents, size_, &patch_size);
+            free(base_contents);
+        }
+        if (!patch_contents)
+            LOG_ERROR("Error reading base file %s, sending the whole file", base_file);
+        else if (patch_size >= size_)
+        {
+            LOG_INFO("Patch from %s is not smaller than the file (%u bytes), sending the whole file", base_file, patch_size);
+            free(patch_contents);
+            patch_contents = NULL;
+        }
+        else
+        {
+            LOG_INFO("Patch from %s : %u bytes for %u (%llu ms)", base_file, patch_size, (unsigned int)size_,
+                     (unsigned long long)(monotonic_us() - start_us) / 1000);
+            binaryinfo.size = patch_size;
+            binaryinfo.crc32 = crc_32(patch_contents, patch_size);
+        }
+    }
+
+    MASTER_SESSION session = {
+        .state = MASTER_STATE_OPEN_SESSION,
+        .slave_id = SLAVE_ID_01,
+        .file_contents = patch_contents ? (const char *)patch_contents : file_contents,
+        .target_contents = file_contents,
+        .target = patch.target,
+        .patch = patch,
+        .patching = patch_contents != NULL,
+        .trailer = trailer,
+        .baudrate = uart_baudrate,
+        .start_baud = uart_baudrate,
+        .max_baud = max_baudrate,
+        .flow_control = flow_control,
+        .fec = fec,
+        .max_chunk = CHUNK_MAX_PLD_LENGTH_XXXX,
+        .max_window = (flow_control || fec) ? STREAM_WINDOW : 1,
+        .cache = BLOCK_CACHE_REFS,
+        .window = 1};
+    uint64_t initial_rto_us = UART_TIMEOUT_MICROSECONDS;
+
+    // settings found by an earlier -T run on this adapter at this rate
+    char profile_key[PROFILE_KEY_SIZE];
+    profile_port_key(uart_port, profile_key, sizeof(profile_key));
+    TUNING_PROFILE profile;
+    if (!tuning && profile_load(profile_file, profile_key, uart_baudrate, &profile) > 0)
+    {
+        LOG_INFO("Tuning profile of %s: chunk %u , window %u , guard %uus , rto %lluus", profile_key, profile.chunk_payload,
+                 profile.window, profile.guard_us, (unsigned long long)profile.rto_us);
+        session.max_chunk = profile.chunk_payload;
+        if (profile.window < session.max_window)
+            session.max_window = profile.window;
+        frame_tx_guard_us(profile.guard_us);
+        initial_rto_us = profile.rto_us;
+    }
     printf("-----------------------------------\n");
-    printf("File : \"%s\"\n", binaryfilename);
+    if (tuning)
+        printf("Tuning : \"%s\"\n", profile_key);
+    else
+        printf("File : \"%s\"\n", binaryfilename);
     printf("UART port: %s\n", uart_port);
-    printf("UART Baudrate: %d bps\n", uart_baudrate);
-    printf("Transmiting speed: %d Byte per Chunk\n", decode_chunk_payload_max_size(encode_chunk_payload_max_size(CHUNK_MAX_PLD_LENGTH_XXXX)));
-    printf("File parms: crc32:%08X , size : %dB\n", binaryinfo.crc32, binaryinfo.size);
+    printf("UART Baudrate: %d bps (driver: %u bps)\n", uart_baudrate, getBaudRate());
+    printf("Transmiting speed: %d Byte per Chunk\n", decode_chunk_payload_max_size(encode_chunk_payload_max_size(session.max_chunk)));
+    if (session.trailer)
+        printf("File parms: crc32: after the chunks , size : %dB\n", session.target.size);
+    else
+        printf("File parms: crc32:%08X , size : %dB\n", session.target.crc32, session.target.size);
+    if (session.patching)
+        printf("Patch from \"%s\": crc32:%08X , size : %dB\n", base_file, binaryinfo.crc32, binaryinfo.size);
     printf("-----------------------------------\n\n");
 
-    /* 4. Start While loop */
-    static uint8_t updateState = 0;
-    uint8_t Slave_ID = SLAVE_ID_01;
-    UARTFrame *Uart_Buf = (UARTFrame *)uart_buf;
-    UARTChunk tempUARTChunk;
-    while (!quitApp)
+    /* 4. Start the event loop */
+    rto_init(&session.rto, initial_rto_us);
+    if (event_loop_open(serial_fd, session.slave_id) <= 0)
+    {
+        free_file_contents(file_contents, size_, mapped);
+        free(patch_contents);
+        return EXIT_FAILURE;
+    }
+    if (tuning)
     {
-        switch (updateState)
+        if (tune(&session, &profile) > 0)
+        {
+            LOG_INFO("Best for %s at %d bps: chunk %u , window %u , guard %uus , rto %lluus : %u B/s", profile_key, uart_baudrate,
+                     profile.chunk_payload, profile.window, profile.guard_us, (unsigned long long)profile.rto_us, profile.goodput);
+            if (profile_save(profile_file, profile_key, uart_baudrate, &profile) > 0)
+                LOG_INFO("Profile saved in %s", profile_file);
+        }
+        else
+            LOG_ERROR("No calibration transfer succeeded, no profile saved");
+        session.state = MASTER_STATE_END_SESSION; // the slave leaves bootloader mode
+        run_session(&session, false, 0);
+    }
+    else
+    {
+        ret = run_session(&session, false, 0);
+        if (ret > 0)
         {
-        case 0: // ask slave to enter bootloader App
-            Write_Command_to_Slave(Slave_ID, UART_CMD_ENTER_BOOTLOADER);
-            if (tryGetResquestFromSlave(Slave_ID) <= 0)
-                break;
-            if (Uart_Buf->data == UART_RESPOND_ACK)
-                updateState = 1;
-            LOG_INFO("Slave in Bootloader Mode");
-            break;
-            uint32_t bytes_sent = 0;
-        case 1: // send file info(size and crc32)
-            Write_Info_to_Slave(Slave_ID, UART_HEADER_FRAME, (uint8_t *)&binaryinfo, sizeof(binaryinfo));
-            if (tryGetResquestFromSlave(Slave_ID) <= 0)
-                break;
-            if (Uart_Buf->data == UART_RESPOND_ACK)
-                updateState = 2;
-            sprintf(msg_buf, "Send file info: size %d , crc32 %08X", binaryinfo.size, binaryinfo.crc32);
-            LOG_INFO(msg_buf);
-            break;
-        case 2: // Ask Slave to check space availabilty
-            Write_Command_to_Slave(Slave_ID, UART_CMD_CHECK_SPACE);
-            if (tryGetResquestFromSlave(Slave_ID) <= 0)
-                break;
-            tempUARTChunk.ChunkIdx = 0;
-            bytes_sent = 0;
-            if (Uart_Buf->data == UART_RESPOND_ACK)
-                updateState = 3;
-            else
-                updateState = 10; // Unavailable space enough for the binary file !!!
-            break;
-        case 3: // send file as chunks
-            tempUARTChunk.ChLen = encode_chunk_payload_max_size(CHUNK_MAX_PLD_LENGTH_XXXX);
-            uint16_t chunk_length = decode_chunk_payload_max_size(tempUARTChunk.ChLen);
-            uint16_t chunk_size = (bytes_sent + chunk_length <= binaryinfo.size) ? chunk_length : (binaryinfo.size - bytes_sent);
-            if (chunk_size > sizeof(tempUARTChunk.ChunkPayload))
-                LOG_ERROR("Buffer Overflow : Check your Code !!\n");
-            memcpy(tempUARTChunk.ChunkPayload, file_contents + bytes_sent, chunk_size);
-            uint16_t dataSize2Send = sizeof(tempUARTChunk.ChLen) + sizeof(tempUARTChunk.ChunkIdx) + chunk_size;
-            Write_Info_to_Slave(Slave_ID, UART_DATA_FRAME, (uint8_t *)&tempUARTChunk, dataSize2Send);
-            // Wait for Ack from the slave
-            if (tryGetResquestFromSlave(Slave_ID) <= 0)
-                break;
-            if (Uart_Buf->data != UART_RESPOND_ACK)
-                break;
-            sprintf(msg_buf, "Send Chunk[%d]", tempUARTChunk.ChunkIdx);
-            tempUARTChunk.ChunkIdx++;
-            bytes_sent += chunk_size;
-            LOG_INFO(msg_buf);
-            if (bytes_sent >= binaryinfo.size)
-                updateState = 4;
-            break;
-        case 4: // ask slave to check CRC32 , File size , File ELF Header
-            Write_Command_to_Slave(Slave_ID, UART_CMD_VERIFY_FILE_PARAMS);
-            if (tryGetResquestFromSlave(Slave_ID) <= 0)
-                break;
-            if (Uart_Buf->data == UART_RESPOND_ACK)
-                updateState = 5;
-            else
-            {
-                LOG_INFO("Faild File updated , unmatched CRC32 and Length");
-                goto end_while_loop;
-            }
-            break;
-        case 5: // Ask Slave to end & exit from Bootloader App
-            Write_Command_to_Slave(Slave_ID, UART_CMD_END_SESSION);
-            /*here, There is no point in waiting for a response from the Slave;
-             his response may be subject to noise.*/
-            updateState = 6;
-            break;
-        case 6: // ask slave to END the Session
             LOG_INFO("File updated successfully.");
             LOG_INFO("You can safely reboot the slave device.");
-
-            goto end_while_loop;
-            break;
-        case 10: // Slave device msg: :Unavilable enough space for binary file
+        }
+        else if (ret == 0)
+        {
             LOG_ERROR("Unavilable enough space for binary file !!!");
             // TODO process this case
-            // ...
-            goto end_while_loop;
-            break;
-        default:
-            break;
         }
-        usleep(50 * 1000); // 100msec sleep for some reason
     }
-end_while_loop:
-    free(file_contents);
-    LOG_INFO("--------------App Finished--------------")
+    uart_errors_poll();
+    LOG_INFO("UART errors: overrun %llu , buffer overrun %llu , framing %llu , parity %llu , break %llu , slave %llu",
+             (unsigned long long)metrics_get(METRIC_UART_OVERRUNS), (unsigned long long)metrics_get(METRIC_UART_BUF_OVERRUNS),
+             (unsigned long long)metrics_get(METRIC_UART_FRAME_ERRORS), (unsigned long long)metrics_get(METRIC_UART_PARITY_ERRORS),
+             (unsigned long long)metrics_get(METRIC_UART_BREAKS), (unsigned long long)metrics_get(METRIC_PEER_UART_ERRORS));
+    LOG_INFO("RTT: srtt %lluus , rttvar %lluus , rto %lluus", (unsigned long long)session.rto.srtt_us,
+             (unsigned long long)session.rto.rttvar_us, (unsigned long long)rto_timeout_us(&session.rto));
+    metrics_enter_phase(MASTER_STATE_DONE);
+    metrics_export();
+    event_loop_close();
+    trace_close();
+    capture_close();
+    free(session.repair_bad);
+    hash_tree_free(&session.tree);
+    free_file_contents(file_contents, size_, mapped);
+    free(patch_contents);
+    LOG_INFO("--------------App Finished--------------");
     return EXIT_SUCCESS;
 }
@@ -22,7 +22,49 @@ extern "C"
 
     // #define RS_485_ENABLE
 
-#define CHUNK_MAX_PLD_LENGTH_XXXX 1024 // Send chunks by 1024 bytes. from {128 , 256 , 512 , 1024}, else default :512
+#define CHUNK_MAX_PLD_LENGTH_XXXX 4096 // Largest chunk asked at session open. from {128 , 256 , 512 , 1024 , 2048 , 4096}, else default :512. The size adapts below it (chunk_sizer.h)
+#define LEGACY_CHUNK_PAYLOAD 1024      // Chunk size used with slaves without session open (3 step setup)
+#define BACKOFF_MIN_CHUNK_PAYLOAD 256  // driver receive errors halve the chunk size down to this, then lower the rate
+#define FRAMING_COBS 1                 // 1 : COBS framing after the session open when the slave supports it, 0 : SOF / length framing
+#define STREAM_WINDOW 16               // chunks streamed between two ACKs with RTS/CTS flow control (-f) or FEC (-e)
+#define FEC_PARITY_MARGIN 2            // FEC (-e) : parity frames per burst, this many times the chunks expected lost
+#define FILL_RUNS 1                    // 1 : runs of chunks holding a single byte value go as one UART_FILL_FRAME when the slave supports it
+#define FILL_MAX_BYTES (16UL << 20)    // file bytes covered by one UART_FILL_FRAME (the slave may write them)
+#define BLOCK_CACHE_REFS 1             // 1 : chunks the slave holds in its block cache go as references when it has one
+#define TRAILER_CRC 1                  // 1 : the CRC32 is computed while the chunks go out and sent after them (UART_HEADER_FRAME again), 0 : before the session
+#define REPAIR_ATTEMPTS 2              // failed verifies repaired (hash tree search, the chunks that differ sent again) before giving up
+#define REPAIR_HASH_KBPS 20000         // slowest hashing of the slave assumed (KB/s) : the wait for a VERIFY answer covers hashing the file once
+#define SESSION_OPEN_ATTEMPTS 3        // unanswered session opens before falling back to the 3 step setup (older slaves)
+#define LINK_CANDIDATES 3              // baud rates tried (fastest first) before staying at the start rate
+#define LINK_ATTEMPTS 3                // unanswered switch / commit requests before giving up a rate
+#define LINK_SETTLE_US 2000            // pause after changing the rate, lets the slave reprogram its UART
+#define LINK_REVERT_GUARD_MS 500       // extra wait so the slave is surely back at the start rate
+#define PROFILE_FILE "uart_profiles.txt" // tuning profiles written by -T, loaded at startup (profile.h)
+#define TUNE_PAYLOAD_BYTES 65536       // -T : calibration file sent with each setting tried
+#define TUNE_RUNS 2                    // -T : transfers per setting, the fastest counts
+#define TUNE_RUN_TIMEOUT_MS 20000      // -T : a calibration transfer not verified by then fails the setting
+
+    /* Master update state machine */
+    typedef enum
+    {
+        MASTER_STATE_ENTER_BOOTLOADER = 0, // ask slave to enter bootloader App
+        MASTER_STATE_SEND_FILE_INFO = 1,   // send file info(size and crc32)
+        MASTER_STATE_CHECK_SPACE = 2,      // Ask Slave to check space availabilty
+        MASTER_STATE_SEND_CHUNKS = 3,      // send file as chunks
+        MASTER_STATE_VERIFY_FILE = 4,      // ask slave to check CRC32 , File size , File ELF Header
+        MASTER_STATE_END_SESSION = 5,      // Ask Slave to end & exit from Bootloader App
+        MASTER_STATE_DONE = 6,             // Session ended
+        MASTER_STATE_OPEN_SESSION = 7,     // bootloader entry, file info and space check in one exchange
+        MASTER_STATE_LINK_SWITCH = 8,      // ask the slave to move to a faster baud rate
+        MASTER_STATE_LINK_PROBE = 9,       // test burst at the new rate
+        MASTER_STATE_NO_SPACE = 10,        // Slave device msg: :Unavilable enough space for binary file
+        MASTER_STATE_LINK_COMMIT = 11,     // keep the new rate
+        MASTER_STATE_CACHE_QUERY = 12,     // ask which chunks of the next bursts the slave holds in its block cache
+        MASTER_STATE_REPAIR_SEARCH = 13,   // failed verify : compare hash tree nodes with the slave's file
+        MASTER_STATE_REPAIR_CHUNKS = 14,   // send the chunks that differ again, then verify again
+        MASTER_STATE_SEND_TRAILER = 15,    // send the file info again with the CRC32 computed during the transfer
+        MASTER_STATE_COUNT
+    } MASTER_STATE;
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,128 @@
+/**
+ * @file profile.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-30
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include "../Slave/log.h"
+#include "profile.h"
+
+#define PROFILE_LINE_SIZE 256
+
+// First line of the sysfs file dir/name without the newline, empty if it does not exist
+static void read_sysfs_attr(const char *dir, const char *name, char *value, size_t size)
+{
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    value[0] = '\0';
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+    if (fgets(value, size, f))
+        value[strcspn(value, "\r\n")] = '\0';
+    fclose(f);
+}
+
+int profile_port_key(const char *port, char *key, size_t size)
+{
+    char device[PATH_MAX];
+    if (!realpath(port, device)) // /dev/serial/by-id/... links resolve to the ttyUSB node
+        snprintf(device, sizeof(device), "%s", port);
+    // the USB device owning the tty : the first parent of /sys/class/tty/<name>/device with an idVendor
+    char sys_path[PATH_MAX + 32], dir[PATH_MAX];
+    snprintf(sys_path, sizeof(sys_path), "/sys/class/tty/%s/device", basename(device));
+    if (realpath(sys_path, dir))
+    {
+        for (char *slash = dir + strlen(dir); slash > dir; slash = strrchr(dir, '/'))
+        {
+            *slash = '\0';
+            char vendor[16], product[16], serial[64];
+            read_sysfs_attr(dir, "idVendor", vendor, sizeof(vendor));
+            if (!vendor[0])
+                continue;
+            read_sysfs_attr(dir, "idProduct", product, sizeof(product));
+            read_sysfs_attr(dir, "serial", serial, sizeof(serial));
+            for (char *c = serial; *c; c++) // a key is a single word
+                if (*c == ' ' || *c == '\t')
+                    *c = '_';
+            return snprintf(key, size, "usb-%s:%s:%s", vendor, product, serial[0] ? serial : "-");
+        }
+    }
+    return snprintf(key, size, "%s", device);
+}
+
+// Parse a profile line, returns 1 if it is one
+static int parse_line(const char *line, char *key, uint32_t *baudrate, TUNING_PROFILE *profile)
+{
+    unsigned int chunk, window;
+    if (sscanf(line, "%127s %" SCNu32 " %u %u %" SCNu32 " %" SCNu64 " %" SCNu32, key, baudrate, &chunk, &window,
+               &profile->guard_us, &profile->rto_us, &profile->goodput) != 7)
+        return 0;
+    profile->chunk_payload = chunk;
+    profile->window = window;
+    return 1;
+}
+
+int profile_load(const char *path, const char *key, uint32_t baudrate, TUNING_PROFILE *profile)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    char line[PROFILE_LINE_SIZE], line_key[PROFILE_KEY_SIZE];
+    uint32_t line_baud;
+    TUNING_PROFILE line_profile;
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f))
+    {
+        if (parse_line(line, line_key, &line_baud, &line_profile) && line_baud == baudrate && !strcmp(line_key, key))
+        {
+            *profile = line_profile;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+int profile_save(const char *path, const char *key, uint32_t baudrate, const TUNING_PROFILE *profile)
+{
+    // copy the other profiles to a temporary file then rename it, the file is never left half written
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (!out)
+    {
+        LOG_ERROR("Error opening profile file %s", tmp_path);
+        return -1;
+    }
+    FILE *in = fopen(path, "r");
+    if (in)
+    {
+        char line[PROFILE_LINE_SIZE], line_key[PROFILE_KEY_SIZE];
+        uint32_t line_baud;
+        TUNING_PROFILE line_profile;
+        while (fgets(line, sizeof(line), in))
+            if (!parse_line(line, line_key, &line_baud, &line_profile) || line_baud != baudrate || strcmp(line_key, key))
+                fputs(line, out);
+        fclose(in);
+    }
+    fprintf(out, "%s %" PRIu32 " %u %u %" PRIu32 " %" PRIu64 " %" PRIu32 "\n", key, baudrate, profile->chunk_payload, profile->window,
+            profile->guard_us, profile->rto_us, profile->goodput);
+    fclose(out);
+    if (rename(tmp_path, path) != 0)
+    {
+        LOG_ERROR("Error renaming profile file %s", tmp_path);
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file profile.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Tuning profiles : the best chunk size, window, TX guard and initial ACK timeout found by the
+ *         tuner (-T) for a serial adapter at a baud rate, kept in a text file, one profile per line :
+ *             <adapter key> <baudrate> <chunk_payload> <window> <guard_us> <rto_us> <goodput B/s>
+ * @version 0.1
+ * @date 2023-12-30
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef PROFILE_HEADER_H_
+#define PROFILE_HEADER_H_
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define PROFILE_KEY_SIZE 128
+
+    typedef struct
+    {
+        uint16_t chunk_payload; // largest chunk asked at session open
+        uint8_t window;         // chunks per burst offered (1 : stop and wait)
+        uint32_t guard_us;      // pause before the line is turned around (frame_tx_guard_us)
+        uint64_t rto_us;        // initial chunk ACK timeout
+        uint32_t goodput;       // file bytes per second measured with these settings
+    } TUNING_PROFILE;
+
+    /* Key of the adapter behind port : "usb-<idVendor>:<idProduct>:<serial>" for USB serial adapters
+       (the same adapter on another ttyUSB number), else the resolved device path. Returns its length */
+    int profile_port_key(const char *port, char *key, size_t size);
+    // Profile of key at baudrate in the file path : 1 found, 0 none (or no file)
+    int profile_load(const char *path, const char *key, uint32_t baudrate, TUNING_PROFILE *profile);
+    // Store the profile of key at baudrate, replacing the previous one : 1 done, -1 error
+    int profile_save(const char *path, const char *key, uint32_t baudrate, const TUNING_PROFILE *profile);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // PROFILE_HEADER_H_
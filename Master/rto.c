@@ -0,0 +1,61 @@
+/**
+ * @file rto.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-22
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "rto.h"
+
+static uint64_t clamp_rto(uint64_t rto_us)
+{
+    if (rto_us < RTO_MIN_US)
+        return RTO_MIN_US;
+    if (rto_us > RTO_MAX_US)
+        return RTO_MAX_US;
+    return rto_us;
+}
+
+void rto_init(RTO_ESTIMATOR *est, uint64_t initial_us)
+{
+    est->srtt_us = 0;
+    est->rttvar_us = 0;
+    est->samples = 0;
+    est->rto_us = est->base_us = clamp_rto(initial_us);
+}
+
+void rto_sample(RTO_ESTIMATOR *est, uint64_t rtt_us)
+{
+    if (est->samples++ == 0)
+    {
+        est->srtt_us = rtt_us;
+        est->rttvar_us = rtt_us / 2;
+    }
+    else
+    {
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R| , SRTT = 7/8 SRTT + 1/8 R
+        uint64_t delta = (est->srtt_us > rtt_us) ? est->srtt_us - rtt_us : rtt_us - est->srtt_us;
+        est->rttvar_us = (3 * est->rttvar_us + delta) / 4;
+        est->srtt_us = (7 * est->srtt_us + rtt_us) / 8;
+    }
+    uint64_t var = 4 * est->rttvar_us;
+    est->rto_us = est->base_us = clamp_rto(est->srtt_us + (var > RTO_GRANULARITY_US ? var : RTO_GRANULARITY_US));
+}
+
+void rto_backoff(RTO_ESTIMATOR *est)
+{
+    est->rto_us = clamp_rto(est->rto_us * 2);
+}
+
+void rto_ack(RTO_ESTIMATOR *est)
+{
+    est->rto_us = est->base_us;
+}
+
+uint64_t rto_timeout_us(const RTO_ESTIMATOR *est)
+{
+    return est->rto_us;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file rto.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Adaptive retransmission timeout (RFC 6298 style) : the master keeps a
+ *         smoothed round-trip time and its variance per session and derives the
+ *         time to wait for an ACK from them instead of a fixed timeout.
+ * @version 0.1
+ * @date 2023-12-22
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef RTO_HEADER_H_
+#define RTO_HEADER_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define RTO_MIN_US 2000            /* lower bound, covers scheduling jitter */
+#define RTO_MAX_US 2000000         /* upper bound, also the backoff ceiling */
+#define RTO_GRANULARITY_US 500     /* G in RFC 6298 */
+
+    typedef struct
+    {
+        uint64_t srtt_us;   // smoothed round-trip time
+        uint64_t rttvar_us; // round-trip time variation
+        uint64_t base_us;   // timeout derived from the estimates, before backoff
+        uint64_t rto_us;    // current retransmission timeout
+        uint32_t samples;
+    } RTO_ESTIMATOR;
+
+    // Start a session, initial_us is used until the first sample
+    void rto_init(RTO_ESTIMATOR *est, uint64_t initial_us);
+    // Feed a measured round trip (only for frames that were not retransmitted : Karn's rule)
+    void rto_sample(RTO_ESTIMATOR *est, uint64_t rtt_us);
+    // The timeout expired : double the timeout until the next ACK
+    void rto_backoff(RTO_ESTIMATOR *est);
+    // An ACK arrived (retransmitted frame or not) : drop the backoff
+    void rto_ack(RTO_ESTIMATOR *est);
+    uint64_t rto_timeout_us(const RTO_ESTIMATOR *est);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // RTO_HEADER_H_
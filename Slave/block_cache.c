@@ -0,0 +1,235 @@
+/**
+ * @file block_cache.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "block_cache.h"
+#define TAG "block_cache"
+
+#define BLOCK_CACHE_MAGIC 0x314B4C42 /* "BLK1" */
+
+/* Index file : the header, then one entry per slot */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t blocks; // slots
+    uint32_t next;   // slot written next (the oldest once the ring is full)
+} __attribute__((packed)) CACHE_HEADER;
+
+typedef struct
+{
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    uint16_t length; // 0 : free slot
+} __attribute__((packed)) CACHE_ENTRY;
+
+static struct
+{
+    FILE *data;
+    FILE *index;
+    CACHE_HEADER header;
+    CACHE_ENTRY *entries;
+    uint32_t used;
+    uint32_t *lookup;     // open addressing on the first 4 bytes of the hash : slot + 1 of a held block, 0 empty
+    uint32_t lookup_mask; // buckets - 1 (a power of two, at least twice the slots)
+} cache;
+
+static uint32_t bucket(const uint8_t hash[SHA256_DIGEST_SIZE])
+{
+    uint32_t key;
+    memcpy(&key, hash, sizeof(key)); // SHA-256 bits are uniform already
+    return key & cache.lookup_mask;
+}
+
+static void lookup_add(uint32_t slot)
+{
+    uint32_t i = bucket(cache.entries[slot].hash);
+    while (cache.lookup[i])
+        i = (i + 1) & cache.lookup_mask;
+    cache.lookup[i] = slot + 1;
+}
+
+// Before the entry of slot changes : the buckets probed past it move back (no tombstones)
+static void lookup_remove(uint32_t slot)
+{
+    uint32_t i = bucket(cache.entries[slot].hash);
+    while (cache.lookup[i] != slot + 1)
+    {
+        if (!cache.lookup[i])
+            return;
+        i = (i + 1) & cache.lookup_mask;
+    }
+    for (uint32_t j = (i + 1) & cache.lookup_mask; cache.lookup[j]; j = (j + 1) & cache.lookup_mask)
+    {
+        uint32_t home = bucket(cache.entries[cache.lookup[j] - 1].hash);
+        if (((j - home) & cache.lookup_mask) >= ((j - i) & cache.lookup_mask)) // the hole is on its probe path
+        {
+            cache.lookup[i] = cache.lookup[j];
+            i = j;
+        }
+    }
+    cache.lookup[i] = 0;
+}
+
+static int write_entry(uint32_t slot)
+{
+    if (fseek(cache.index, sizeof(CACHE_HEADER) + (long)slot * sizeof(CACHE_ENTRY), SEEK_SET) != 0 ||
+        fwrite(&cache.entries[slot], sizeof(CACHE_ENTRY), 1, cache.index) != 1)
+        return -1;
+    return 0;
+}
+
+static int write_header(void)
+{
+    if (fseek(cache.index, 0, SEEK_SET) != 0 || fwrite(&cache.header, sizeof(cache.header), 1, cache.index) != 1)
+        return -1;
+    return 0;
+}
+
+static FILE *open_update(const char *path)
+{
+    FILE *file = fopen(path, "r+b");
+    return file ? file : fopen(path, "w+b");
+}
+
+int block_cache_open(const char *data_path, const char *index_path, uint32_t blocks)
+{
+    block_cache_close();
+    uint32_t buckets = 1;
+    while (buckets < 2ULL * blocks)
+        buckets <<= 1;
+    cache.entries = calloc(blocks, sizeof(CACHE_ENTRY));
+    cache.lookup = calloc(buckets, sizeof(uint32_t));
+    cache.lookup_mask = buckets - 1;
+    cache.data = open_update(data_path);
+    cache.index = open_update(index_path);
+    if (!blocks || !cache.entries || !cache.lookup || !cache.data || !cache.index)
+    {
+        LOG_ERROR("Error opening the block cache %s , %s", data_path, index_path);
+        block_cache_close();
+        return -1;
+    }
+    CACHE_HEADER header;
+    if (fread(&header, sizeof(header), 1, cache.index) == 1 && header.magic == BLOCK_CACHE_MAGIC && header.blocks == blocks &&
+        header.next < blocks && fread(cache.entries, sizeof(CACHE_ENTRY), blocks, cache.index) == blocks)
+        cache.header = header;
+    else
+    {
+        // new cache, or one of another size : start empty
+        memset(cache.entries, 0, blocks * sizeof(CACHE_ENTRY));
+        cache.header = (CACHE_HEADER){.magic = BLOCK_CACHE_MAGIC, .blocks = blocks, .next = 0};
+        if (write_header() < 0 || fwrite(cache.entries, sizeof(CACHE_ENTRY), blocks, cache.index) != blocks)
+        {
+            LOG_ERROR("Error writing the block cache index %s", index_path);
+            block_cache_close();
+            return -1;
+        }
+    }
+    cache.used = 0;
+    for (uint32_t i = 0; i < blocks; i++)
+        if (cache.entries[i].length)
+        {
+            cache.used++;
+            lookup_add(i);
+        }
+    return 1;
+}
+
+void block_cache_close(void)
+{
+    if (cache.data)
+        fclose(cache.data);
+    if (cache.index)
+        fclose(cache.index);
+    free(cache.entries);
+    free(cache.lookup);
+    memset(&cache, 0, sizeof(cache));
+}
+
+void block_cache_flush(void)
+{
+    if (cache.data)
+        fflush(cache.data);
+    if (cache.index)
+        fflush(cache.index);
+}
+
+uint32_t block_cache_count(void)
+{
+    return cache.used;
+}
+
+// Slot of the block, -1 if not held
+static int32_t find(const uint8_t hash[SHA256_DIGEST_SIZE], uint16_t length)
+{
+    if (!cache.lookup)
+        return -1;
+    for (uint32_t i = bucket(hash); cache.lookup[i]; i = (i + 1) & cache.lookup_mask)
+    {
+        uint32_t slot = cache.lookup[i] - 1;
+        if (cache.entries[slot].length == length && memcmp(cache.entries[slot].hash, hash, SHA256_DIGEST_SIZE) == 0)
+            return slot;
+    }
+    return -1;
+}
+
+bool block_cache_has(const uint8_t hash[SHA256_DIGEST_SIZE], uint16_t length)
+{
+    return length && find(hash, length) >= 0;
+}
+
+int block_cache_get(const uint8_t hash[SHA256_DIGEST_SIZE], uint8_t *block, uint16_t length)
+{
+    int32_t slot = length ? find(hash, length) : -1;
+    if (slot < 0)
+        return 0;
+    uint8_t check[SHA256_DIGEST_SIZE];
+    if (fseek(cache.data, (long)slot * BLOCK_CACHE_BLOCK_SIZE, SEEK_SET) == 0 && fread(block, 1, length, cache.data) == length)
+    {
+        sha256(block, length, check);
+        if (memcmp(check, hash, SHA256_DIGEST_SIZE) == 0)
+            return 1;
+    }
+    // damaged or never written (the index got ahead of the data) : the slot is freed
+    LOG_WARNING("Block cache slot %d does not match its hash, dropped", slot);
+    lookup_remove(slot);
+    cache.entries[slot].length = 0;
+    cache.used--;
+    write_entry(slot);
+    return 0;
+}
+
+int block_cache_put(const uint8_t *block, uint16_t length)
+{
+    if (!cache.entries || !length || length > BLOCK_CACHE_BLOCK_SIZE)
+        return -1;
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    sha256(block, length, hash);
+    if (find(hash, length) >= 0)
+        return 0;
+    uint32_t slot = cache.header.next;
+    if (!cache.entries[slot].length)
+        cache.used++;
+    else
+        lookup_remove(slot); // the oldest block leaves
+    memcpy(cache.entries[slot].hash, hash, SHA256_DIGEST_SIZE);
+    cache.entries[slot].length = length;
+    lookup_add(slot);
+    cache.header.next = (slot + 1) % cache.header.blocks;
+    // the data first : an entry is never written ahead of its block on purpose
+    if (fseek(cache.data, (long)slot * BLOCK_CACHE_BLOCK_SIZE, SEEK_SET) != 0 || fwrite(block, 1, length, cache.data) != length ||
+        write_entry(slot) < 0 || write_header() < 0)
+    {
+        LOG_ERROR("Error writing block cache slot %u", slot);
+        return -2;
+    }
+    return 1;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file block_cache.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Content-addressed store of the chunks received, kept across transfers : a ring of fixed size slots in a
+ *         data file and their SHA-256 in an index file. The master names a chunk the slave holds by its hash
+ *         (CAP_CODEC_CACHE, CHUNK_CACHE_REF) instead of sending it again.
+ * @version 0.1
+ * @date 2023-12-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef BLOCK_CACHE_HEADER_H_
+#define BLOCK_CACHE_HEADER_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "sha256.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define BLOCK_CACHE_BLOCK_SIZE 4096 /* slot size : the largest chunk payload */
+
+    // Open (or create) the cache of blocks slots, an index written for another slot count starts empty. 1 on success
+    int block_cache_open(const char *data_path, const char *index_path, uint32_t blocks);
+    void block_cache_close(void);
+    // Write the blocks added so far to the files
+    void block_cache_flush(void);
+    // Blocks held
+    uint32_t block_cache_count(void);
+    // True if a block of length bytes with this hash is held
+    bool block_cache_has(const uint8_t hash[SHA256_DIGEST_SIZE], uint16_t length);
+    // Copy the block of length bytes with this hash to block, checked against its hash. 1 found, 0 not held
+    int block_cache_get(const uint8_t hash[SHA256_DIGEST_SIZE], uint8_t *block, uint16_t length);
+    // Add a block (replaces the oldest one once the cache is full). 1 added, 0 already held, < 0 error
+    int block_cache_put(const uint8_t *block, uint16_t length);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // BLOCK_CACHE_HEADER_H_
@@ -0,0 +1,85 @@
+/**
+ * @file caps.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-24
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "caps.h"
+#include "serialport_layer.h"
+
+/* Rates offered in the handshake : the Bxxxx table of openDevice(), then common
+   PLL derived rates reached through termios2 (new rates are appended, never inserted) */
+static const uint32_t BAUD_RATES[CAPS_BAUD_RATE_COUNT] = {
+    9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600,
+    1000000, 1152000, 1500000, 2000000, 2500000, 3000000, 3500000, 4000000,
+    1843200, 3600000, 6000000};
+
+#define CHUNK_HEADER_BYTES 3 /* UARTChunk : ChLen + ChunkIdx */
+
+uint32_t caps_baud_rate(int index)
+{
+    return (index >= 0 && index < CAPS_BAUD_RATE_COUNT) ? BAUD_RATES[index] : 0;
+}
+
+uint32_t caps_baud_bit(uint32_t baud)
+{
+    for (int i = 0; i < CAPS_BAUD_RATE_COUNT; i++)
+        if (BAUD_RATES[i] == baud)
+            return 1UL << i;
+    return 0;
+}
+
+void caps_local(PROTOCOL_CAPS *caps, uint32_t max_chunk_payload)
+{
+    caps->protocol_version = PROTOCOL_VERSION;
+    caps->max_frame_payload = MAX_UART_DATA_PAYLOAD_SIZE;
+    caps->chunk_classes = 0;
+    for (int i = 0; (128UL << i) <= max_chunk_payload && (128UL << i) + CHUNK_HEADER_BYTES <= MAX_UART_DATA_PAYLOAD_SIZE; i++)
+        caps->chunk_classes |= 1 << i;
+    caps->window = 1;
+    caps->codecs = CAP_CODEC_NONE | CAP_CODEC_COBS | CAP_CODEC_FILL;
+    caps->hashes = CAP_HASH_CRC32 | CAP_HASH_TREE;
+    caps->bauds = (1UL << CAPS_BAUD_RATE_COUNT) - 1;
+}
+
+int caps_negotiate(const PROTOCOL_CAPS *a, const PROTOCOL_CAPS *b, PROTOCOL_CAPS *common)
+{
+    common->protocol_version = (a->protocol_version < b->protocol_version) ? a->protocol_version : b->protocol_version;
+    common->max_frame_payload = (a->max_frame_payload < b->max_frame_payload) ? a->max_frame_payload : b->max_frame_payload;
+    common->chunk_classes = a->chunk_classes & b->chunk_classes;
+    common->window = (a->window < b->window) ? a->window : b->window;
+    common->codecs = a->codecs & b->codecs;
+    common->hashes = a->hashes & b->hashes;
+    common->bauds = a->bauds & b->bauds;
+    if (!common->window)
+        common->window = 1;
+    return caps_best_chunk(common) ? 1 : -1;
+}
+
+uint32_t caps_best_chunk(const PROTOCOL_CAPS *caps)
+{
+    for (int i = 15; i >= 0; i--)
+        if ((caps->chunk_classes & (1 << i)) && (128UL << i) + CHUNK_HEADER_BYTES <= caps->max_frame_payload)
+            return 128UL << i;
+    return 0;
+}
+
+void caps_limit_baud(PROTOCOL_CAPS *caps, uint32_t max_baud)
+{
+    for (int i = 0; i < CAPS_BAUD_RATE_COUNT; i++)
+        if (BAUD_RATES[i] > max_baud)
+            caps->bauds &= ~(1UL << i);
+}
+
+uint32_t caps_best_baud(const PROTOCOL_CAPS *caps)
+{
+    uint32_t best = 0;
+    for (int i = 0; i < CAPS_BAUD_RATE_COUNT; i++)
+        if ((caps->bauds & (1UL << i)) && BAUD_RATES[i] > best)
+            best = BAUD_RATES[i];
+    return best;
+}
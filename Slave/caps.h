@@ -0,0 +1,81 @@
+/**
+ * @file caps.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Protocol version and capabilities advertised by each side at session open,
+ *         and the negotiation of the fastest configuration both sides support.
+ * @version 0.1
+ * @date 2023-12-24
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef CAPS_HEADER_H_
+#define CAPS_HEADER_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define PROTOCOL_VERSION 2 /* 1 : no capabilities exchange (3 step setup) */
+#define CAPS_BAUD_RATE_COUNT 19
+
+    /* Chunk payload classes, bit i = (128 << i) bytes, i is also the ChLen code of the chunk */
+    typedef enum
+    {
+        CAP_CHUNK_128 = 1 << 0,
+        CAP_CHUNK_256 = 1 << 1,
+        CAP_CHUNK_512 = 1 << 2,
+        CAP_CHUNK_1024 = 1 << 3,
+        CAP_CHUNK_2048 = 1 << 4,
+        CAP_CHUNK_4096 = 1 << 5,
+    } CAP_CHUNK_CLASS;
+
+    typedef enum
+    {
+        CAP_CODEC_NONE = 1 << 0, // chunks sent as is
+        CAP_CODEC_COBS = 1 << 1, // frames COBS encoded between 0x00 delimiters (serialport_layer.h)
+        CAP_CODEC_FEC = 1 << 2,  // bursts may end with Reed-Solomon parity frames (fec.h), offered with -e
+        CAP_CODEC_FILL = 1 << 3, // runs of chunks holding a single byte value sent as UART_FILL_FRAME
+        CAP_CODEC_PATCH = 1 << 4, // the file sent is a patch of the slave's current file (PATCH_INFO, patch.h)
+        CAP_CODEC_CACHE = 1 << 5, // chunks the slave holds in its block cache sent as CHUNK_CACHE_REF (block_cache.h)
+    } CAP_CODEC;
+
+    typedef enum
+    {
+        CAP_HASH_CRC32 = 1 << 0, // whole file CRC32 (VERIFY_FILE_PARAMS)
+        CAP_HASH_TREE = 1 << 1,  // SHA-256 hash tree of the chunks (hash_tree.h) : a failed verify is repaired
+    } CAP_HASH;
+
+    typedef struct
+    {
+        uint8_t protocol_version;
+        uint16_t max_frame_payload; // largest frame payload the receiver accepts
+        uint16_t chunk_classes;     // CAP_CHUNK_CLASS bits
+        uint8_t window;             // frames in flight before an ACK (1 : stop and wait)
+        uint8_t codecs;             // CAP_CODEC bits
+        uint8_t hashes;             // CAP_HASH bits
+        uint32_t bauds;             // bit i : caps_baud_rate(i) is supported
+    } __attribute__((packed)) PROTOCOL_CAPS;
+
+    // Capabilities of this build, chunk classes limited to max_chunk_payload
+    void caps_local(PROTOCOL_CAPS *caps, uint32_t max_chunk_payload);
+    // Common configuration of a and b, returns -1 if they have no chunk class in common
+    int caps_negotiate(const PROTOCOL_CAPS *a, const PROTOCOL_CAPS *b, PROTOCOL_CAPS *common);
+    // Largest chunk payload of caps that fits a frame (0 if none)
+    uint32_t caps_best_chunk(const PROTOCOL_CAPS *caps);
+    // Drop the baud rates above max_baud
+    void caps_limit_baud(PROTOCOL_CAPS *caps, uint32_t max_baud);
+    // Highest baud rate of caps (0 if none)
+    uint32_t caps_best_baud(const PROTOCOL_CAPS *caps);
+
+    // Baud rate of bit index (0 if out of range) / bit of a baud rate (0 if not listed)
+    uint32_t caps_baud_rate(int index);
+    uint32_t caps_baud_bit(uint32_t baud);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // CAPS_HEADER_H_
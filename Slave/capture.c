@@ -0,0 +1,145 @@
+/**
+ * @file capture.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-21
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <string.h>
+#include <time.h>
+#include "capture.h"
+#include "log.h"
+
+static FILE *capture_file = NULL;
+static uint64_t last_record_ns;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void put_varint(uint64_t value)
+{
+    uint8_t out[10];
+    int n = 0;
+    do
+    {
+        out[n] = value & 0x7F;
+        value >>= 7;
+        if (value)
+            out[n] |= 0x80;
+        n++;
+    } while (value);
+    fwrite(out, 1, n, capture_file);
+}
+
+static int get_varint(FILE *file, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = fgetc(file);
+        if (c == EOF)
+            return shift ? -1 : 0;
+        *value |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return 1;
+    }
+    return -2;
+}
+
+int capture_open(const char *path, CAPTURE_ROLE role)
+{
+    capture_file = fopen(path, "wb");
+    if (!capture_file)
+    {
+        LOG_ERROR("Error opening capture file %s", path);
+        return -1;
+    }
+    setvbuf(capture_file, NULL, _IOFBF, CAPTURE_FILE_BUFFER_SIZE);
+    uint64_t start_realtime_ns = clock_ns(CLOCK_REALTIME);
+    uint8_t header[2] = {CAPTURE_VERSION, (uint8_t)role};
+    fwrite(CAPTURE_MAGIC, 1, 4, capture_file);
+    fwrite(header, 1, sizeof(header), capture_file);
+    fwrite(&start_realtime_ns, 1, sizeof(start_realtime_ns), capture_file);
+    last_record_ns = clock_ns(CLOCK_MONOTONIC);
+    return 1;
+}
+
+void capture_close(void)
+{
+    if (!capture_file)
+        return;
+    fclose(capture_file);
+    capture_file = NULL;
+}
+
+void capture_record(CAPTURE_DIR direction, const void *data, uint32_t len)
+{
+    if (!capture_file || !len)
+        return;
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    while (len)
+    {
+        uint32_t part = (len > CAPTURE_MAX_RECORD_LEN) ? CAPTURE_MAX_RECORD_LEN : len;
+        fputc(direction, capture_file);
+        put_varint(now - last_record_ns);
+        put_varint(part);
+        fwrite(data, 1, part, capture_file);
+        last_record_ns = now;
+        data = (const uint8_t *)data + part;
+        len -= part;
+    }
+}
+
+int capture_reader_open(CAPTURE_READER *reader, const char *path)
+{
+    uint8_t header[14];
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(path, "rb");
+    if (!reader->file)
+        return -1;
+    if (fread(header, 1, sizeof(header), reader->file) != sizeof(header) || memcmp(header, CAPTURE_MAGIC, 4) != 0)
+    {
+        capture_reader_close(reader);
+        return -2;
+    }
+    if (header[4] != CAPTURE_VERSION)
+    {
+        capture_reader_close(reader);
+        return -3;
+    }
+    reader->role = header[5];
+    memcpy(&reader->start_realtime_ns, &header[6], sizeof(reader->start_realtime_ns));
+    return 1;
+}
+
+int capture_reader_next(CAPTURE_READER *reader, CAPTURE_RECORD *record)
+{
+    uint64_t delta, len;
+    int direction = fgetc(reader->file);
+    if (direction == EOF)
+        return 0;
+    if (get_varint(reader->file, &delta) <= 0 || get_varint(reader->file, &len) <= 0 || len > CAPTURE_MAX_RECORD_LEN)
+        return -1;
+    if (fread(reader->buf, 1, len, reader->file) != len)
+        return -2;
+    reader->time_ns += delta;
+    record->direction = (uint8_t)direction;
+    record->time_ns = reader->time_ns;
+    record->len = (uint32_t)len;
+    record->data = reader->buf;
+    return 1;
+}
+
+void capture_reader_close(CAPTURE_READER *reader)
+{
+    if (reader->file)
+        fclose(reader->file);
+    reader->file = NULL;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file capture.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Wire capture: every byte written to / read from the serial port,
+ *         with nanosecond timestamps, in a compact binary file.
+ *
+ *  File layout (little endian):
+ *   ________________________________________________________
+ *  | MAGIC "UCAP" | VERSION | ROLE | START_REALTIME_NS        |
+ *  |      4B      |    1B   |  1B  |        8B                |
+ *   --------------------------------------------------------
+ *  followed by records:
+ *   ____________________________________________
+ *  | DIR | DELTA_NS (varint) | LEN (varint) | DATA |
+ *  | 1B  |       1..10B      |    1..5B     | N*B  |
+ *   --------------------------------------------
+ *  DELTA_NS is the CLOCK_MONOTONIC time since the previous record.
+ * @version 0.1
+ * @date 2023-12-21
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef CAPTURE_HEADER_H_
+#define CAPTURE_HEADER_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CAPTURE_MAGIC "UCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FILE_BUFFER_SIZE (256 * 1024)
+#define CAPTURE_MAX_RECORD_LEN (64 * 1024)
+
+    typedef enum
+    {
+        CAPTURE_DIR_RX = 0, // bytes read from the serial port
+        CAPTURE_DIR_TX = 1, // bytes written to the serial port
+    } CAPTURE_DIR;
+
+    typedef enum
+    {
+        CAPTURE_ROLE_MASTER = 0,
+        CAPTURE_ROLE_SLAVE = 1,
+    } CAPTURE_ROLE;
+
+    typedef struct
+    {
+        uint8_t direction;    // CAPTURE_DIR
+        uint64_t time_ns;     // since the start of the capture
+        uint32_t len;         // number of bytes in data
+        uint8_t *data;        // points into the reader buffer
+    } CAPTURE_RECORD;
+
+    typedef struct
+    {
+        FILE *file;
+        uint8_t role;                // CAPTURE_ROLE
+        uint64_t start_realtime_ns;  // wall clock at the start of the capture
+        uint64_t time_ns;
+        uint8_t buf[CAPTURE_MAX_RECORD_LEN];
+    } CAPTURE_READER;
+
+    // Writer side, used by serialport.c once capture_open() succeeded
+    int capture_open(const char *path, CAPTURE_ROLE role);
+    void capture_close(void);
+    void capture_record(CAPTURE_DIR direction, const void *data, uint32_t len);
+
+    // Reader side, returns 1 on success, 0 at end of file, < 0 on error
+    int capture_reader_open(CAPTURE_READER *reader, const char *path);
+    int capture_reader_next(CAPTURE_READER *reader, CAPTURE_RECORD *record);
+    void capture_reader_close(CAPTURE_READER *reader);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // CAPTURE_HEADER_H_
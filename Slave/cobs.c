@@ -0,0 +1,60 @@
+/**
+ * @file cobs.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-27
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "cobs.h"
+
+size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst)
+{
+    size_t code_pos = 0; // where the length code of the current block goes
+    size_t out = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (src[i] != COBS_DELIMITER)
+        {
+            dst[out++] = src[i];
+            code++;
+        }
+        if (src[i] == COBS_DELIMITER || code == 0xFF)
+        {
+            dst[code_pos] = code;
+            code_pos = out++;
+            code = 1;
+        }
+    }
+    dst[code_pos] = code;
+    return out;
+}
+
+int cobs_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_size)
+{
+    size_t in = 0;
+    size_t out = 0;
+    while (in < len)
+    {
+        uint8_t code = src[in++];
+        if (code == COBS_DELIMITER || in + code - 1 > len)
+            return -1;
+        for (uint8_t i = 1; i < code; i++)
+        {
+            if (out >= dst_size || src[in] == COBS_DELIMITER)
+                return -1;
+            dst[out++] = src[in++]; // out <= in - 1 : decoding in place is safe
+        }
+        // a block shorter than 254 bytes stands for a 0x00, except at the end
+        if (code != 0xFF && in < len)
+        {
+            if (out >= dst_size)
+                return -1;
+            dst[out++] = COBS_DELIMITER;
+        }
+    }
+    return (int)out;
+}
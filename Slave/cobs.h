@@ -0,0 +1,34 @@
+/**
+ * @file cobs.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Consistent Overhead Byte Stuffing : the encoded data holds no 0x00 byte,
+ *         so 0x00 can delimit frames and a receiver resynchronizes on the next one.
+ * @version 0.1
+ * @date 2023-12-27
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef COBS_HEADER_H_
+#define COBS_HEADER_H_
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define COBS_DELIMITER 0x00
+#define COBS_MAX_ENCODED_SIZE(n) ((n) + (n) / 254 + 1) /* worst case size of n encoded bytes (delimiter not included) */
+
+    // Encode len bytes of src into dst (COBS_MAX_ENCODED_SIZE(len) bytes), returns the encoded size
+    size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst);
+    // Decode len bytes of src (without delimiter) into dst, may be src itself.
+    // Returns the decoded size, -1 if src is not valid COBS or does not fit dst_size
+    int cobs_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // COBS_HEADER_H_
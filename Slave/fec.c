@@ -0,0 +1,121 @@
+/**
+ * @file fec.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-28
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdbool.h>
+#include <string.h>
+#include "fec.h"
+
+#define GF_POLYNOMIAL 0x11D /* x^8 + x^4 + x^3 + x^2 + 1, 2 is a generator */
+
+static uint8_t gf_exp[2 * 255]; // doubled : gf_exp[log a + log b] needs no modulo
+static uint8_t gf_log[256];
+static bool gf_ready = false;
+
+static void gf_init(void)
+{
+    if (gf_ready)
+        return;
+    uint16_t x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        gf_exp[i] = gf_exp[i + 255] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLYNOMIAL;
+    }
+    gf_ready = true;
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    return (a && b) ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]]; // a != 0
+}
+
+uint8_t fec_coef(uint8_t row, uint8_t col)
+{
+    gf_init();
+    // x_row = row and y_col = FEC_MAX_PARITY + col never meet : x ^ y is never 0
+    return gf_inv(row ^ (uint8_t)(FEC_MAX_PARITY + col));
+}
+
+void fec_mul_add(uint8_t *dst, const uint8_t *src, size_t len, uint8_t coef)
+{
+    if (!coef)
+        return;
+    gf_init();
+    const uint8_t *exp = gf_exp + gf_log[coef];
+    for (size_t i = 0; i < len; i++)
+        if (src[i])
+            dst[i] ^= exp[gf_log[src[i]]];
+}
+
+int fec_solve(uint8_t count, const uint8_t *rows, const uint8_t *cols, uint8_t *const *syndromes, uint8_t *const *out, size_t len)
+{
+    if (!count || count > FEC_MAX_PARITY)
+        return -1;
+    // invert the count x count Cauchy submatrix (Gauss-Jordan), never singular
+    uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY] = {0};
+    for (int r = 0; r < count; r++)
+    {
+        for (int c = 0; c < count; c++)
+            a[r][c] = fec_coef(rows[r], cols[c]);
+        inv[r][r] = 1;
+    }
+    for (int c = 0; c < count; c++)
+    {
+        int pivot = c;
+        while (pivot < count && !a[pivot][c])
+            pivot++;
+        if (pivot == count)
+            return -1;
+        if (pivot != c)
+            for (int k = 0; k < count; k++)
+            {
+                uint8_t t = a[c][k];
+                a[c][k] = a[pivot][k];
+                a[pivot][k] = t;
+                t = inv[c][k];
+                inv[c][k] = inv[pivot][k];
+                inv[pivot][k] = t;
+            }
+        uint8_t scale = gf_inv(a[c][c]);
+        for (int k = 0; k < count; k++)
+        {
+            a[c][k] = gf_mul(a[c][k], scale);
+            inv[c][k] = gf_mul(inv[c][k], scale);
+        }
+        for (int r = 0; r < count; r++)
+        {
+            uint8_t factor = a[r][c];
+            if (r == c || !factor)
+                continue;
+            for (int k = 0; k < count; k++)
+            {
+                a[r][k] ^= gf_mul(factor, a[c][k]);
+                inv[r][k] ^= gf_mul(factor, inv[c][k]);
+            }
+        }
+    }
+    // missing chunk i = sum over r of inv[i][r] * syndrome r
+    for (int i = 0; i < count; i++)
+    {
+        memset(out[i], 0, len);
+        for (int r = 0; r < count; r++)
+            fec_mul_add(out[i], syndromes[r], len, inv[i][r]);
+    }
+    return 1;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file fec.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Forward error correction of a group of chunks : Reed-Solomon erasure code over GF(256)
+ *         with a Cauchy parity matrix. Chunks failing their CRC are erasures, any count of them
+ *         up to the parity frames received is rebuilt from the others.
+ * @version 0.1
+ * @date 2023-12-28
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef FEC_HEADER_H_
+#define FEC_HEADER_H_
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define FEC_MAX_PARITY 4                  /* parity frames per group */
+#define FEC_MAX_GROUP (256 - FEC_MAX_PARITY) /* chunks per group */
+
+    /*
+     * Parity row r of a group of data chunks d[0 .. count) (the short last chunk of the file padded with zeros) :
+     *     p[r] = sum over c of fec_coef(r, c) * d[c]      (GF(256) arithmetic, + is xor)
+     */
+
+    // Cauchy matrix coefficient of data chunk col in parity row row : every square submatrix is invertible
+    uint8_t fec_coef(uint8_t row, uint8_t col);
+    // dst += coef * src on len bytes
+    void fec_mul_add(uint8_t *dst, const uint8_t *src, size_t len, uint8_t coef);
+    /* Rebuild count missing data chunks cols[] from the parity rows rows[] : syndromes[i] holds parity row rows[i]
+       minus the contribution of the chunks received, out[i] gets chunk cols[i]. Returns -1 if count is out of range */
+    int fec_solve(uint8_t count, const uint8_t *rows, const uint8_t *cols, uint8_t *const *syndromes, uint8_t *const *out, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // FEC_HEADER_H_
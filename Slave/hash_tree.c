@@ -0,0 +1,70 @@
+/**
+ * @file hash_tree.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdlib.h>
+#include "hash_tree.h"
+
+int hash_tree_build(HASH_TREE *tree, HASH_TREE_READ read, void *ctx, uint32_t size)
+{
+    static uint8_t leaf[HASH_TREE_LEAF];
+    hash_tree_free(tree);
+    uint32_t total = 0;
+    uint32_t count = size ? (uint32_t)(((uint64_t)size + HASH_TREE_LEAF - 1) / HASH_TREE_LEAF) : 1;
+    for (uint8_t level = 0;; level++)
+    {
+        if (level >= HASH_TREE_LEVELS)
+            return -1;
+        tree->first[level] = total;
+        tree->count[level] = count;
+        total += count;
+        tree->levels = level + 1;
+        if (count == 1)
+            break;
+        count = (count + HASH_TREE_FANOUT - 1) / HASH_TREE_FANOUT;
+    }
+    tree->nodes = malloc((size_t)total * SHA256_DIGEST_SIZE);
+    if (!tree->nodes)
+    {
+        tree->levels = 0;
+        return -1;
+    }
+    // the leaves : the only pass over the file
+    for (uint32_t i = 0; i < tree->count[0]; i++)
+    {
+        uint32_t offset = i * HASH_TREE_LEAF;
+        uint16_t length = (size - offset < HASH_TREE_LEAF) ? size - offset : HASH_TREE_LEAF;
+        if (length)
+            length = read(ctx, offset, leaf, length);
+        sha256(leaf, length, tree->nodes[i]);
+    }
+    // each node above : the hash of the hashes of its children
+    for (uint8_t level = 1; level < tree->levels; level++)
+        for (uint32_t i = 0; i < tree->count[level]; i++)
+        {
+            uint32_t child = i * HASH_TREE_FANOUT;
+            uint32_t children = (tree->count[level - 1] - child < HASH_TREE_FANOUT) ? tree->count[level - 1] - child : HASH_TREE_FANOUT;
+            sha256(tree->nodes[tree->first[level - 1] + child], (size_t)children * SHA256_DIGEST_SIZE, tree->nodes[tree->first[level] + i]);
+        }
+    return 1;
+}
+
+void hash_tree_free(HASH_TREE *tree)
+{
+    free(tree->nodes);
+    tree->nodes = NULL;
+    tree->levels = 0;
+}
+
+const uint8_t *hash_tree_node(const HASH_TREE *tree, uint8_t level, uint32_t idx)
+{
+    if (level >= tree->levels || idx >= tree->count[level])
+        return NULL;
+    return tree->nodes[tree->first[level] + idx];
+}
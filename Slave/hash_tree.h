@@ -0,0 +1,49 @@
+/**
+ * @file hash_tree.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Hash tree of a file (CAP_HASH_TREE) : SHA-256 of each HASH_TREE_LEAF bytes, then each level up the SHA-256
+ *         of up to HASH_TREE_FANOUT hashes of the level below, built once after a failed verify. The master asks for
+ *         the children of the nodes that differ, HASH_TREE_FANOUT at a time, down to the leaves to send again.
+ * @version 0.1
+ * @date 2023-12-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef HASH_TREE_HEADER_H_
+#define HASH_TREE_HEADER_H_
+#include <stdint.h>
+#include <stddef.h>
+#include "sha256.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define HASH_TREE_FANOUT 16   /* children of a node : a round trip narrows the search 16 times */
+#define HASH_TREE_LEAF 4096   /* file bytes of a leaf : the largest chunk payload, a leaf is whole chunks of any size */
+#define HASH_TREE_LEVELS 5    /* levels of a 65535 leaf tree (65535, 4096, 256, 16, 1 nodes) */
+
+    // Read length bytes of the file at offset, returns the count read (fewer : the file is shorter)
+    typedef size_t (*HASH_TREE_READ)(void *ctx, uint32_t offset, uint8_t *buf, uint16_t length);
+
+    typedef struct
+    {
+        uint8_t (*nodes)[SHA256_DIGEST_SIZE]; // every level, the leaves first
+        uint32_t first[HASH_TREE_LEVELS];     // index in nodes of the first node of a level
+        uint32_t count[HASH_TREE_LEVELS];     // nodes of a level
+        uint8_t levels;                       // 0 : not built, levels - 1 is the root
+    } HASH_TREE;
+
+    /* Hash a file of size bytes once (an empty file is one empty leaf) and keep every node.
+       1 on success, -1 out of memory or more than HASH_TREE_LEVELS levels */
+    int hash_tree_build(HASH_TREE *tree, HASH_TREE_READ read, void *ctx, uint32_t size);
+    void hash_tree_free(HASH_TREE *tree);
+    // Hash of node idx of a level (0 : the leaves), NULL past the level
+    const uint8_t *hash_tree_node(const HASH_TREE *tree, uint8_t level, uint32_t idx);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // HASH_TREE_HEADER_H_
@@ -1,5 +1,10 @@
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <time.h>
 
 #include "log.h"
@@ -7,33 +12,457 @@
 static LOG_LEVEL level = INFO_LOG_LEVEL;
 static const char *LOG_LEVEL_STRINGS[] = {"Error", "Warning", "Info"};
 
+typedef enum
+{
+    LOG_ARG_INT,         // int, short, char
+    LOG_ARG_LONG,        // long
+    LOG_ARG_LONG_LONG,   // long long, intmax_t
+    LOG_ARG_SIZE,        // size_t, ptrdiff_t
+    LOG_ARG_DOUBLE,      // float, double (long double is narrowed)
+    LOG_ARG_POINTER,     // %p
+    LOG_ARG_STRING,      // %s, copied into LOG_RECORD.strings
+} LOG_ARG_TYPE;
+
+typedef union
+{
+    long long i;
+    size_t z;
+    double d;
+    const void *p;
+    uint16_t str_offset;
+} LOG_ARG;
+
+/* One fixed-size binary record, formatting is deferred to the drain thread */
+typedef struct
+{
+    atomic_size_t seq;   // ring slot sequence (Vyukov bounded queue)
+    struct timespec timestamp;
+    const char *fmt;     // format id: address of the format literal
+    const char *file;
+    const char *function;
+    int line;
+    uint8_t level;
+    uint8_t nargs;
+    uint8_t types[LOG_MAX_ARGS];
+    LOG_ARG args[LOG_MAX_ARGS];
+    char strings[LOG_STRING_BYTES];
+} LOG_RECORD;
+
+static LOG_RECORD ring[LOG_RING_SIZE];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos; // only touched by the drain thread (or under inline_drain_lock without it)
+static atomic_size_t dropped_records;
+static atomic_bool stop_thread;
+static atomic_bool drain_running; // false : pthread_create failed, the callers drain the ring themselves
+static pthread_mutex_t inline_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t drain_thread;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+/* Parse one conversion spec starting after '%'.
+ * returns a pointer past the conversion character, reports the conversion,
+ * the length modifier and the number of '*' width/precision arguments. */
+static const char *parse_spec(const char *p, char *conv, int *length, int *stars)
+{
+    *stars = 0;
+    *length = 0;
+    while (*p && strchr("-+ #0'", *p))
+        p++;
+    if (*p == '*')
+    {
+        (*stars)++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            (*stars)++;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    /* length : 0 none, 1 l, 2 ll/j, 3 z/t, 4 L, -1 h/hh */
+    switch (*p)
+    {
+    case 'h':
+        *length = -1;
+        p += (p[1] == 'h') ? 2 : 1;
+        break;
+    case 'l':
+        *length = (p[1] == 'l') ? 2 : 1;
+        p += (p[1] == 'l') ? 2 : 1;
+        break;
+    case 'j':
+        *length = 2;
+        p++;
+        break;
+    case 'z':
+    case 't':
+        *length = 3;
+        p++;
+        break;
+    case 'L':
+        *length = 4;
+        p++;
+        break;
+    default:
+        break;
+    }
+    *conv = *p;
+    return *p ? p + 1 : p;
+}
+
+static LOG_ARG_TYPE integer_arg_type(int length)
+{
+    switch (length)
+    {
+    case 1:
+        return LOG_ARG_LONG;
+    case 2:
+        return LOG_ARG_LONG_LONG;
+    case 3:
+        return LOG_ARG_SIZE;
+    default:
+        return LOG_ARG_INT;
+    }
+}
+
+/* Hot path: copy the raw arguments into the record, no formatting */
+static void capture_args(LOG_RECORD *rec, const char *fmt, va_list ap)
+{
+    size_t str_used = 0;
+    rec->nargs = 0;
+    for (const char *p = strchr(fmt, '%'); p; p = strchr(p, '%'))
+    {
+        char conv;
+        int length, stars;
+        if (p[1] == '%')
+        {
+            p += 2;
+            continue;
+        }
+        p = parse_spec(p + 1, &conv, &length, &stars);
+        for (int s = 0; s < stars && rec->nargs < LOG_MAX_ARGS; s++)
+        {
+            rec->types[rec->nargs] = LOG_ARG_INT;
+            rec->args[rec->nargs++].i = va_arg(ap, int);
+        }
+        if (rec->nargs >= LOG_MAX_ARGS)
+            return;
+        LOG_ARG *arg = &rec->args[rec->nargs];
+        uint8_t *type = &rec->types[rec->nargs];
+        switch (conv)
+        {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+            *type = integer_arg_type(length);
+            if (*type == LOG_ARG_LONG)
+                arg->i = va_arg(ap, long);
+            else if (*type == LOG_ARG_LONG_LONG)
+                arg->i = va_arg(ap, long long);
+            else if (*type == LOG_ARG_SIZE)
+                arg->z = va_arg(ap, size_t);
+            else
+                arg->i = va_arg(ap, int);
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            *type = LOG_ARG_DOUBLE;
+            arg->d = (length == 4) ? (double)va_arg(ap, long double) : va_arg(ap, double);
+            break;
+        case 'p':
+            *type = LOG_ARG_POINTER;
+            arg->p = va_arg(ap, void *);
+            break;
+        case 's':
+        {
+            const char *s = va_arg(ap, const char *);
+            size_t n = s ? strlen(s) : 6;
+            size_t room = LOG_STRING_BYTES - 1 - str_used; // strings are truncated, never dropped
+            if (n > room)
+                n = room;
+            *type = LOG_ARG_STRING;
+            arg->str_offset = (uint16_t)str_used;
+            memcpy(&rec->strings[str_used], s ? s : "(null)", n);
+            rec->strings[str_used + n] = '\0';
+            str_used = (n < room) ? str_used + n + 1 : LOG_STRING_BYTES - 1;
+            break;
+        }
+        default: // unsupported conversion : stop capturing
+            return;
+        }
+        rec->nargs++;
+    }
+}
+
+/* Drain thread: rebuild the message from the record, one conversion at a time */
+static void format_record(const LOG_RECORD *rec, char *out, size_t out_size)
+{
+    size_t used = 0;
+    int argi = 0;
+    const char *p = rec->fmt;
+    while (*p && used + 1 < out_size)
+    {
+        const char *pct = strchr(p, '%');
+        size_t lit = pct ? (size_t)(pct - p) : strlen(p);
+        if (lit)
+        {
+            if (lit > out_size - used - 1)
+                lit = out_size - used - 1;
+            memcpy(out + used, p, lit);
+            used += lit;
+            p += lit;
+            continue;
+        }
+        if (pct[1] == '%')
+        {
+            out[used++] = '%';
+            p = pct + 2;
+            continue;
+        }
+        char conv;
+        int length, stars;
+        const char *end = parse_spec(pct + 1, &conv, &length, &stars);
+        char spec[32];
+        size_t spec_len = (size_t)(end - pct);
+        if (spec_len >= sizeof(spec) || argi + stars >= rec->nargs)
+            break;
+        memcpy(spec, pct, spec_len);
+        spec[spec_len] = '\0';
+        if (length == 4) // drop the 'L' : long double was narrowed to double
+        {
+            memmove(&spec[spec_len - 2], &spec[spec_len - 1], 2);
+        }
+        int star[2] = {0, 0};
+        for (int s = 0; s < stars; s++)
+            star[s] = (int)rec->args[argi++].i;
+        const LOG_ARG *arg = &rec->args[argi];
+        size_t room = out_size - used;
+        int n = 0;
+#define LOG_EMIT(value)                                                       \
+    do                                                                        \
+    {                                                                         \
+        if (stars == 2)                                                       \
+            n = snprintf(out + used, room, spec, star[0], star[1], value);    \
+        else if (stars == 1)                                                  \
+            n = snprintf(out + used, room, spec, star[0], value);             \
+        else                                                                  \
+            n = snprintf(out + used, room, spec, value);                      \
+    } while (0)
+        switch (rec->types[argi])
+        {
+        case LOG_ARG_LONG:
+            LOG_EMIT((long)arg->i);
+            break;
+        case LOG_ARG_LONG_LONG:
+            LOG_EMIT(arg->i);
+            break;
+        case LOG_ARG_SIZE:
+            LOG_EMIT(arg->z);
+            break;
+        case LOG_ARG_DOUBLE:
+            LOG_EMIT(arg->d);
+            break;
+        case LOG_ARG_POINTER:
+            LOG_EMIT(arg->p);
+            break;
+        case LOG_ARG_STRING:
+            LOG_EMIT(&rec->strings[arg->str_offset]);
+            break;
+        default:
+            LOG_EMIT((int)arg->i);
+            break;
+        }
+#undef LOG_EMIT
+        argi++;
+        if (n < 0)
+            break;
+        used += ((size_t)n < room) ? (size_t)n : room - 1;
+        p = end;
+    }
+    out[used] = '\0';
+}
+
+static void write_record(const LOG_RECORD *rec)
+{
+    char msg[512];
+    char time_str[32], year_str[8];
+    struct tm tm_;
+    localtime_r(&rec->timestamp.tv_sec, &tm_);
+    strftime(time_str, sizeof(time_str), "%a %b %e %H:%M:%S", &tm_);
+    strftime(year_str, sizeof(year_str), "%Y", &tm_);
+    format_record(rec, msg, sizeof(msg));
+    printf("[%s]: %s.%06ld %s %s:%d (%s) - %s\n", LOG_LEVEL_STRINGS[rec->level], time_str,
+           rec->timestamp.tv_nsec / 1000, year_str, rec->file, rec->line, rec->function, msg);
+}
+
+// Returns the number of records written
+static size_t drain_ring(void)
+{
+    size_t count = 0;
+    while (1)
+    {
+        LOG_RECORD *rec = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&rec->seq, memory_order_acquire) != dequeue_pos + 1)
+            break;
+        write_record(rec);
+        atomic_store_explicit(&rec->seq, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+        dequeue_pos++;
+        count++;
+    }
+    size_t dropped = atomic_exchange(&dropped_records, 0);
+    if (dropped)
+        printf("[%s]: %zu log records dropped (ring full)\n", LOG_LEVEL_STRINGS[WARNING_LOG_LEVEL], dropped);
+    if (count || dropped)
+        fflush(stdout);
+    return count;
+}
+
+static void *drain_thread_main(void *arg)
+{
+    (void)arg;
+    const struct timespec period = {0, LOG_DRAIN_PERIOD_US * 1000L};
+    while (1)
+    {
+        if (drain_ring())
+            continue;
+        if (atomic_load(&stop_thread))
+            break;
+        nanosleep(&period, NULL);
+    }
+    drain_ring();
+    return NULL;
+}
+
+// No drain thread : the caller writes the records out, one caller at a time
+static void drain_inline(void)
+{
+    pthread_mutex_lock(&inline_drain_lock);
+    drain_ring();
+    pthread_mutex_unlock(&inline_drain_lock);
+}
+
+static void log_stop(void)
+{
+    atomic_store(&stop_thread, true);
+    pthread_join(drain_thread, NULL);
+    atomic_store(&drain_running, false); // records logged from now on are written by their caller
+}
+
+static void log_start(void)
+{
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_init(&ring[i].seq, i);
+    if (pthread_create(&drain_thread, NULL, drain_thread_main, NULL) != 0)
+    {
+        fprintf(stderr, "log: failed to start drain thread, logging synchronously\n");
+        return;
+    }
+    atomic_store(&drain_running, true);
+    atexit(log_stop);
+}
+
 void log_set_level(LOG_LEVEL _level)
 {
     level = _level;
 }
-static void log_message(LOG_LEVEL log_level, const char *file, int line, const char *function, const char *msg)
+
+static void log_message(LOG_LEVEL log_level, const char *file, int line, const char *function, const char *fmt, va_list ap)
 {
-    if (level >= log_level)
-    {
-        time_t now = time(NULL);
-        char *time_str = ctime(&now);
-        time_str[strlen(time_str) - 1] = '\0'; // Remove newline character
+    if (level < log_level)
+        return;
+    pthread_once(&log_once, log_start);
 
-        printf("[%s]: %s %s:%d (%s) - %s\n", LOG_LEVEL_STRINGS[log_level], time_str, file, line, function, msg);
+    /* claim a slot (multi-producer safe) */
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    LOG_RECORD *rec;
+    while (1)
+    {
+        rec = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0)
+        {
+            atomic_fetch_add(&dropped_records, 1); // ring full : never block the caller
+            return;
+        }
+        else
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
     }
+
+    clock_gettime(CLOCK_REALTIME, &rec->timestamp);
+    rec->level = (uint8_t)log_level;
+    rec->fmt = fmt;
+    rec->file = file;
+    rec->line = line;
+    rec->function = function;
+    capture_args(rec, fmt, ap);
+    atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+    if (!atomic_load(&drain_running))
+        drain_inline();
+}
+
+void log_error(const char *file, int line, const char *function, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    log_message(ERROR_LOG_LEVEL, file, line, function, fmt, ap);
+    va_end(ap);
 }
 
-void log_error(const char *file, int line, const char *function, const char *msg)
+void log_warning(const char *file, int line, const char *function, const char *fmt, ...)
 {
-    log_message(ERROR_LOG_LEVEL, file, line, function, msg);
+    va_list ap;
+    va_start(ap, fmt);
+    log_message(WARNING_LOG_LEVEL, file, line, function, fmt, ap);
+    va_end(ap);
 }
 
-void log_warning(const char *file, int line, const char *function, const char *msg)
+void log_info(const char *fmt, ...)
 {
-    log_message(WARNING_LOG_LEVEL, file, line, function, msg);
+    va_list ap;
+    va_start(ap, fmt);
+    log_message(INFO_LOG_LEVEL, "", 0, "", fmt, ap);
+    va_end(ap);
 }
 
-void log_info(const char *msg)
+void log_flush(void)
 {
-    log_message(INFO_LOG_LEVEL, "", 0, "", msg);
+    const struct timespec period = {0, LOG_DRAIN_PERIOD_US * 1000L};
+    if (atomic_load(&enqueue_pos) == 0)
+        return;
+    if (!atomic_load(&drain_running)) // nothing would ever empty the ring
+    {
+        drain_inline();
+        return;
+    }
+    // wait for the drain thread to catch up with every claimed slot
+    size_t target = atomic_load(&enqueue_pos);
+    while (1)
+    {
+        LOG_RECORD *rec = &ring[(target - 1) & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&rec->seq, memory_order_acquire) >= target - 1 + LOG_RING_SIZE)
+            break;
+        nanosleep(&period, NULL);
+    }
 }
@@ -1,8 +1,11 @@
 /**
  * @file log.h
  * @author Abdo Daood (abdo.daood94@gmail.com)
- * @brief
- * @version 0.1
+ * @brief  printf-like asynchronous logger.
+ *         The caller only captures a fixed-size binary record (timestamp, level,
+ *         format pointer, raw arguments) into a lock-free ring; formatting and
+ *         writing to stdout happen later on a background thread.
+ * @version 0.2
  * @date 2023-12-11
  *
  * @copyright Copyright (c) 2023
@@ -19,20 +22,52 @@
 extern "C"
 {
 #endif
+
+/* Numeric levels, usable in #if */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+
+/* Levels above this threshold compile to nothing (e.g. -DLOG_COMPILE_LEVEL=0 keeps only errors) */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE 1024     /* number of records in the ring, must be a power of 2 */
+#define LOG_MAX_ARGS 8         /* max printf arguments captured per record */
+#define LOG_STRING_BYTES 96    /* inline storage for the "%s" arguments of a record */
+#define LOG_DRAIN_PERIOD_US 2000 /* background thread sleep when the ring is empty */
+
     typedef enum
     {
-        ERROR_LOG_LEVEL = 0,
-        WARNING_LOG_LEVEL = 1,
-        INFO_LOG_LEVEL = 2
+        ERROR_LOG_LEVEL = LOG_LEVEL_ERROR,
+        WARNING_LOG_LEVEL = LOG_LEVEL_WARNING,
+        INFO_LOG_LEVEL = LOG_LEVEL_INFO
     } LOG_LEVEL;
 
     void log_set_level(LOG_LEVEL _level);
-    void log_error(const char *file, int line, const char *function, const char *msg);
-    void log_warning(const char *file, int line, const char *function, const char *msg);
-    void log_info(const char *msg);
-#define LOG_ERROR(msg) log_error(__FILE__, __LINE__, __FUNCTION__, msg)
-#define LOG_WARNING(msg) log_warning(__FILE__, __LINE__, __FUNCTION__, msg)
-#define LOG_INFO(msg) log_info(msg);
+    /* The format string must outlive the process (a string literal): only its address is recorded */
+    void log_error(const char *file, int line, const char *function, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+    void log_warning(const char *file, int line, const char *function, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+    void log_info(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+    // Block until every queued record has been written out
+    void log_flush(void);
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) log_error(__FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_WARNING
+#define LOG_WARNING(...) log_warning(__FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) ((void)0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) log_info(__VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
 
 #ifdef __cplusplus
 }
@@ -11,12 +11,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
 #include "serialport_layer.h"
 #include "utilities.h"
 #include "checksum.h"
 #include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "fec.h"
+#include "patch.h"
+#include "block_cache.h"
 #include "main.h"
 #define TAG "main"
 
@@ -29,20 +36,151 @@ Version BL_Version = {
     .major = BL_MAJOR_VERSION,
     .minor = BL_MINOR_VERSION};
 
-char msg_buf[1024];
+static const char *const SLAVE_PHASE_NAMES[SLAVE_PHASE_COUNT] = {
+    [SLAVE_PHASE_WAIT_REQUEST] = "wait_request",
+    [SLAVE_PHASE_PROCESS_REQUEST] = "process_request",
+};
+
+/* Runtime baud rate change (UART_LINK_FRAME) */
+static struct
+{
+    uint32_t start_baud;   // rate given on the command line, always the fallback
+    uint32_t baud;         // current rate
+    uint32_t max_baud;     // highest rate offered to the master
+    Deadline revert;       // switch not committed yet : back to start_baud when it expires
+    uint64_t last_frame_us; // last valid frame received
+} baud_link = {.max_baud = 6000000};
+
+/* Streaming mode (RTS/CTS flow control or FEC) : chunks arrive back to back, go-back-N */
+static struct
+{
+    bool flow_control;      // -f : RTS/CTS enabled, streaming offered at session open
+    bool fec;               // -e : FEC offered at session open (with streaming)
+    uint8_t window;         // agreed at session open, 1 : an ACK per chunk
+    uint8_t codecs;         // CAP_CODEC bits agreed at session open
+    uint8_t hashes;         // CAP_HASH bits agreed at session open
+    uint32_t next_offset;   // file bytes stored in order
+    uint64_t ahead;         // FEC : bit i set, chunk (next chunk in order + i) stored out of order
+    uint32_t ahead_step;    // chunk size of the ahead bits, a smaller size clears them
+} stream = {.window = 1};
+
+/* FEC group being received : its parity frames, kept until the checkpoint */
+static struct
+{
+    uint16_t first_idx;
+    uint8_t data_count; // 0 : no group
+    uint8_t chunk_code; // ChLen code of the group
+    uint8_t rows;       // parity frames received
+    uint8_t row[FEC_MAX_PARITY];
+    uint8_t parity[FEC_MAX_PARITY][4096];
+} fec_group;
+
+/* Patch session (CAP_CODEC_PATCH) : the chunks build the patch in PATCH_FILE_PATH, applied at verify */
+static struct
+{
+    bool active;
+    bool applied; // BINARY_FILE_PATH is the target already (a repeated VERIFY only checks it)
+    PATCH_INFO info;
+} patch;
+
+/* Hash tree of the received file (CAP_HASH_TREE), built when its verify fails : the master's queries read it */
+static HASH_TREE received_tree;
+
+static void link_set_baud(uint32_t baud)
+{
+    if (setBaudRate(baud) <= 0)
+        LOG_ERROR("Error setting %u bps", baud);
+    baud_link.baud = baud;
+    flushReceiver();
+}
+
+// Back to the start rate when a switch is not committed in time or the link went silent
+static void link_watchdog(void)
+{
+    if (baud_link.baud == baud_link.start_baud)
+        return;
+    bool idle = monotonic_us() - baud_link.last_frame_us > LINK_IDLE_REVERT_MS * 1000ULL;
+    if (deadline_expired(&baud_link.revert) || idle)
+    {
+        LOG_WARNING("Link at %u bps %s, back to %u bps", baud_link.baud, idle ? "silent" : "not committed", baud_link.start_baud);
+        deadline_set_us(&baud_link.revert, 0);
+        link_set_baud(baud_link.start_baud);
+    }
+}
+
+static void usage(const char *app)
+{
+    printf("Usage: %s [-m <metrics_file>] [-t <trace_file>] [-c <capture_file>] [-b <max_baudrate>] [-r <before_ms>,<after_ms>] [-f] [-e] <UART_port> <UART_baudrate>\n", app);
+    printf("  -m <metrics_file> : export transfer metrics (JSON, Prometheus textfile if it ends with .prom)\n");
+    printf("  -t <trace_file>   : record frame level spans as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)\n");
+    printf("  -c <capture_file> : record every byte sent and received with timestamps (decode / replay with uartcap)\n");
+    printf("  -b <max_baudrate> : highest rate the master may switch to after the handshake (default 6000000)\n");
+    printf("  -r <before_ms>,<after_ms> : RS-485, the driver drives RTS with these delays around each frame (TIOCSRS485)\n");
+    printf("  -f : RTS/CTS flow control, the master may stream chunks with an ACK every %u chunks\n", SLAVE_STREAM_WINDOW);
+    printf("  -e : forward error correction, streamed bursts may carry up to %u parity frames\n", FEC_MAX_PARITY);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 3)
+    const char *metrics_file = NULL;
+    const char *trace_file = NULL;
+    const char *capture_file = NULL;
+    int opt;
+    bool rs485 = false;
+    unsigned int rs485_before_ms = 0, rs485_after_ms = 0;
+    while ((opt = getopt(argc, argv, "m:t:c:b:r:fe")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            metrics_file = optarg;
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'c':
+            capture_file = optarg;
+            break;
+        case 'b':
+            baud_link.max_baud = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%u,%u", &rs485_before_ms, &rs485_after_ms) != 2)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            rs485 = true;
+            break;
+        case 'f':
+            stream.flow_control = true;
+            break;
+        case 'e':
+            stream.fec = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2)
     {
-        printf("Usage: %s <UART_port> <UART_baudrate>\n", argv[0]);
+        usage(argv[0]);
         return 1;
     }
 
-    // argv[1] is the UART port
-    const char *uart_port = argv[1];
+    // 1st positional argument is the UART port
+    const char *uart_port = argv[optind];
 
-    // argv[2] is the UART baud rate
-    int uart_baudrate = atoi(argv[2]);
+    // 2nd positional argument is the UART baud rate
+    int uart_baudrate = atoi(argv[optind + 1]);
+    metrics_init("slave", SLAVE_PHASE_NAMES, SLAVE_PHASE_COUNT);
+    if (metrics_file)
+        metrics_set_export_path(metrics_file);
+    if (trace_file)
+        trace_open(trace_file, "slave");
+    if (capture_file)
+        capture_open(capture_file, CAPTURE_ROLE_SLAVE);
     /* 1. Open Serial Port */
     int ret = (int)openDevice(uart_port, uart_baudrate);
     if (ret <= 0)
@@ -50,9 +188,23 @@ int main(int argc, char *argv[])
         LOG_ERROR("faild open serial port");
         return EXIT_FAILURE;
     }
+    if (rs485 && setRS485(true, rs485_before_ms, rs485_after_ms) <= 0)
+    {
+        LOG_ERROR("%s does not support kernel RS-485 mode", uart_port);
+        return EXIT_FAILURE;
+    }
+    if (stream.flow_control && setFlowControl(true) <= 0)
+    {
+        LOG_ERROR("Error enabling RTS/CTS flow control");
+        return EXIT_FAILURE;
+    }
+    uart_errors_poll();
+    if (block_cache_open(BLOCK_CACHE_DATA_PATH, BLOCK_CACHE_INDEX_PATH, BLOCK_CACHE_BLOCKS) > 0)
+        LOG_INFO("Block cache : %u of %u blocks", block_cache_count(), BLOCK_CACHE_BLOCKS);
+    baud_link.start_baud = baud_link.baud = uart_baudrate;
     printf("-----------------------------------\n");
     printf("UART port: %s\n", uart_port);
-    printf("UART Baudrate: %d bps\n", uart_baudrate);
+    printf("UART Baudrate: %d bps (driver: %u bps)\n", uart_baudrate, getBaudRate());
     printf("-----------------------------------\n\n");
 
     /* 2. Set WatchDog timer */
@@ -62,10 +214,15 @@ int main(int argc, char *argv[])
     while (!quitApp)
     {
         // check watchdog timout
-
+        metrics_enter_phase(SLAVE_PHASE_WAIT_REQUEST);
+        metrics_poll();
+        link_watchdog();
         if ((ret = tryGetResquestFromMaster(MY_ID)) <= 0)
             continue;
+        baud_link.last_frame_us = monotonic_us();
+        frame_tx_cobs(frame_rx_cobs()); // answer in the framing of the request
         // watchdog reset
+        metrics_enter_phase(SLAVE_PHASE_PROCESS_REQUEST);
 
         UARTFrame *frame = (UARTFrame *)uart_buf;
         switch (frame->type)
@@ -77,26 +234,552 @@ int main(int argc, char *argv[])
             BINARY_FILE_INFO *binaryinfo_ptr = (BINARY_FILE_INFO *)&frame->data;
             binaryinfo.crc32 = binaryinfo_ptr->crc32;
             binaryinfo.size = binaryinfo_ptr->size;
-            sprintf(msg_buf, "Firmware info: size %d , crc32 %08X", binaryinfo.size, binaryinfo.crc32);
-            LOG_INFO(msg_buf);
+            patch.active = false; // 3 step setup, or the CRC32 trailer after the chunks : always the file itself
+            select_receive_file(BINARY_FILE_PATH);
+            LOG_INFO("Firmware info: size %u , crc32 %08X", binaryinfo.size, binaryinfo.crc32);
             Write_Info_to_Master(MY_ID, UART_RESPOND_ACK);
             break;
+        case UART_SESSION_FRAME:
+            processSessionOpen(&frame->data, frame->len);
+            break;
+        case UART_LINK_FRAME:
+            processLinkRequest(&frame->data, frame->len);
+            break;
         case UART_DATA_FRAME:
-            UART_RSPONSE resp = UART_RESPOND_ACK;
-            if (StoreDataIntoFile(&frame->data, frame->len) <= 0)
-                resp = UART_RESPOND_NACK;
-            Write_Info_to_Master(MY_ID, resp);
-            sprintf(msg_buf, "Recivied Chunk[%d]", *(uint16_t *)((uint8_t *)(&frame->data) + 1));
-            LOG_INFO(msg_buf);
+            processChunk(&frame->data, frame->len);
+            break;
+        case UART_FEC_FRAME:
+            processParity(&frame->data, frame->len);
+            break;
+        case UART_FILL_FRAME:
+            processFill(&frame->data, frame->len);
+            break;
+        case UART_CACHE_FRAME:
+            processCacheQuery(&frame->data, frame->len);
+            break;
+        case UART_HASH_FRAME:
+            processHashQuery(&frame->data, frame->len);
             break;
         default:
             break;
         }
     }
-    LOG_INFO("--------------App Finished--------------")
+    metrics_enter_phase(SLAVE_PHASE_WAIT_REQUEST);
+    uart_errors_poll();
+    LOG_INFO("UART errors: overrun %llu , buffer overrun %llu , framing %llu , parity %llu , break %llu",
+             (unsigned long long)metrics_get(METRIC_UART_OVERRUNS), (unsigned long long)metrics_get(METRIC_UART_BUF_OVERRUNS),
+             (unsigned long long)metrics_get(METRIC_UART_FRAME_ERRORS), (unsigned long long)metrics_get(METRIC_UART_PARITY_ERRORS),
+             (unsigned long long)metrics_get(METRIC_UART_BREAKS));
+    block_cache_close();
+    hash_tree_free(&received_tree);
+    metrics_export();
+    trace_close();
+    capture_close();
+    LOG_INFO("--------------App Finished--------------");
     return EXIT_SUCCESS;
 }
 
+// True if the file at path has the size and crc32 of info
+static bool file_matches(const char *path, const BINARY_FILE_INFO *info)
+{
+    uint32_t crc32, size;
+    return calculate_file_crc_and_length(path, &crc32, &size) == 0 && crc32 == info->crc32 && size == info->size;
+}
+
+/* Patch session : check the patch received, apply it to the current file and put the result in its place once
+   checked. A VERIFY sent again (its answer was lost) checks the result again */
+static UART_RSPONSE verify_patch(void)
+{
+    if (!patch.applied)
+    {
+        if (!file_matches(PATCH_FILE_PATH, &binaryinfo))
+            return UART_RESPOND_NACK;
+        uint64_t span = trace_begin();
+        int ret = patch_apply_file(BINARY_FILE_PATH, PATCH_FILE_PATH, PATCHED_FILE_PATH);
+        trace_end("patch_apply", span);
+        if (ret <= 0 || !file_matches(PATCHED_FILE_PATH, &patch.info.target))
+        {
+            LOG_ERROR("Patch did not give the file announced (size %u , crc32 %08X)", patch.info.target.size, patch.info.target.crc32);
+            remove(PATCHED_FILE_PATH);
+            return UART_RESPOND_NACK;
+        }
+        if (rename(PATCHED_FILE_PATH, BINARY_FILE_PATH) != 0)
+        {
+            LOG_ERROR("Error renaming %s", PATCHED_FILE_PATH);
+            return UART_RESPOND_NACK;
+        }
+        remove(PATCH_FILE_PATH);
+        patch.applied = true;
+        LOG_INFO("Patch applied : size %u , crc32 %08X", patch.info.target.size, patch.info.target.crc32);
+    }
+    return file_matches(BINARY_FILE_PATH, &patch.info.target) ? UART_RESPOND_ACK : UART_RESPOND_NACK;
+}
+
+void processSessionOpen(const uint8_t *data, uint16_t length)
+{
+    SESSION_OPEN_RESPONSE resp = {
+        .chunk_payload = 0,
+        .bl_status = UART_RESPOND_ACK, // I'm already in bootloader mode
+        .bl_version = encode_bootloader_version(BL_MAJOR_VERSION, BL_MINOR_VERSION),
+        .space = UART_RESPOND_NACK};
+    if (length < sizeof(SESSION_OPEN_REQUEST))
+    {
+        LOG_ERROR("Session open request too short (%u bytes)", length);
+        resp.bl_status = UART_RESPOND_NACK;
+        Write_Data_to_Master(MY_ID, UART_SESSION_FRAME, (uint8_t *)&resp, sizeof(resp));
+        return;
+    }
+    SESSION_OPEN_REQUEST req;
+    memcpy(&req, data, sizeof(req));
+    binaryinfo.crc32 = req.file.crc32;
+    binaryinfo.size = req.file.size;
+    // a patch is accepted against the current file only
+    patch.active = patch.applied = false;
+    select_receive_file(BINARY_FILE_PATH);
+    if ((req.caps.codecs & CAP_CODEC_PATCH) && length >= sizeof(req) + sizeof(PATCH_INFO))
+    {
+        memcpy(&patch.info, data + sizeof(req), sizeof(patch.info));
+        if (file_matches(BINARY_FILE_PATH, &patch.info.base))
+        {
+            patch.active = true;
+            remove(PATCH_FILE_PATH);
+            select_receive_file(PATCH_FILE_PATH);
+        }
+        else
+            LOG_WARNING("Patch base (size %u , crc32 %08X) is not the current file", patch.info.base.size, patch.info.base.crc32);
+    }
+    // a patch is applied at verify while it is still stored : the patched file needs its room too
+    size_t space = (size_t)binaryinfo.size + (patch.active ? (size_t)patch.info.target.size : 0);
+    if (check_space_by_writing_temp_file(space) > 0)
+        resp.space = UART_RESPOND_ACK;
+
+    PROTOCOL_CAPS my_caps;
+    caps_local(&my_caps, SLAVE_MAX_CHUNK_PAYLOAD);
+    caps_limit_baud(&my_caps, baud_link.max_baud);
+    if (stream.fec)
+        my_caps.codecs |= CAP_CODEC_FEC;
+    if (patch.active)
+        my_caps.codecs |= CAP_CODEC_PATCH;
+    if (block_cache_count())
+        my_caps.codecs |= CAP_CODEC_CACHE;
+    if (stream.flow_control || stream.fec)
+        my_caps.window = SLAVE_STREAM_WINDOW;
+    if (caps_negotiate(&req.caps, &my_caps, &resp.caps) > 0)
+    {
+        uint32_t chunk_payload = caps_best_chunk(&resp.caps);
+        resp.chunk_payload = (req.chunk_payload < chunk_payload) ? chunk_payload_floor(req.chunk_payload) : chunk_payload;
+    }
+    stream.window = resp.caps.window;
+    stream.codecs = resp.caps.codecs;
+    stream.hashes = resp.caps.hashes;
+    stream.next_offset = 0;
+    stream.ahead = 0;
+    fec_group.data_count = 0;
+    uart_errors_poll(); // counters of this session start here
+    Write_Data_to_Master(MY_ID, UART_SESSION_FRAME, (uint8_t *)&resp, sizeof(resp));
+    LOG_INFO("SESSION_OPEN: size %u , crc32 %08X , space %s , protocol v%u , chunk %u , window %u", binaryinfo.size, binaryinfo.crc32,
+             (resp.space == UART_RESPOND_ACK ? "ACK" : "NACK"), resp.caps.protocol_version, resp.chunk_payload, resp.caps.window);
+}
+
+// Payload bytes of chunk idx (the last chunk of the file is shorter, 0 past the end)
+static uint16_t chunk_length(uint32_t idx, uint32_t chunk_step)
+{
+    uint32_t offset = idx * chunk_step;
+    if (offset >= binaryinfo.size)
+        return 0;
+    return (binaryinfo.size - offset < chunk_step) ? binaryinfo.size - offset : chunk_step;
+}
+
+static bool chunk_stored(uint32_t idx, uint32_t chunk_step)
+{
+    uint32_t base = stream.next_offset / chunk_step;
+    if (idx * chunk_step < stream.next_offset)
+        return true;
+    return chunk_step == stream.ahead_step && idx - base < 64 && ((stream.ahead >> (idx - base)) & 1);
+}
+
+// The part stored in order grows over the chunks stored ahead of it
+static void chunks_merge_ahead(uint32_t chunk_step)
+{
+    uint32_t base = stream.next_offset / chunk_step;
+    while ((stream.ahead & 1) && chunk_length(base, chunk_step))
+    {
+        stream.next_offset += chunk_length(base++, chunk_step);
+        stream.ahead >>= 1;
+    }
+}
+
+// FEC : chunk idx is in the file, the part stored in order grows over the chunks stored ahead of it.
+// They are kept across bursts : the chunks a burst got through count again when the master goes back
+static void chunk_mark_stored(uint32_t idx, uint32_t chunk_step)
+{
+    uint32_t base = stream.next_offset / chunk_step;
+    if (idx * chunk_step < stream.next_offset || idx - base >= 64)
+        return;
+    if (chunk_step != stream.ahead_step)
+    {
+        stream.ahead = 0;
+        stream.ahead_step = chunk_step;
+    }
+    stream.ahead |= 1ULL << (idx - base);
+    chunks_merge_ahead(chunk_step);
+}
+
+// Chunks from the first one not stored in order to last that are not stored
+static uint8_t chunks_missing(uint32_t last, uint32_t chunk_step)
+{
+    uint8_t missing = 0;
+    for (uint32_t idx = stream.next_offset / chunk_step; idx <= last && missing < UINT8_MAX; idx++)
+        if (chunk_length(idx, chunk_step) && !chunk_stored(idx, chunk_step))
+            missing++;
+    return missing;
+}
+
+// Answer to the checkpoint of chunk last : next chunk expected, in chunks of the checkpoint size
+static void send_stream_ack(uint8_t status, uint16_t last, uint32_t chunk_step, uint8_t lost, uint8_t recovered)
+{
+    // the chunk size may have been lowered since the previous burst : count in chunks of this one
+    uint32_t errors = uart_errors_poll();
+    STREAM_ACK ack = {.status = status,
+                      .next_expected = (stream.next_offset + chunk_step - 1) / chunk_step,
+                      .rx_errors = errors > UINT16_MAX ? UINT16_MAX : errors,
+                      .lost = lost,
+                      .recovered = recovered,
+                      .checkpoint = last};
+    if (errors)
+        LOG_WARNING("%u receive errors in the driver since the previous checkpoint", errors);
+    Write_Data_to_Master(MY_ID, UART_DATA_FRAME, (uint8_t *)&ack, sizeof(ack));
+}
+
+// A chunk received is kept in the block cache for later transfers (a patch is not the file itself)
+static void cache_chunk(const uint8_t *payload, uint16_t length)
+{
+    if (!patch.active && length)
+        block_cache_put(payload, length);
+}
+
+// CHUNK_CACHE_REF : the payload of the chunk is replaced by the block of its hash, length gets the frame length.
+// False if the block is not held : the chunk counts as lost, the master sends its data
+static bool chunk_from_cache(UARTChunk *chunk, uint16_t *length, uint32_t chunk_step)
+{
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    uint16_t payload = chunk_length(chunk->ChunkIdx, chunk_step);
+    if (!(stream.codecs & CAP_CODEC_CACHE) || *length != sizeof(chunk->ChLen) + sizeof(chunk->ChunkIdx) + sizeof(hash))
+        return false;
+    memcpy(hash, chunk->ChunkPayload, sizeof(hash));
+    if (block_cache_get(hash, chunk->ChunkPayload, payload) <= 0)
+        return false;
+    *length = sizeof(chunk->ChLen) + sizeof(chunk->ChunkIdx) + payload;
+    metrics_inc(METRIC_CACHE_REFS);
+    return true;
+}
+
+void processChunk(uint8_t *data, uint16_t length)
+{
+    UARTChunk *chunk = (UARTChunk *)data;
+    bool checkpoint = chunk->ChLen & CHUNK_ACK_REQUEST;
+    bool cached = chunk->ChLen & CHUNK_CACHE_REF;
+    bool fec = stream.codecs & CAP_CODEC_FEC;
+    uint32_t chunk_step = decode_chunk_payload_max_size(chunk->ChLen & CHUNK_LEN_CODE_MASK);
+    uint32_t offset = (uint32_t)chunk->ChunkIdx * chunk_step;
+    UART_RSPONSE resp = UART_RESPOND_ACK;
+    bool in_order = stream.window <= 1 || offset <= stream.next_offset || (fec && offset > stream.next_offset);
+    // Streaming : a chunk out of order means an earlier one was lost, it is dropped and the
+    // master goes back to next_expected at the checkpoint (go-back-N). With FEC it is kept :
+    // the parity frames may rebuild the lost one. A chunk before next_offset is written again (repair after a failed verify)
+    if (in_order && cached && !chunk_from_cache(chunk, &length, chunk_step))
+        LOG_WARNING("Chunk[%d] not in the block cache", chunk->ChunkIdx);
+    else if (in_order)
+    {
+        uint64_t write_start_us = metrics_now_us();
+        uint64_t span = trace_begin();
+        uint16_t payload = length - sizeof(chunk->ChLen) - sizeof(chunk->ChunkIdx);
+        if (StoreDataIntoFile(data, length) <= 0)
+            resp = UART_RESPOND_NACK;
+        else
+        {
+            if (fec && stream.window > 1)
+                chunk_mark_stored(chunk->ChunkIdx, chunk_step);
+            else if (offset + payload > stream.next_offset)
+                stream.next_offset = offset + payload;
+            metrics_inc(METRIC_CHUNKS);
+            metrics_add(METRIC_PAYLOAD_BYTES, payload);
+            if (!cached)
+                cache_chunk(chunk->ChunkPayload, payload);
+        }
+        metrics_observe_us(METRIC_HIST_FILE_WRITE_US, metrics_now_us() - write_start_us);
+        trace_end_arg("file_write", span, "chunk", chunk->ChunkIdx);
+        LOG_INFO("Recivied Chunk[%d]", chunk->ChunkIdx);
+    }
+    else
+        LOG_WARNING("Chunk[%d] out of order, expecting offset %u", chunk->ChunkIdx, stream.next_offset);
+    if (stream.window > 1 && !checkpoint)
+        return;
+    uint64_t span = trace_begin();
+    if (checkpoint)
+        send_stream_ack(resp, chunk->ChunkIdx, chunk_step, fec ? chunks_missing(chunk->ChunkIdx, chunk_step) : 0, 0);
+    else
+        Write_Info_to_Master(MY_ID, resp);
+    trace_end("ack", span);
+}
+
+// Rebuild the chunks of the group missing at its checkpoint from the parity frames, returns the count missing before
+static uint8_t fec_recover(uint32_t chunk_step, uint8_t *recovered)
+{
+    static uint8_t chunk[4096];
+    static uint8_t rebuilt[FEC_MAX_PARITY][4096];
+    uint8_t cols[FEC_MAX_PARITY];
+    uint8_t missing = 0;
+    *recovered = 0;
+    for (uint16_t c = 0; c < fec_group.data_count; c++)
+    {
+        uint32_t idx = fec_group.first_idx + c;
+        if (!chunk_length(idx, chunk_step) || chunk_stored(idx, chunk_step))
+            continue;
+        if (missing < FEC_MAX_PARITY)
+            cols[missing] = c;
+        missing++;
+    }
+    if (!missing || missing > fec_group.rows)
+        return missing;
+    // syndromes : parity rows minus the chunks received (read back from the file)
+    for (uint16_t c = 0; c < fec_group.data_count; c++)
+    {
+        uint32_t idx = fec_group.first_idx + c;
+        uint16_t len = chunk_length(idx, chunk_step);
+        if (!len || !chunk_stored(idx, chunk_step))
+            continue;
+        if (LoadPayloadFromFile(idx * chunk_step, chunk, len) <= 0)
+            return missing;
+        for (uint8_t r = 0; r < missing; r++)
+            fec_mul_add(fec_group.parity[r], chunk, len, fec_coef(fec_group.row[r], c));
+    }
+    uint8_t *syndromes[FEC_MAX_PARITY];
+    uint8_t *out[FEC_MAX_PARITY];
+    for (uint8_t r = 0; r < missing; r++)
+    {
+        syndromes[r] = fec_group.parity[r];
+        out[r] = rebuilt[r];
+    }
+    if (fec_solve(missing, fec_group.row, cols, syndromes, out, chunk_step) < 0)
+        return missing;
+    for (uint8_t i = 0; i < missing; i++)
+    {
+        uint32_t idx = fec_group.first_idx + cols[i];
+        uint16_t len = chunk_length(idx, chunk_step);
+        if (StorePayloadIntoFile(idx * chunk_step, rebuilt[i], len) <= 0)
+            continue;
+        chunk_mark_stored(idx, chunk_step);
+        cache_chunk(rebuilt[i], len);
+        metrics_inc(METRIC_CHUNKS);
+        metrics_add(METRIC_PAYLOAD_BYTES, len);
+        LOG_INFO("Chunk[%u] rebuilt from parity", idx);
+        (*recovered)++;
+    }
+    metrics_add(METRIC_FEC_RECOVERED, *recovered);
+    return missing;
+}
+
+void processParity(const uint8_t *data, uint16_t length)
+{
+    const FEC_PARITY *parity = (const FEC_PARITY *)data;
+    uint16_t header = offsetof(FEC_PARITY, parity);
+    if (length < header || !(stream.codecs & CAP_CODEC_FEC) || stream.window <= 1)
+        return;
+    uint8_t chunk_code = parity->ChLen & CHUNK_LEN_CODE_MASK;
+    uint32_t chunk_step = decode_chunk_payload_max_size(chunk_code);
+    if (length != header + chunk_step || parity->row >= FEC_MAX_PARITY || !parity->data_count || parity->data_count > FEC_MAX_GROUP)
+    {
+        LOG_WARNING("Invalid parity frame (%u bytes)", length);
+        return;
+    }
+    metrics_inc(METRIC_FEC_PARITY_FRAMES);
+    if (parity->first_idx != fec_group.first_idx || parity->data_count != fec_group.data_count || chunk_code != fec_group.chunk_code)
+    {
+        fec_group.first_idx = parity->first_idx;
+        fec_group.data_count = parity->data_count;
+        fec_group.chunk_code = chunk_code;
+        fec_group.rows = 0;
+    }
+    bool known = false;
+    for (uint8_t r = 0; r < fec_group.rows; r++)
+        known |= fec_group.row[r] == parity->row;
+    if (!known && fec_group.rows < FEC_MAX_PARITY)
+    {
+        memcpy(fec_group.parity[fec_group.rows], parity->parity, chunk_step);
+        fec_group.row[fec_group.rows++] = parity->row;
+    }
+    if (!(parity->ChLen & CHUNK_ACK_REQUEST))
+        return;
+    uint64_t span = trace_begin();
+    uint8_t recovered;
+    uint8_t lost = fec_recover(chunk_step, &recovered);
+    fec_group.data_count = 0; // the parity rows were turned into syndromes
+    if (lost)
+        LOG_INFO("Chunks[%u..%u] : %u lost , %u rebuilt", parity->first_idx, parity->first_idx + parity->data_count - 1, lost, recovered);
+    send_stream_ack(UART_RESPOND_ACK, parity->first_idx + parity->data_count - 1, chunk_step, lost, recovered);
+    trace_end("ack", span);
+}
+
+void processFill(const uint8_t *data, uint16_t length)
+{
+    FILL_CHUNKS fill;
+    if (length < sizeof(fill) || !(stream.codecs & CAP_CODEC_FILL))
+        return;
+    memcpy(&fill, data, sizeof(fill));
+    uint32_t chunk_step = decode_chunk_payload_max_size(fill.ChLen & CHUNK_LEN_CODE_MASK);
+    uint32_t offset = (uint32_t)fill.first_idx * chunk_step;
+    uint64_t end = (uint64_t)(fill.first_idx + fill.count) * chunk_step;
+    if (end > binaryinfo.size)
+        end = binaryinfo.size;
+    UART_RSPONSE resp = UART_RESPOND_ACK;
+    // in order only, as a streamed chunk : the master goes back to next_expected otherwise
+    if (offset < end && (stream.window <= 1 || offset == stream.next_offset))
+    {
+        uint64_t write_start_us = metrics_now_us();
+        uint64_t span = trace_begin();
+        if (FillFileRange(offset, end - offset, fill.value) <= 0)
+            resp = UART_RESPOND_NACK;
+        else
+        {
+            // FEC : the chunks stored ahead are counted from the new end of the part stored in order
+            uint32_t skipped = fill.count;
+            if (chunk_step != stream.ahead_step || skipped >= 64)
+                stream.ahead = 0;
+            else
+                stream.ahead >>= skipped;
+            stream.next_offset = end;
+            chunks_merge_ahead(chunk_step);
+            metrics_inc(METRIC_FILL_FRAMES);
+            metrics_add(METRIC_CHUNKS, fill.count);
+            metrics_add(METRIC_PAYLOAD_BYTES, end - offset);
+        }
+        metrics_observe_us(METRIC_HIST_FILE_WRITE_US, metrics_now_us() - write_start_us);
+        trace_end_arg("file_fill", span, "chunk", fill.first_idx);
+        LOG_INFO("Filled Chunks[%u..%u] with %02X", fill.first_idx, fill.first_idx + fill.count - 1, fill.value);
+    }
+    else
+        LOG_WARNING("Fill of Chunks[%u..%u] out of order, expecting offset %u", fill.first_idx, fill.first_idx + fill.count - 1, stream.next_offset);
+    uint64_t span = trace_begin();
+    send_stream_ack(resp, fill.first_idx + fill.count - 1, chunk_step, 0, 0);
+    trace_end("ack", span);
+}
+
+void processCacheQuery(const uint8_t *data, uint16_t length)
+{
+    const CACHE_QUERY *query = (const CACHE_QUERY *)data;
+    uint16_t header = offsetof(CACHE_QUERY, hashes);
+    if (length < header || !(stream.codecs & CAP_CODEC_CACHE) || query->count > CACHE_QUERY_MAX ||
+        length != header + query->count * SHA256_DIGEST_SIZE)
+    {
+        LOG_WARNING("Invalid block cache query (%u bytes)", length);
+        return;
+    }
+    uint32_t chunk_step = decode_chunk_payload_max_size(query->ChLen & CHUNK_LEN_CODE_MASK);
+    CACHE_ANSWER answer = {.ChLen = query->ChLen, .first_idx = query->first_idx, .count = query->count, .have = 0};
+    uint8_t held = 0;
+    for (uint8_t i = 0; i < query->count; i++)
+        if (block_cache_has(query->hashes[i], chunk_length(query->first_idx + i, chunk_step)))
+        {
+            answer.have |= 1ULL << i;
+            held++;
+        }
+    LOG_INFO("Chunks[%u..%u] : %u in the block cache", query->first_idx, query->first_idx + query->count - 1, held);
+    Write_Data_to_Master(MY_ID, UART_CACHE_FRAME, (uint8_t *)&answer, sizeof(answer));
+}
+
+static size_t read_received(void *ctx, uint32_t offset, uint8_t *buf, uint16_t length)
+{
+    FILE *file = ctx;
+    return fseek(file, offset, SEEK_SET) == 0 ? fread(buf, 1, length, file) : 0;
+}
+
+/* Hash the received file once : the repair queries only read the tree. The repair writes to the file again,
+   it stays open until the next verify. 1 on success */
+static int build_received_tree(void)
+{
+    FILE *file = open_receive_file();
+    if (!file)
+        return -1;
+    uint64_t span = trace_begin();
+    int ret = hash_tree_build(&received_tree, read_received, file, binaryinfo.size);
+    trace_end("hash_tree", span);
+    if (ret <= 0)
+        LOG_ERROR("Error building the hash tree of %u bytes", binaryinfo.size);
+    else
+        LOG_INFO("Hash tree : %u leaves , %u levels", received_tree.count[0], received_tree.levels);
+    return ret;
+}
+
+void processHashQuery(const uint8_t *data, uint16_t length)
+{
+    HASH_ANSWER answer;
+    if (length < sizeof(answer.query))
+        return;
+    memcpy(&answer.query, data, sizeof(answer.query));
+    const HASH_QUERY *query = &answer.query;
+    if (!query->count || query->count > HASH_TREE_FANOUT)
+    {
+        LOG_WARNING("Invalid hash tree query (level %u , count %u)", query->level, query->count);
+        return;
+    }
+    if (!received_tree.levels && build_received_tree() <= 0) // the verify did not build it (slave restarted since)
+        return;
+    for (uint8_t i = 0; i < query->count; i++)
+    {
+        const uint8_t *node = hash_tree_node(&received_tree, query->level, query->first + i);
+        if (!node)
+        {
+            LOG_WARNING("Hash tree query past level %u (%u nodes from %u)", query->level, query->count, query->first);
+            return;
+        }
+        memcpy(answer.hashes[i], node, SHA256_DIGEST_SIZE);
+    }
+    LOG_INFO("Hash tree : level %u , %u nodes from %u", query->level, query->count, query->first);
+    Write_Data_to_Master(MY_ID, UART_HASH_FRAME, (uint8_t *)&answer, sizeof(answer.query) + query->count * SHA256_DIGEST_SIZE);
+}
+
+void processLinkRequest(const uint8_t *data, uint16_t length)
+{
+    LINK_REQUEST req;
+    if (length < sizeof(req))
+    {
+        Write_Info_to_Master(MY_ID, UART_RESPOND_NACK);
+        return;
+    }
+    memcpy(&req, data, sizeof(req));
+    switch (req.op)
+    {
+    case LINK_OP_SWITCH:
+        if (!caps_baud_bit(req.baud) || req.baud > baud_link.max_baud)
+        {
+            Write_Info_to_Master(MY_ID, UART_RESPOND_NACK);
+            break;
+        }
+        Write_Info_to_Master(MY_ID, UART_RESPOND_ACK); // returns once the ACK left at the current rate
+        link_set_baud(req.baud);
+        deadline_set_us(&baud_link.revert, LINK_REVERT_MS * 1000ULL);
+        LOG_INFO("LINK_SWITCH : %u bps (driver: %u bps)", req.baud, getBaudRate());
+        break;
+    case LINK_OP_PROBE:
+    {
+        uint8_t expected[LINK_PROBE_BYTES];
+        link_probe_pattern(expected, sizeof(expected), req.seq);
+        bool ok = (length == sizeof(req) + sizeof(expected) && memcmp(data + sizeof(req), expected, sizeof(expected)) == 0);
+        Write_Info_to_Master(MY_ID, ok ? UART_RESPOND_ACK : UART_RESPOND_NACK);
+        break;
+    }
+    case LINK_OP_COMMIT:
+        deadline_set_us(&baud_link.revert, 0);
+        Write_Info_to_Master(MY_ID, UART_RESPOND_ACK);
+        LOG_INFO("LINK_COMMIT : %u bps", baud_link.baud);
+        break;
+    default:
+        Write_Info_to_Master(MY_ID, UART_RESPOND_NACK);
+        break;
+    }
+}
+
 void processMasterCommand(uint8_t cmd_type)
 {
 
@@ -105,46 +788,34 @@ void processMasterCommand(uint8_t cmd_type)
     case UART_CMD_GET_BL_VERSION:
         uint8_t BL_version = encode_bootloader_version(BL_MAJOR_VERSION, BL_MINOR_VERSION);
         Write_Info_to_Master(MY_ID, BL_version);
-        sprintf(msg_buf, "CMD_GET_BL_VERSION:%02X", BL_version);
-        LOG_INFO(msg_buf);
+        LOG_INFO("CMD_GET_BL_VERSION:%02X", BL_version);
         break;
     case UART_CMD_GET_APP_VERSION:
-        BL_Version.major = 4;
-        sprintf(msg_buf, "CMD_GET_APP_VERSION:%02X", 0x00); // TOSET
-        LOG_INFO(msg_buf);
-        //
+        uint8_t APP_version = encode_bootloader_version(APP_MAJOR_VERSION, APP_MINOR_VERSION);
+        Write_Info_to_Master(MY_ID, APP_version);
+        LOG_INFO("CMD_GET_APP_VERSION:%02X", APP_version);
         break;
     case UART_CMD_ENTER_BOOTLOADER:
         Write_Info_to_Master(MY_ID, UART_RESPOND_ACK); // I'm already in bootloader mode
-        sprintf(msg_buf, "CMD_GET_ENTER_BOOTLOADER");
-        LOG_INFO(msg_buf);
+        LOG_INFO("CMD_GET_ENTER_BOOTLOADER");
         break;
     case UART_CMD_CHECK_SPACE:
         UART_RSPONSE resp = UART_RESPOND_ACK;
         if (check_space_by_writing_temp_file((size_t)binaryinfo.size) <= 0)
             resp = UART_RESPOND_NACK;
         Write_Info_to_Master(MY_ID, resp);
-        sprintf(msg_buf, "CMD_GET_CHECK_SPACE : %s", (resp == UART_RESPOND_ACK ? "ACK" : "NACK"));
-        LOG_INFO(msg_buf);
+        LOG_INFO("CMD_GET_CHECK_SPACE : %s", (resp == UART_RESPOND_ACK ? "ACK" : "NACK"));
         break;
     case UART_CMD_VERIFY_FILE_PARAMS:
-        close_binary_file();
-        size_t temp_file_size = 0;
-        char *temp_file_contents = read_binary_file(BINARY_FILE_PATH, &temp_file_size);
-        if (!temp_file_contents)
-        {
-            LOG_ERROR("Error reading binary file");
-            Write_Info_to_Master(MY_ID, UART_RESPOND_NACK);
-            break;
-        }
-        uint32_t temp_file_crc32 = crc_32((uint8_t *)temp_file_contents, temp_file_size);
-        resp = (temp_file_crc32 == binaryinfo.crc32 && temp_file_size == binaryinfo.size)
-                   ? UART_RESPOND_ACK
-                   : UART_RESPOND_NACK;
-        sprintf(msg_buf, "CMD_VERIFY_FILE_PARAMS : %s", (resp == UART_RESPOND_ACK ? "ACK" : "NACK"));
-        LOG_INFO(msg_buf);
+        trim_receive_file(binaryinfo.size); // closes it
+        block_cache_flush();
+        hash_tree_free(&received_tree);
+        resp = patch.active ? verify_patch() : (file_matches(BINARY_FILE_PATH, &binaryinfo) ? UART_RESPOND_ACK : UART_RESPOND_NACK);
+        LOG_INFO("CMD_VERIFY_FILE_PARAMS : %s", (resp == UART_RESPOND_ACK ? "ACK" : "NACK"));
+        // the master searches the chunks that differ next : hashed once here, before the answer it waits for
+        if (resp != UART_RESPOND_ACK && (stream.hashes & CAP_HASH_TREE))
+            build_received_tree();
         Write_Info_to_Master(MY_ID, resp);
-        free(temp_file_contents);
         break;
     case UART_CMD_END_SESSION:
         quitApp = true;
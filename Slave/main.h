@@ -27,6 +27,24 @@ extern "C"
 #define BL_MINOR_VERSION 0 // Bootloader minor version
 
 #define BINARY_FILE_PATH "./app_xx.bin"
+#define PATCH_FILE_PATH "./app_xx.patch" // patch received (CAP_CODEC_PATCH), applied to BINARY_FILE_PATH at verify
+#define PATCHED_FILE_PATH "./app_xx.new" // result of the patch, renamed to BINARY_FILE_PATH once verified
+#define BLOCK_CACHE_DATA_PATH "./block_cache.bin"  // chunks received, kept for later transfers (block_cache.h)
+#define BLOCK_CACHE_INDEX_PATH "./block_cache.idx" // their SHA-256
+#define BLOCK_CACHE_BLOCKS 4096                    // blocks kept (4 KB slots : 16 MB), the oldest is replaced
+#define SLAVE_MAX_CHUNK_PAYLOAD 4096 // largest chunk payload accepted at session open
+#define SLAVE_STREAM_WINDOW 32       // chunks accepted between two ACKs in streaming mode (-f)
+#define APP_MAJOR_VERSION 1          // Application major version (answer to GET_APP_VERSION) TOSET
+#define APP_MINOR_VERSION 0          // Application minor version
+
+
+    /* Slave time phases reported by the metrics */
+    typedef enum
+    {
+        SLAVE_PHASE_WAIT_REQUEST = 0, // waiting for / receiving a frame
+        SLAVE_PHASE_PROCESS_REQUEST,  // handling the frame (file I/O, response)
+        SLAVE_PHASE_COUNT
+    } SLAVE_PHASE;
 
 #ifdef __cplusplus
 }
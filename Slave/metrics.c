@@ -0,0 +1,208 @@
+/**
+ * @file metrics.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include "metrics.h"
+#include "serialport.h"
+#include "log.h"
+
+static const char *COUNTER_NAMES[METRIC_COUNT] = {
+    "frames_tx", "frames_rx", "bytes_tx", "bytes_rx", "crc_errors", "id_mismatches",
+    "oversize_frames", "partial_timeouts", "response_timeouts", "retransmits", "chunks", "payload_bytes",
+    "uart_overruns", "uart_buf_overruns", "uart_frame_errors", "uart_parity_errors", "uart_breaks", "peer_uart_errors",
+    "fec_parity_frames", "fec_recovered", "fill_frames", "cache_refs", "repaired_chunks"};
+static const char *HISTOGRAM_NAMES[METRIC_HIST_COUNT] = {"response_us", "file_write_us"};
+
+typedef struct
+{
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS]; // bucket i counts values <= 2^i us
+    uint64_t count;
+    uint64_t sum;
+} Histogram;
+
+static struct
+{
+    const char *app;
+    const char *export_path;
+    bool prometheus;
+    const char *const *phase_names;
+    int phase_count;
+    int phase;
+    uint64_t phase_start_us;
+    uint64_t phase_us[METRICS_MAX_PHASES];
+    uint64_t start_us;
+    uint64_t last_export_us;
+    uint64_t counters[METRIC_COUNT];
+    Histogram hist[METRIC_HIST_COUNT];
+} metrics = {.app = "app", .phase = -1};
+
+uint64_t metrics_now_us(void)
+{
+    return monotonic_us();
+}
+
+void metrics_init(const char *app, const char *const *phase_names, int phase_count)
+{
+    metrics.app = app;
+    metrics.phase_names = phase_names;
+    metrics.phase_count = (phase_count < METRICS_MAX_PHASES) ? phase_count : METRICS_MAX_PHASES;
+    metrics.start_us = metrics_now_us();
+    metrics.last_export_us = metrics.start_us;
+}
+
+int metrics_set_export_path(const char *path)
+{
+    size_t len = path ? strlen(path) : 0;
+    if (!len)
+        return -1;
+    metrics.export_path = path;
+    metrics.prometheus = (len > 5 && strcmp(path + len - 5, ".prom") == 0);
+    return 1;
+}
+
+void metrics_add(METRIC_COUNTER counter, uint64_t value)
+{
+    metrics.counters[counter] += value;
+}
+
+uint64_t metrics_get(METRIC_COUNTER counter)
+{
+    return metrics.counters[counter];
+}
+
+void metrics_observe_us(METRIC_HISTOGRAM hist, uint64_t us)
+{
+    Histogram *h = &metrics.hist[hist];
+    int bucket = 0;
+    while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && us > (1ULL << bucket))
+        bucket++;
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum += us;
+}
+
+void metrics_enter_phase(int phase)
+{
+    uint64_t now = metrics_now_us();
+    if (metrics.phase >= 0 && metrics.phase < metrics.phase_count)
+        metrics.phase_us[metrics.phase] += now - metrics.phase_start_us;
+    metrics.phase = phase;
+    metrics.phase_start_us = now;
+}
+
+static double goodput(uint64_t elapsed_us)
+{
+    return elapsed_us ? (double)metrics.counters[METRIC_PAYLOAD_BYTES] * 1e6 / (double)elapsed_us : 0.0;
+}
+
+// Time spent in phase, including the still running one
+static uint64_t phase_time_us(int phase, uint64_t now)
+{
+    uint64_t us = metrics.phase_us[phase];
+    if (phase == metrics.phase)
+        us += now - metrics.phase_start_us;
+    return us;
+}
+
+static void write_json(FILE *f, uint64_t now)
+{
+    uint64_t elapsed = now - metrics.start_us;
+    fprintf(f, "{\n  \"app\": \"%s\",\n  \"elapsed_us\": %llu,\n", metrics.app, (unsigned long long)elapsed);
+    fprintf(f, "  \"goodput_bytes_per_second\": %.1f,\n  \"counters\": {", goodput(elapsed));
+    for (int i = 0; i < METRIC_COUNT; i++)
+        fprintf(f, "%s\n    \"%s\": %llu", i ? "," : "", COUNTER_NAMES[i], (unsigned long long)metrics.counters[i]);
+    fprintf(f, "\n  },\n  \"phases_us\": {");
+    const char *sep = "";
+    for (int i = 0; i < metrics.phase_count; i++)
+    {
+        if (!metrics.phase_names || !metrics.phase_names[i])
+            continue;
+        fprintf(f, "%s\n    \"%s\": %llu", sep, metrics.phase_names[i], (unsigned long long)phase_time_us(i, now));
+        sep = ",";
+    }
+    fprintf(f, "\n  },\n  \"histograms\": {");
+    for (int h = 0; h < METRIC_HIST_COUNT; h++)
+    {
+        const Histogram *hist = &metrics.hist[h];
+        fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"sum\": %llu, \"buckets\": [", h ? "," : "", HISTOGRAM_NAMES[h],
+                (unsigned long long)hist->count, (unsigned long long)hist->sum);
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++)
+            fprintf(f, "%s%llu", b ? ", " : "", (unsigned long long)hist->buckets[b]);
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n  }\n}\n");
+}
+
+static void write_prometheus(FILE *f, uint64_t now)
+{
+    uint64_t elapsed = now - metrics.start_us;
+    fprintf(f, "# TYPE uart_elapsed_seconds gauge\nuart_elapsed_seconds{app=\"%s\"} %.6f\n", metrics.app, elapsed / 1e6);
+    fprintf(f, "# TYPE uart_goodput_bytes_per_second gauge\nuart_goodput_bytes_per_second{app=\"%s\"} %.1f\n", metrics.app, goodput(elapsed));
+    for (int i = 0; i < METRIC_COUNT; i++)
+        fprintf(f, "# TYPE uart_%s_total counter\nuart_%s_total{app=\"%s\"} %llu\n", COUNTER_NAMES[i], COUNTER_NAMES[i],
+                metrics.app, (unsigned long long)metrics.counters[i]);
+    fprintf(f, "# TYPE uart_phase_seconds_total counter\n");
+    for (int i = 0; i < metrics.phase_count; i++)
+    {
+        if (!metrics.phase_names || !metrics.phase_names[i])
+            continue;
+        fprintf(f, "uart_phase_seconds_total{app=\"%s\",phase=\"%s\"} %.6f\n", metrics.app, metrics.phase_names[i], phase_time_us(i, now) / 1e6);
+    }
+    for (int h = 0; h < METRIC_HIST_COUNT; h++)
+    {
+        const Histogram *hist = &metrics.hist[h];
+        uint64_t cumulative = 0;
+        fprintf(f, "# TYPE uart_%s histogram\n", HISTOGRAM_NAMES[h]);
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++)
+        {
+            cumulative += hist->buckets[b];
+            fprintf(f, "uart_%s_bucket{app=\"%s\",le=\"%llu\"} %llu\n", HISTOGRAM_NAMES[h], metrics.app, 1ULL << b, (unsigned long long)cumulative);
+        }
+        fprintf(f, "uart_%s_bucket{app=\"%s\",le=\"+Inf\"} %llu\n", HISTOGRAM_NAMES[h], metrics.app, (unsigned long long)hist->count);
+        fprintf(f, "uart_%s_sum{app=\"%s\"} %llu\n", HISTOGRAM_NAMES[h], metrics.app, (unsigned long long)hist->sum);
+        fprintf(f, "uart_%s_count{app=\"%s\"} %llu\n", HISTOGRAM_NAMES[h], metrics.app, (unsigned long long)hist->count);
+    }
+}
+
+int metrics_export(void)
+{
+    if (!metrics.export_path)
+        return 0;
+    uint64_t now = metrics_now_us();
+    metrics.last_export_us = now;
+
+    // write a temporary file then rename it, readers never see a partial file
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics.export_path);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f)
+    {
+        LOG_ERROR("Error opening metrics file %s", tmp_path);
+        return -1;
+    }
+    if (metrics.prometheus)
+        write_prometheus(f, now);
+    else
+        write_json(f, now);
+    fclose(f);
+    if (rename(tmp_path, metrics.export_path) != 0)
+    {
+        LOG_ERROR("Error renaming metrics file %s", tmp_path);
+        return -2;
+    }
+    return 1;
+}
+
+void metrics_poll(void)
+{
+    if (metrics.export_path && metrics_now_us() - metrics.last_export_us >= METRICS_EXPORT_PERIOD_MS * 1000ULL)
+        metrics_export();
+}
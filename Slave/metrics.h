@@ -0,0 +1,86 @@
+/**
+ * @file metrics.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Transfer metrics: counters, per-phase timers and latency histograms,
+ *         exported as JSON or as a Prometheus textfile (".prom" extension).
+ * @version 0.1
+ * @date 2023-12-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef METRICS_HEADER_H_
+#define METRICS_HEADER_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define METRICS_EXPORT_PERIOD_MS 1000 /* periodic export while the session runs */
+#define METRICS_MAX_PHASES 16
+#define METRICS_HISTOGRAM_BUCKETS 25 /* power of two buckets: 1us .. 16s */
+
+    typedef enum
+    {
+        METRIC_FRAMES_TX,         // frames written to the serial port
+        METRIC_FRAMES_RX,         // valid frames received
+        METRIC_BYTES_TX,          // raw bytes written
+        METRIC_BYTES_RX,          // raw bytes read
+        METRIC_CRC_ERRORS,        // tryGetResquestFromMaster() == -3
+        METRIC_ID_MISMATCHES,     // tryGetResquestFromMaster() == -1
+        METRIC_OVERSIZE_FRAMES,   // tryGetResquestFromMaster() == -2
+        METRIC_PARTIAL_TIMEOUTS,  // timeout in the middle of a frame
+        METRIC_RESPONSE_TIMEOUTS, // no response from the slave
+        METRIC_RETRANSMITS,       // frames sent again after a failed attempt
+        METRIC_CHUNKS,            // file chunks sent / stored
+        METRIC_PAYLOAD_BYTES,     // file bytes sent / stored (goodput)
+        METRIC_UART_OVERRUNS,     // driver : UART FIFO overruns (TIOCGICOUNT)
+        METRIC_UART_BUF_OVERRUNS, // driver : tty buffer overruns
+        METRIC_UART_FRAME_ERRORS, // driver : framing errors
+        METRIC_UART_PARITY_ERRORS, // driver : parity errors
+        METRIC_UART_BREAKS,       // driver : breaks
+        METRIC_PEER_UART_ERRORS,  // master : receive errors reported by the slave (STREAM_ACK)
+        METRIC_FEC_PARITY_FRAMES, // FEC parity frames sent / received
+        METRIC_FEC_RECOVERED,     // chunks lost and rebuilt from parity frames (master : as reported by the slave)
+        METRIC_FILL_FRAMES,       // UART_FILL_FRAME sent / applied
+        METRIC_CACHE_REFS,        // chunks sent / stored as a block cache reference (CHUNK_CACHE_REF)
+        METRIC_REPAIRED_CHUNKS,   // master : chunks sent again after a failed verify (hash tree search)
+        METRIC_COUNT
+    } METRIC_COUNTER;
+
+    typedef enum
+    {
+        METRIC_HIST_RESPONSE_US,   // master: end of request to end of response
+        METRIC_HIST_FILE_WRITE_US, // slave: StoreDataIntoFile() duration
+        METRIC_HIST_COUNT
+    } METRIC_HISTOGRAM;
+
+    // Start the clocks, app is used as label ("master" / "slave"), phase_names may be NULL
+    void metrics_init(const char *app, const char *const *phase_names, int phase_count);
+    // Enable export to path (JSON, or Prometheus text format if path ends with ".prom")
+    int metrics_set_export_path(const char *path);
+
+    // Monotonic clock used by every metric, in microseconds
+    uint64_t metrics_now_us(void);
+
+    void metrics_add(METRIC_COUNTER counter, uint64_t value);
+    static inline void metrics_inc(METRIC_COUNTER counter) { metrics_add(counter, 1); }
+    uint64_t metrics_get(METRIC_COUNTER counter);
+    void metrics_observe_us(METRIC_HISTOGRAM hist, uint64_t us);
+
+    // Charge the time since the last call to the previous phase, then switch to phase
+    void metrics_enter_phase(int phase);
+
+    // Export if METRICS_EXPORT_PERIOD_MS elapsed since the last export
+    void metrics_poll(void);
+    // Export now (end of session)
+    int metrics_export(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // METRICS_HEADER_H_
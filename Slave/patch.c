@@ -0,0 +1,192 @@
+/**
+ * @file patch.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <string.h>
+#include "log.h"
+#include "patch.h"
+
+void patch_apply_init(PATCH_APPLIER *applier, FILE *base, FILE *out)
+{
+    applier->base = base;
+    applier->out = out;
+    applier->state = PATCH_DIFF_LEN;
+    applier->varint = 0;
+    applier->shift = 0;
+    applier->diff_left = 0;
+    applier->extra_left = 0;
+    applier->run_left = 0;
+    applier->seek = 0;
+    applier->base_pos = 0;
+    applier->out_size = 0;
+}
+
+// count base bytes at base_pos plus add (NULL : unchanged) to the output
+static int copy_base(PATCH_APPLIER *applier, const uint8_t *add, uint64_t count)
+{
+    while (count)
+    {
+        size_t size = (count < sizeof(applier->buf)) ? count : sizeof(applier->buf);
+        if (fseek(applier->base, applier->base_pos, SEEK_SET) != 0 || fread(applier->buf, 1, size, applier->base) != size)
+            return -1; // past the end of the base
+        for (size_t i = 0; add && i < size; i++)
+            applier->buf[i] += add[i];
+        if (fwrite(applier->buf, 1, size, applier->out) != size)
+            return -2;
+        applier->base_pos += size;
+        applier->out_size += size;
+        count -= size;
+        if (add)
+            add += size;
+    }
+    return 0;
+}
+
+// Next part of the record : diff tokens, extra bytes, or the next record once the seek is applied
+static int record_next(PATCH_APPLIER *applier)
+{
+    if (applier->diff_left)
+        applier->state = PATCH_DIFF_TOKEN;
+    else if (applier->extra_left)
+        applier->state = PATCH_EXTRA;
+    else
+    {
+        if (applier->seek < 0 && (uint64_t)-applier->seek > applier->base_pos)
+            return -1;
+        applier->base_pos += applier->seek;
+        applier->state = PATCH_DIFF_LEN;
+    }
+    return 0;
+}
+
+int patch_apply_feed(PATCH_APPLIER *applier, const uint8_t *bytes, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        int ret = 0;
+        if (applier->state == PATCH_DIFF_BYTES || applier->state == PATCH_EXTRA)
+        {
+            uint64_t left = (applier->state == PATCH_EXTRA) ? applier->extra_left : applier->run_left;
+            size_t size = (count - i < left) ? count - i : left;
+            if (applier->state == PATCH_EXTRA)
+            {
+                if (fwrite(bytes + i, 1, size, applier->out) != size)
+                    return -2;
+                applier->out_size += size;
+                applier->extra_left -= size;
+            }
+            else if ((ret = copy_base(applier, bytes + i, size)) < 0)
+                return ret;
+            else
+            {
+                applier->run_left -= size;
+                applier->diff_left -= size;
+            }
+            i += size;
+            if ((applier->state == PATCH_EXTRA ? applier->extra_left : applier->run_left) == 0 && record_next(applier) < 0)
+                return -1;
+            continue;
+        }
+        // numbers : LEB128, low groups first
+        uint8_t byte = bytes[i++];
+        if (applier->shift >= 64)
+            return -1;
+        applier->varint |= (uint64_t)(byte & 0x7F) << applier->shift;
+        applier->shift += 7;
+        if (byte & 0x80)
+            continue;
+        uint64_t value = applier->varint;
+        applier->varint = 0;
+        applier->shift = 0;
+        switch (applier->state)
+        {
+        case PATCH_DIFF_LEN:
+            applier->diff_left = value;
+            applier->state = PATCH_EXTRA_LEN;
+            break;
+        case PATCH_EXTRA_LEN:
+            applier->extra_left = value;
+            applier->state = PATCH_SEEK;
+            break;
+        case PATCH_SEEK:
+            applier->seek = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+            ret = record_next(applier);
+            break;
+        case PATCH_DIFF_TOKEN:
+            applier->run_left = value >> 1;
+            if (!applier->run_left || applier->run_left > applier->diff_left)
+                return -1;
+            if (value & 1)
+            {
+                applier->state = PATCH_DIFF_BYTES;
+                break;
+            }
+            if ((ret = copy_base(applier, NULL, applier->run_left)) < 0)
+                return ret;
+            applier->diff_left -= applier->run_left;
+            applier->run_left = 0;
+            ret = record_next(applier);
+            break;
+        default:
+            break;
+        }
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+int patch_apply_finish(const PATCH_APPLIER *applier)
+{
+    return (applier->state == PATCH_DIFF_LEN && !applier->shift) ? 1 : 0;
+}
+
+int patch_apply_file(const char *base_path, const char *patch_path, const char *out_path)
+{
+    FILE *base = fopen(base_path, "rb");
+    FILE *patch = fopen(patch_path, "rb");
+    FILE *out = fopen(out_path, "wb");
+    int ret = -2;
+    if (base && patch && out)
+    {
+        static PATCH_APPLIER applier;
+        uint8_t bytes[PATCH_BUFFER_SIZE];
+        size_t count;
+        patch_apply_init(&applier, base, out);
+        ret = 0;
+        while (ret == 0 && (count = fread(bytes, 1, sizeof(bytes), patch)) > 0)
+            ret = patch_apply_feed(&applier, bytes, count);
+        if (ret == 0)
+            ret = patch_apply_finish(&applier) ? 1 : -1;
+        if (ret == -1)
+            LOG_ERROR("Invalid patch %s at output byte %llu", patch_path, (unsigned long long)applier.out_size);
+    }
+    else
+        LOG_ERROR("Error opening %s , %s or %s", base_path, patch_path, out_path);
+    if (base)
+        fclose(base);
+    if (patch)
+        fclose(patch);
+    if (out && fclose(out) != 0 && ret > 0)
+        ret = -2;
+    return ret;
+}
+
+size_t patch_put_varint(uint8_t *buf, uint64_t value)
+{
+    size_t size = 0;
+    while (value >= 0x80)
+    {
+        buf[size++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    buf[size++] = (uint8_t)value;
+    return size;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file patch.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Binary patch (bsdiff style) of a base file into a new file, applied as a stream : the patch is read once
+ *         in order, the base is read where the records point, the new file is written in order. Memory use does
+ *         not depend on the file sizes.
+ * @version 0.1
+ * @date 2023-12-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef PATCH_HEADER_H_
+#define PATCH_HEADER_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /*
+     * The patch is a sequence of records, every number is a LEB128 varint :
+     *  ____________________________________________________________________________
+     * | diff_len | extra_len | zigzag(seek) | diff tokens        | extra bytes      |
+     * |          |           |              | (diff_len bytes)   | (extra_len)      |
+     * ------------------------------------------------------------------------------
+     * diff     : the next diff_len bytes of the new file are the base bytes at pos plus a difference (mod 256),
+     *            given by tokens : (n << 1) for n unchanged bytes, (n << 1 | 1) followed by n difference bytes
+     * extra    : the next extra_len bytes of the new file, as is
+     * then pos += diff_len + seek
+     */
+
+#define PATCH_BUFFER_SIZE 4096 /* base / output bytes handled at once */
+
+    typedef enum
+    {
+        PATCH_DIFF_LEN = 0,
+        PATCH_EXTRA_LEN,
+        PATCH_SEEK,
+        PATCH_DIFF_TOKEN,
+        PATCH_DIFF_SAME,  // base bytes copied unchanged
+        PATCH_DIFF_BYTES, // difference bytes added to the base bytes
+        PATCH_EXTRA,
+    } PATCH_STATE;
+
+    typedef struct
+    {
+        FILE *base;
+        FILE *out;
+        PATCH_STATE state;
+        uint64_t varint; // number being decoded
+        uint8_t shift;
+        uint64_t diff_left;  // diff bytes of the record not produced yet
+        uint64_t extra_left; // extra bytes of the record not produced yet
+        uint64_t run_left;   // bytes left in the current diff token
+        int64_t seek;
+        uint64_t base_pos;   // base offset of the next diff byte
+        uint64_t out_size;   // bytes written
+        uint8_t buf[PATCH_BUFFER_SIZE];
+    } PATCH_APPLIER;
+
+    // Apply to base, the new file is written to out
+    void patch_apply_init(PATCH_APPLIER *applier, FILE *base, FILE *out);
+    // Push the next count bytes of the patch : 0 when consumed, -1 if the patch is invalid, -2 on a file error
+    int patch_apply_feed(PATCH_APPLIER *applier, const uint8_t *bytes, size_t count);
+    // The whole patch was pushed : 1 if it ended on a record boundary
+    int patch_apply_finish(const PATCH_APPLIER *applier);
+    // Write base_path patched with the file patch_path to out_path, 1 on success
+    int patch_apply_file(const char *base_path, const char *patch_path, const char *out_path);
+
+    // Append value as a varint to buf, returns the bytes written (at most 10)
+    size_t patch_put_varint(uint8_t *buf, uint64_t value);
+    static inline uint64_t patch_zigzag(int64_t value) { return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); }
+
+#ifdef __cplusplus
+}
+#endif
+#endif // PATCH_HEADER_H_
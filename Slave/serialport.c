@@ -1,10 +1,22 @@
+#define _GNU_SOURCE // ppoll()
 #include "serialport.h"
+#include "log.h"
+#include "capture.h"
+#include "serialport_termios2.h"
 
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <linux/serial.h> // struct serial_rs485
+#endif
 
 int serial_fd;
+// Rate the port runs at (as reported by the driver when it can tell)
+static unsigned int currentBaud;
+// True once the driver drives the RS-485 transceiver direction (TIOCSRS485)
+static bool rs485Kernel;
 
 //_____________________________________
 // ::: Constructors and destructors :::
@@ -16,14 +28,97 @@ static int readStringNoTimeOut(char *String, char FinalChar, unsigned int MaxNbB
 // static bool currentStateRTS;
 // static bool currentStateDTR;
 
-// Used to store the previous time (for computing timeout)
-static struct timeval previousTime;
-
 void closeDevice();
 
 //_________________________________________
 // ::: Configuration and initialization :::
 
+#if defined(__linux__) || defined(__APPLE__)
+// True if the driver got close enough to the requested rate for the link to work
+static bool baud_within_tolerance(unsigned int requested, unsigned int achieved)
+{
+    unsigned int gap = (achieved > requested) ? achieved - requested : requested - achieved;
+    return achieved && (uint64_t)gap * 100 <= (uint64_t)requested * BAUD_TOLERANCE_PERCENT;
+}
+
+// termios speed constant of a baud rate, false if the rate is not in the Bxxxx table
+static bool baud_to_speed(unsigned int Bauds, speed_t *Speed)
+{
+    switch (Bauds)
+    {
+    case 110:
+        *Speed = B110;
+        break;
+    case 300:
+        *Speed = B300;
+        break;
+    case 600:
+        *Speed = B600;
+        break;
+    case 1200:
+        *Speed = B1200;
+        break;
+    case 2400:
+        *Speed = B2400;
+        break;
+    case 4800:
+        *Speed = B4800;
+        break;
+    case 9600:
+        *Speed = B9600;
+        break;
+    case 19200:
+        *Speed = B19200;
+        break;
+    case 38400:
+        *Speed = B38400;
+        break;
+    case 57600:
+        *Speed = B57600;
+        break;
+    case 115200:
+        *Speed = B115200;
+        break;
+    case 230400:
+        *Speed = B230400;
+        break;
+    case 460800:
+        *Speed = B460800;
+        break;
+    case 921600:
+        *Speed = B921600;
+        break;
+    case 1000000:
+        *Speed = B1000000;
+        break;
+    case 1152000:
+        *Speed = B1152000;
+        break;
+    case 1500000:
+        *Speed = B1500000;
+        break;
+    case 2000000:
+        *Speed = B2000000;
+        break;
+    case 2500000:
+        *Speed = B2500000;
+        break;
+    case 3000000:
+        *Speed = B3000000;
+        break;
+    case 3500000:
+        *Speed = B3500000;
+        break;
+    case 4000000:
+        *Speed = B4000000;
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+#endif
+
 /*!
      \brief Open the serial port
      \param Device : Port name (COM1, COM2, ... for Windows ) or (/dev/ttyS0, /dev/ttyACM0, /dev/ttyUSB0 ... for linux)
@@ -69,6 +164,8 @@ void closeDevice();
                         - 3000000
                         - 3500000
                         - 4000000
+                        - any other integer rate the driver can reach within
+                          BAUD_TOLERANCE_PERCENT (termios2 / BOTHER)
      \param Databits : Number of data bits in one UART transmission.
 
             \n Supported values: \n
@@ -97,7 +194,7 @@ void closeDevice();
      \return -1 device not found
      \return -2 error while opening the device
      \return -3 error while getting port parameters
-     \return -4 Speed (Bauds) not recognized
+     \return -4 Speed (Bauds) not supported by the driver
      \return -5 error while writing port parameters
      \return -6 error while writing timeout parameters
      \return -7 Databits not recognized
@@ -287,79 +384,11 @@ char openDevice(const char *Device, const unsigned int Bauds)
     // Clear all the options
     bzero(&options, sizeof(options));
 
-    // Prepare speed (Bauds)
+    // Prepare speed (Bauds), rates out of the Bxxxx table are set later through termios2
     speed_t Speed;
-    switch (Bauds)
-    {
-    case 110:
-        Speed = B110;
-        break;
-    case 300:
-        Speed = B300;
-        break;
-    case 600:
-        Speed = B600;
-        break;
-    case 1200:
-        Speed = B1200;
-        break;
-    case 2400:
-        Speed = B2400;
-        break;
-    case 4800:
-        Speed = B4800;
-        break;
-    case 9600:
-        Speed = B9600;
-        break;
-    case 19200:
-        Speed = B19200;
-        break;
-    case 38400:
+    bool customBaud = !baud_to_speed(Bauds, &Speed);
+    if (customBaud)
         Speed = B38400;
-        break;
-    case 57600:
-        Speed = B57600;
-        break;
-    case 115200:
-        Speed = B115200;
-        break;
-    case 230400:
-        Speed = B230400;
-        break;
-    case 460800:
-        Speed = B460800;
-        break;
-    case 921600:
-        Speed = B921600;
-        break;
-    case 1000000:
-        Speed = B1000000;
-        break;
-    case 1152000:
-        Speed = B1152000;
-        break;
-    case 1500000:
-        Speed = B1500000;
-        break;
-    case 2000000:
-        Speed = B2000000;
-        break;
-    case 2500000:
-        Speed = B2500000;
-        break;
-    case 3000000:
-        Speed = B3000000;
-        break;
-    case 3500000:
-        Speed = B3500000;
-        break;
-    case 4000000:
-        Speed = B4000000;
-        break;
-    default:
-        return -4;
-    }
     int databits_flag = 0;
     switch (Databits)
     {
@@ -416,17 +445,180 @@ char openDevice(const char *Device, const unsigned int Bauds)
     // Ignore modem control lines (CLOCAL) and Enable receiver (CREAD)
     options.c_cflag |= (CLOCAL | CREAD | databits_flag | parity_flag | stopbits_flag);
     options.c_iflag |= (IGNPAR | IGNBRK);
-    // Timer unused
-    options.c_cc[VTIME] = 1;
+    // Timer unused : read() returns at once, timeouts are handled by waitReadable()
+    options.c_cc[VTIME] = 0;
     // At least on character before satisfy reading
     options.c_cc[VMIN] = 0;
     // Activate the settings
     tcsetattr(serial_fd, TCSANOW, &options);
+    currentBaud = customBaud ? termios2_set_baud(serial_fd, Bauds) : termios2_get_baud(serial_fd);
+    if (customBaud && !baud_within_tolerance(Bauds, currentBaud))
+        return -4;
+    if (!currentBaud)
+        currentBaud = Bauds;
     // Success
     return (1);
 #endif
 }
 
+/*!
+     \brief Change the baud rate of the opened serial port, pending output is sent first
+     \param Bauds : new baud rate (same list as openDevice())
+     \return 1 success
+     \return -3 error while getting port parameters
+     \return -4 Speed (Bauds) not supported by the driver
+     \return -5 error while writing port parameters
+  */
+char setBaudRate(const unsigned int Bauds)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    DCB dcbSerialParams;
+    dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
+    if (!GetCommState(hSerial, &dcbSerialParams))
+        return -3;
+    dcbSerialParams.BaudRate = Bauds;
+    if (!SetCommState(hSerial, &dcbSerialParams))
+        return -5;
+    currentBaud = Bauds;
+    return 1;
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+    struct termios options;
+    speed_t Speed;
+    if (!baud_to_speed(Bauds, &Speed))
+    {
+        // not in the Bxxxx table : termios2 / BOTHER
+        unsigned int achieved = termios2_set_baud(serial_fd, Bauds);
+        if (!baud_within_tolerance(Bauds, achieved))
+            return -4;
+        currentBaud = achieved;
+        return 1;
+    }
+    if (tcgetattr(serial_fd, &options) != 0)
+        return -3;
+    cfsetispeed(&options, Speed);
+    cfsetospeed(&options, Speed);
+    if (tcsetattr(serial_fd, TCSADRAIN, &options) != 0)
+        return -5;
+    currentBaud = termios2_get_baud(serial_fd);
+    if (!currentBaud)
+        currentBaud = Bauds;
+    return 1;
+#endif
+}
+
+/*!
+     \brief Rate the serial port runs at
+     \return the rate reported by the driver (it may differ slightly from the one
+              requested, by up to BAUD_TOLERANCE_PERCENT for a non standard rate)
+  */
+unsigned int getBaudRate()
+{
+    return currentBaud;
+}
+
+/*!
+     \brief Hand the RS-485 transceiver direction to the driver (TIOCSRS485) : RTS is
+            raised before the first start bit and dropped after the last stop bit
+     \param enable : true for the kernel RS-485 mode, false for plain UART
+     \param delayBeforeSend_ms : delay between raising RTS and the first bit
+     \param delayAfterSend_ms : delay between the last stop bit and dropping RTS
+     \return 1 success
+     \return -1 the driver (or the platform) does not support RS-485 mode
+     \return -3 could not read the current RS-485 configuration
+  */
+char setRS485(bool enable, unsigned int delayBeforeSend_ms, unsigned int delayAfterSend_ms)
+{
+#if defined(__linux__)
+    struct serial_rs485 rs485;
+    memset(&rs485, 0, sizeof(rs485));
+    if (ioctl(serial_fd, TIOCGRS485, &rs485) != 0)
+        return (errno == ENOTTY || errno == EINVAL) ? -1 : -3;
+    if (enable)
+    {
+        rs485.flags |= SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+        rs485.flags &= ~(SER_RS485_RTS_AFTER_SEND | SER_RS485_RX_DURING_TX);
+        rs485.delay_rts_before_send = delayBeforeSend_ms;
+        rs485.delay_rts_after_send = delayAfterSend_ms;
+    }
+    else
+        rs485.flags &= ~SER_RS485_ENABLED;
+    if (ioctl(serial_fd, TIOCSRS485, &rs485) != 0)
+        return -1;
+    rs485Kernel = enable;
+    return 1;
+#else
+    (void)delayBeforeSend_ms;
+    (void)delayAfterSend_ms;
+    return enable ? -1 : 1;
+#endif
+}
+
+/*!
+     \brief Turn RTS/CTS hardware flow control on or off : the driver holds the
+            transmission while CTS is low and lowers RTS when its receive buffer fills up
+     \param rtscts : true to enable flow control
+     \return 1 success
+     \return -3 could not read the port configuration
+     \return -5 could not apply it
+  */
+char setFlowControl(bool rtscts)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    DCB dcbSerialParams;
+    dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
+    if (!GetCommState(hSerial, &dcbSerialParams))
+        return -3;
+    dcbSerialParams.fOutxCtsFlow = rtscts;
+    dcbSerialParams.fRtsControl = rtscts ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_ENABLE;
+    if (!SetCommState(hSerial, &dcbSerialParams))
+        return -5;
+    return 1;
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+    struct termios options;
+    if (tcgetattr(serial_fd, &options) != 0)
+        return -3;
+    if (rtscts)
+        options.c_cflag |= CRTSCTS;
+    else
+        options.c_cflag &= ~CRTSCTS;
+    if (tcsetattr(serial_fd, TCSANOW, &options) != 0)
+        return -5;
+    return 1;
+#endif
+}
+
+/*!
+     \brief Read the receive error counters of the driver (TIOCGICOUNT)
+     \param counters : filled with the totals since the port was opened
+     \return 1 success
+     \return -1 the driver (or the platform) does not count errors
+  */
+char getErrorCounters(SerialErrorCounters *counters)
+{
+#if defined(__linux__)
+    struct serial_icounter_struct icount;
+    if (ioctl(serial_fd, TIOCGICOUNT, &icount) != 0)
+        return -1;
+    counters->overrun = icount.overrun;
+    counters->buf_overrun = icount.buf_overrun;
+    counters->frame = icount.frame;
+    counters->parity = icount.parity;
+    counters->brk = icount.brk;
+    return 1;
+#else
+    (void)counters;
+    return -1;
+#endif
+}
+
+// True if the driver switches the RS-485 direction
+bool isRS485()
+{
+    return rs485Kernel;
+}
+
 // Creat Serial port Block and Inisialize it's Parameter
 int Open_serial_port(const char *s, const unsigned int baudrate)
 {
@@ -437,7 +629,7 @@ int Open_serial_port(const char *s, const unsigned int baudrate)
     // Read in existing settings, and handle any error
     if (tcgetattr(serial_port, &tty) != 0)
     {
-        printf("Error %i from tcgetattr.\n", errno);
+        LOG_ERROR("Error %i from tcgetattr.", errno);
         return -1;
     }
 
@@ -469,7 +661,7 @@ int Open_serial_port(const char *s, const unsigned int baudrate)
     // Save tty settings, also checking for error
     if (tcsetattr(serial_port, TCSANOW, &tty) != 0)
     {
-        printf("Error %i from tcsetattr.\n", errno);
+        LOG_ERROR("Error %i from tcsetattr.", errno);
         return -1;
     }
     serial_fd = serial_port;
@@ -487,6 +679,7 @@ void closeDevice()
 #if defined(__linux__) || defined(__APPLE__)
     close(serial_fd);
 #endif
+    rs485Kernel = false;
 }
 
 //___________________________________________
@@ -514,6 +707,7 @@ char writeChar(const char Byte)
     // Write the char
     if (write(serial_fd, &Byte, 1) != 1)
         return -1;
+    capture_record(CAPTURE_DIR_TX, &Byte, 1);
 
     // Write operation successfull
     return 1;
@@ -590,9 +784,10 @@ char writeBytes(const void *Buffer, const unsigned int NbBytes)
     int ret = write(serial_fd, Buffer, NbBytes);
     if (ret != (ssize_t)NbBytes)
     {
-        printf("ret %d, NbBytes %d, The error is : %s", ret, NbBytes, strerror(errno)); // TODO add Tag file name , to cach debug messages
+        LOG_ERROR("ret %d, NbBytes %u, The error is : %s", ret, NbBytes, strerror(errno));
         return -1;
     }
+    capture_record(CAPTURE_DIR_TX, Buffer, NbBytes);
     // tcdrain(serial_fd); /* this is very important instruction to insure that the system finish transmit all the data*/
     //  Write operation successfull
     return 1;
@@ -610,13 +805,46 @@ char writeBytes(const void *Buffer, const unsigned int NbBytes)
      \return -2 error while reading the byte
   */
 char readChar(char *pByte, unsigned int timeOut_ms)
+{
+    return readChar_us(pByte, (uint64_t)timeOut_ms * 1000ULL);
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+/*!
+     \brief Wait until the device is readable or the deadline is reached
+     \return 1 readable
+     \return 0 deadline reached
+     \return -1 error while waiting
+  */
+static int waitReadable(const Deadline *deadline)
+{
+    struct pollfd pfd = {.fd = serial_fd, .events = POLLIN};
+    while (1)
+    {
+        uint64_t remaining = deadline_remaining_us(deadline);
+        if (remaining == 0)
+            return 0;
+        struct timespec ts = {.tv_sec = remaining / 1000000ULL, .tv_nsec = (remaining % 1000000ULL) * 1000};
+        int ret = ppoll(&pfd, 1, (remaining == UINT64_MAX) ? NULL : &ts, NULL);
+        if (ret > 0)
+            return 1;
+        if (ret < 0 && errno != EINTR)
+            return -1;
+    }
+}
+#endif
+
+/*!
+     \brief Same as readChar() with a timeout in microseconds
+  */
+char readChar_us(char *pByte, const uint64_t timeOut_us)
 {
 #if defined(_WIN32) || defined(_WIN64)
     // Number of bytes read
     DWORD dwBytesRead = 0;
 
     // Set the TimeOut
-    timeouts.ReadTotalTimeoutConstant = timeOut_ms;
+    timeouts.ReadTotalTimeoutConstant = (DWORD)(timeOut_us / 1000);
 
     // Write the parameters, return -1 if an error occured
     if (!SetCommTimeouts(hSerial, &timeouts))
@@ -634,21 +862,27 @@ char readChar(char *pByte, unsigned int timeOut_ms)
     return 1;
 #endif
 #if defined(__linux__) || defined(__APPLE__)
-    // Timer used for timeout
-    initTimer();
+    // Deadline used for timeout
+    Deadline deadline;
+    deadline_set_us(&deadline, timeOut_us);
     // While Timeout is not reached
-    while (elapsedTime_ms() < timeOut_ms || timeOut_ms == 0)
+    while (1)
     {
         // Try to read a byte on the device
         switch (read(serial_fd, pByte, 1))
         {
         case 1:
+            capture_record(CAPTURE_DIR_RX, pByte, 1);
             return 1; // Read successfull
         case -1:
             return -2; // Error while reading
         }
+        int ready = waitReadable(&deadline);
+        if (ready == 0)
+            return 0;
+        if (ready < 0)
+            return -1;
     }
-    return 0;
 #endif
 }
 
@@ -721,24 +955,24 @@ int readString(char *receivedString, char finalChar, unsigned int maxNbBytes, un
     unsigned int nbBytes = 0;
     // Character read on serial device
     char charRead;
-    // Timer used for timeout
-
-    long int timeOutParam;
+    // Deadline used for timeout
+    Deadline deadline;
+    uint64_t timeOutParam;
 
-    // Initialize the timer (for timeout)
-    initTimer();
+    // Initialize the deadline (for timeout)
+    deadline_set_us(&deadline, (uint64_t)timeOut_ms * 1000ULL);
 
     // While the buffer is not full
     while (nbBytes < maxNbBytes)
     {
         // Compute the TimeOut for the next call of ReadChar
-        timeOutParam = timeOut_ms - elapsedTime_ms();
+        timeOutParam = deadline_remaining_us(&deadline);
 
         // If there is time remaining
         if (timeOutParam > 0)
         {
             // Wait for a byte on the serial link with the remaining time as timeout
-            charRead = readChar(&receivedString[nbBytes], timeOutParam);
+            charRead = readChar_us(&receivedString[nbBytes], timeOutParam);
 
             // If a byte has been received
             if (charRead == 1)
@@ -760,7 +994,7 @@ int readString(char *receivedString, char finalChar, unsigned int maxNbBytes, un
                 return charRead;
         }
         // Check if timeout is reached
-        if (elapsedTime_ms() > timeOut_ms)
+        if (deadline_expired(&deadline))
         {
             // Add the end caracter
             receivedString[nbBytes] = 0;
@@ -778,9 +1012,9 @@ int readString(char *receivedString, char finalChar, unsigned int maxNbBytes, un
      \param buffer : array of bytes read from the serial device
      \param maxNbBytes : maximum allowed number of bytes read
      \param timeOut_ms : delay of timeout before giving up the reading
-     \param sleepDuration_us : delay of CPU relaxing in microseconds (Linux only)
-            In the reading loop, a sleep can be performed after each reading
-            This allows CPU to perform other tasks
+     \param sleepDuration_us : unused, kept for compatibility
+            The reading loop sleeps in ppoll() until data arrives or the
+            deadline is reached, so the CPU is not charged
      \return >=0 return the number of bytes read before timeout or
                 requested data is completed
      \return -1 error while setting the Timeout
@@ -788,15 +1022,29 @@ int readString(char *receivedString, char finalChar, unsigned int maxNbBytes, un
   */
 int readBytes(void *buffer, unsigned int maxNbBytes, unsigned int timeOut_ms, unsigned int sleepDuration_us)
 {
-#if defined(_WIN32) || defined(_WIN64)
-    // Avoid warning while compiling
+    // The wait is event driven (ppoll), there is no polling loop to relax anymore
     UNUSED(sleepDuration_us);
+    return readBytes_us(buffer, maxNbBytes, (uint64_t)timeOut_ms * 1000ULL);
+}
 
+/*!
+     \brief Read an array of bytes from the serial device, timeout in microseconds
+     \param buffer : array of bytes read from the serial device
+     \param maxNbBytes : maximum allowed number of bytes read
+     \param timeOut_us : delay of timeout before giving up the reading (0 : no timeout)
+     \return >=0 return the number of bytes read before timeout or
+                requested data is completed
+     \return -1 error while waiting for data
+     \return -2 error while reading the byte
+  */
+int readBytes_us(void *buffer, unsigned int maxNbBytes, const uint64_t timeOut_us)
+{
+#if defined(_WIN32) || defined(_WIN64)
     // Number of bytes read
     DWORD dwBytesRead = 0;
 
     // Set the TimeOut
-    timeouts.ReadTotalTimeoutConstant = (DWORD)timeOut_ms;
+    timeouts.ReadTotalTimeoutConstant = (DWORD)(timeOut_us / 1000);
 
     // Write the parameters and return -1 if an error occrured
     if (!SetCommTimeouts(hSerial, &timeouts))
@@ -810,13 +1058,12 @@ int readBytes(void *buffer, unsigned int maxNbBytes, unsigned int timeOut_ms, un
     return dwBytesRead;
 #endif
 #if defined(__linux__) || defined(__APPLE__)
-    // Timer used for timeout
-
-    // Initialise the timer
-    initTimer();
+    // Deadline used for timeout
+    Deadline deadline;
+    deadline_set_us(&deadline, timeOut_us);
     unsigned int NbByteRead = 0;
     // While Timeout is not reached
-    while (elapsedTime_ms() < timeOut_ms || timeOut_ms == 0)
+    while (1)
     {
         // Compute the position of the current byte
         unsigned char *Ptr = (unsigned char *)buffer + NbByteRead;
@@ -829,20 +1076,59 @@ int readBytes(void *buffer, unsigned int maxNbBytes, unsigned int timeOut_ms, un
         // One or several byte(s) has been read on the device
         if (Ret > 0)
         {
+            capture_record(CAPTURE_DIR_RX, Ptr, Ret);
             // Increase the number of read bytes
             NbByteRead += Ret;
             // Success : bytes has been read
             if (NbByteRead >= maxNbBytes)
                 return NbByteRead;
+            continue;
         }
-        // Suspend the loop to avoid charging the CPU
-        usleep(sleepDuration_us);
+        // Nothing pending : sleep until data arrives or the deadline is reached
+        int ready = waitReadable(&deadline);
+        if (ready < 0)
+            return -1;
+        if (ready == 0)
+            break;
     }
     // Timeout reached, return the number of bytes read
     return NbByteRead;
 #endif
 }
 
+/*!
+     \brief Read the bytes already received by the serial device, never blocks
+     \param buffer : array of bytes read from the serial device
+     \param maxNbBytes : maximum allowed number of bytes read
+     \return >=0 the number of bytes read (0 if nothing is pending)
+     \return -2 error while reading
+  */
+int readAvailable(void *buffer, unsigned int maxNbBytes)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    DWORD dwBytesRead = 0;
+    // Return immediately with the bytes already received
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = 0;
+    if (!SetCommTimeouts(hSerial, &timeouts))
+        return -2;
+    BOOL ok = ReadFile(hSerial, buffer, (DWORD)maxNbBytes, &dwBytesRead, NULL);
+    // Back to the timeouts used by the other read functions
+    timeouts.ReadIntervalTimeout = 0;
+    SetCommTimeouts(hSerial, &timeouts);
+    return ok ? (int)dwBytesRead : -2;
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+    // VMIN = VTIME = 0 : read() returns at once
+    int Ret = read(serial_fd, buffer, maxNbBytes);
+    if (Ret < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -2;
+    if (Ret > 0)
+        capture_record(CAPTURE_DIR_RX, buffer, Ret);
+    return Ret;
+#endif
+}
+
 // _________________________
 // ::: Special operation :::
 
@@ -888,6 +1174,27 @@ int available()
 #endif
 }
 
+/*!
+    \brief  Return the number of bytes written but not sent yet (TIOCOUTQ)
+    \return The number of bytes waiting in the driver transmit queue, -1 on error
+*/
+int pendingOutput()
+{
+#if defined(_WIN32) || defined(_WIN64)
+    DWORD commErrors;
+    COMSTAT commStatus;
+    if (!ClearCommError(hSerial, &commErrors, &commStatus))
+        return -1;
+    return commStatus.cbOutQue;
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+    int nBytes = 0;
+    if (ioctl(serial_fd, TIOCOUTQ, &nBytes) != 0)
+        return -1;
+    return nBytes;
+#endif
+}
+
 // __________________
 // ::: I/O Access :::
 
@@ -1141,46 +1448,47 @@ bool isRTS()
 }
 
 // ******************************************
-//  Class timeOut
+//  Deadline timers
 // ******************************************
 
 /*!
-    \brief      Initialise the timer. It writes the current time of the day in the structure PreviousTime.
+    \brief      Current time of the monotonic clock, which never jumps with wall-clock changes
+    \return     Microseconds since an arbitrary fixed point
 */
-// Initialize the timer
-void initTimer()
+uint64_t monotonic_us()
 {
-    gettimeofday(&previousTime, NULL);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000ULL + (uint64_t)now.tv_nsec / 1000ULL;
 }
 
 /*!
-    \brief      Returns the time elapsed since initialization.  It write the current time of the day in the structure CurrentTime.
-                Then it returns the difference between CurrentTime and PreviousTime.
-    \return     The number of microseconds elapsed since the functions InitTimer was called.
-  */
-// Return the elapsed time since initialization
-unsigned long int elapsedTime_ms()
+    \brief      Arm a deadline. Each caller owns its Deadline, so nested or
+                concurrent timeouts do not interfere.
+    \param      timeOut_us : delay before expiry in microseconds, 0 = never expires
+*/
+void deadline_set_us(Deadline *deadline, uint64_t timeOut_us)
 {
-    // Current time
-    struct timeval CurrentTime;
-    // Number of seconds and microseconds since last call
-    int sec, usec;
-
-    // Get current time
-    gettimeofday(&CurrentTime, NULL);
-
-    // Compute the number of seconds and microseconds elapsed since last call
-    sec = CurrentTime.tv_sec - previousTime.tv_sec;
-    usec = CurrentTime.tv_usec - previousTime.tv_usec;
+    deadline->expiry_us = timeOut_us ? monotonic_us() + timeOut_us : 0;
+}
 
-    // If the previous usec is higher than the current one
-    if (usec < 0)
-    {
-        // Recompute the microseonds and substract one second
-        usec = 1000000 - previousTime.tv_usec + CurrentTime.tv_usec;
-        sec--;
-    }
+/*!
+    \brief      Check the deadline
+    \return     true if the deadline is reached
+*/
+bool deadline_expired(const Deadline *deadline)
+{
+    return deadline->expiry_us && monotonic_us() >= deadline->expiry_us;
+}
 
-    // Return the elapsed time in milliseconds
-    return sec * 1000 + usec / 1000;
+/*!
+    \brief      Time left before the deadline
+    \return     microseconds left, 0 if expired, UINT64_MAX if the deadline never expires
+*/
+uint64_t deadline_remaining_us(const Deadline *deadline)
+{
+    if (!deadline->expiry_us)
+        return UINT64_MAX;
+    uint64_t now = monotonic_us();
+    return (now >= deadline->expiry_us) ? 0 : deadline->expiry_us - now;
 }
@@ -2,7 +2,8 @@
 #define SERIALPORT_H
 
 // Used for TimeOut operations
-#include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
 
 // Include for Linux
 #if defined(__linux__) || defined(__APPLE__)
@@ -55,8 +56,31 @@ typedef enum
     SERIAL_PARITY_SPACE /**< space bit */
 } SerialParity;
 
+/**
+ * receive errors counted by the driver since the port was opened (TIOCGICOUNT)
+ */
+typedef struct
+{
+    uint32_t overrun;     /**< UART FIFO overrun : bytes lost before the driver read them */
+    uint32_t buf_overrun; /**< tty buffer overrun : bytes lost because the application is too slow */
+    uint32_t frame;       /**< framing errors */
+    uint32_t parity;      /**< parity errors */
+    uint32_t brk;         /**< breaks */
+} SerialErrorCounters;
+
 // Open a device
 char openDevice(const char *Device, const unsigned int Bauds);
+// Change the baud rate of the opened device (any integer rate on Linux)
+char setBaudRate(const unsigned int Bauds);
+// Rate achieved by the driver
+unsigned int getBaudRate();
+// Let the driver switch the RS-485 direction through RTS (delays in ms)
+char setRS485(bool enable, unsigned int delayBeforeSend_ms, unsigned int delayAfterSend_ms);
+bool isRS485();
+// RTS/CTS hardware flow control
+char setFlowControl(bool rtscts);
+// Receive error counters of the driver
+char getErrorCounters(SerialErrorCounters *counters);
 int Open_serial_port(const char *s, const unsigned int baudrate);
 // Close the current device
 void closeDevice();
@@ -69,6 +93,7 @@ char writeChar(char);
 
 // Read a char (with timeout)
 char readChar(char *pByte, const unsigned int timeOut_ms);
+char readChar_us(char *pByte, const uint64_t timeOut_us);
 
 //________________________________________
 // ::: Read/Write operation on strings :::
@@ -90,6 +115,9 @@ char writeBytes(const void *Buffer, const unsigned int NbBytes);
 
 // Read an array of byte (with timeout)
 int readBytes(void *buffer, unsigned int maxNbBytes, const unsigned int timeOut_ms, unsigned int sleepDuration_us);
+int readBytes_us(void *buffer, unsigned int maxNbBytes, const uint64_t timeOut_us);
+// Read what is already received, without waiting
+int readAvailable(void *buffer, unsigned int maxNbBytes);
 
 // _________________________
 // ::: Special operation :::
@@ -99,6 +127,8 @@ char flushReceiver();
 
 // Return the number of bytes in the received buffer
 int available();
+// Bytes waiting in the transmit queue
+int pendingOutput();
 
 // _________________________
 // ::: Access to IO bits :::
@@ -141,13 +171,25 @@ COMMTIMEOUTS timeouts;
 // int serial_fd;
 #endif
 
-// Constructor
-void timeOut();
+// ________________________________________
+// ::: Deadline timers (CLOCK_MONOTONIC) :::
+
+// A per-call deadline, immune to wall-clock jumps (NTP, settimeofday)
+typedef struct
+{
+    uint64_t expiry_us; // monotonic time of expiry, 0 = never expires
+} Deadline;
+
+// Microseconds on the monotonic clock
+uint64_t monotonic_us();
+
+// Arm a deadline timeOut_us from now (0 disables the timeout)
+void deadline_set_us(Deadline *deadline, uint64_t timeOut_us);
 
-// Init the timer
-void initTimer();
+// True once the deadline is reached
+bool deadline_expired(const Deadline *deadline);
 
-// Return the elapsed time since initialization
-unsigned long int elapsedTime_ms();
+// Time left before the deadline (UINT64_MAX if it never expires)
+uint64_t deadline_remaining_us(const Deadline *deadline);
 
 #endif // SerialPort_H
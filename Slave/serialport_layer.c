@@ -1,16 +1,54 @@
 #include "serialport_layer.h"
 #include <stdint.h>
+#include <stddef.h>
 #include "log.h"
 #include "checksum.h"
 #include "main.h"
+#include "metrics.h"
+#include "trace.h"
 uint8_t uart_buf[MAX_UART_FRAME_SIZE];
 extern int serial_fd;
+static bool tx_cobs; // frames are written COBS framed
+static bool rx_cobs; // framing of the last frame received
+static uint8_t cobs_tx_buf[MAX_UART_COBS_FRAME_SIZE];
+static uint32_t tx_guard_us = TX_GUARD_US;
+
+void frame_tx_cobs(bool enable)
+{
+    tx_cobs = enable;
+}
+
+void frame_tx_guard_us(uint32_t us)
+{
+    tx_guard_us = us;
+}
+
+bool frame_rx_cobs(void)
+{
+    return rx_cobs;
+}
+
+// COBS framing of a frame : 0x00 , COBS(id type length data crc) , 0x00 in cobs_tx_buf, returns its size
+static size_t cobs_frame(const UARTFrame *frame, const uint8_t *data, uint16_t length)
+{
+    static uint8_t raw[MAX_UART_FRAME_SIZE];
+    size_t header = sizeof(frame->id) + sizeof(frame->type) + sizeof(frame->len);
+    memcpy(raw, &frame->id, header);
+    memcpy(raw + header, data, length);
+    memcpy(raw + header + length, &frame->crc, sizeof(frame->crc));
+    size_t size = 0;
+    cobs_tx_buf[size++] = COBS_DELIMITER; // ends whatever noise came before
+    size += cobs_encode(raw, header + length + sizeof(frame->crc), cobs_tx_buf + size);
+    cobs_tx_buf[size++] = COBS_DELIMITER;
+    return size;
+}
 
 // Function to handle RS-485 transmission enable
 static void rs485_transmission_enable()
 {
 #ifdef RS_485_ENABLE
-    gpio__RS485_set();
+    if (!isRS485())
+        gpio__RS485_set();
 #endif
 }
 
@@ -18,10 +56,73 @@ static void rs485_transmission_enable()
 static void rs485_transmission_disable()
 {
 #ifdef RS_485_ENABLE
-    gpio__RS485_clear();
+    if (!isRS485())
+        gpio__RS485_clear();
 #endif
 }
 
+uint32_t uart_errors_poll(void)
+{
+    static SerialErrorCounters last;
+    static bool baseline;
+    SerialErrorCounters now;
+    if (getErrorCounters(&now) <= 0)
+        return 0;
+    if (!baseline)
+    {
+        last = now;
+        baseline = true;
+        return 0;
+    }
+    uint32_t delta[] = {now.overrun - last.overrun, now.buf_overrun - last.buf_overrun, now.frame - last.frame,
+                        now.parity - last.parity, now.brk - last.brk};
+    static const METRIC_COUNTER counter[] = {METRIC_UART_OVERRUNS, METRIC_UART_BUF_OVERRUNS, METRIC_UART_FRAME_ERRORS,
+                                             METRIC_UART_PARITY_ERRORS, METRIC_UART_BREAKS};
+    uint32_t errors = 0;
+    for (unsigned int i = 0; i < sizeof(delta) / sizeof(delta[0]); i++)
+    {
+        metrics_add(counter[i], delta[i]);
+        errors += delta[i];
+    }
+    last = now;
+    return errors;
+}
+
+// Let the driver TX queue drain down to TX_QUEUE_TARGET_US of line time, so a frame queued now
+// follows the previous one without a gap on the line, nor waits behind a long backlog
+static void tx_queue_wait()
+{
+    unsigned int baud = getBaudRate();
+    if (!baud)
+        return;
+    int target = (int)((uint64_t)baud * TX_QUEUE_TARGET_US / 10 / 1000000);
+    int queued = pendingOutput();
+    if (queued <= target)
+        return;
+    uint64_t span = trace_begin();
+    while (queued > target) // also holds while CTS is low
+    {
+        uint64_t drain_us = (uint64_t)(queued - target) * 10 * 1000000 / baud;
+        usleep(drain_us > TX_QUEUE_POLL_US ? drain_us : TX_QUEUE_POLL_US);
+        queued = pendingOutput();
+    }
+    trace_end("tx_queue_wait", span);
+}
+
+// Wait until the frame left the UART before the line is turned around.
+// In kernel RS-485 mode the driver drops RTS after the last stop bit, nothing to wait for
+static void tx_turnaround()
+{
+    if (isRS485())
+        return;
+    uint64_t span = trace_begin();
+    usleep(tx_guard_us);
+    trace_end("tx_guard_sleep", span);
+    span = trace_begin();
+    tcdrain(serial_fd);
+    trace_end("tcdrain", span);
+}
+
 static int write_Byte_Salve_Master(uint8_t ID, uint8_t type, uint8_t data)
 {
     rs485_transmission_enable();
@@ -35,15 +136,24 @@ static int write_Byte_Salve_Master(uint8_t ID, uint8_t type, uint8_t data)
         .eof = UART_EOF_H};
     size_t len = sizeof(frame.id) + sizeof(frame.type) + sizeof(frame.len) + sizeof(frame.data);
     frame.crc = crc_32(&frame.id, len);
-    writeBytes((uint8_t *)&frame, sizeof(frame));
-    usleep(750);
-    tcdrain(serial_fd);
-
+    uint64_t span = trace_begin();
+    size_t size = sizeof(frame);
+    if (tx_cobs)
+        writeBytes(cobs_tx_buf, size = cobs_frame(&frame, &frame.data, sizeof(frame.data)));
+    else
+        writeBytes((uint8_t *)&frame, sizeof(frame));
+    trace_end_arg("frame_tx", span, "type", type);
+    metrics_inc(METRIC_FRAMES_TX);
+    metrics_add(METRIC_BYTES_TX, size);
+    tx_turnaround();
     rs485_transmission_disable();
     return 0;
 }
-static int write_Bytes_Salve_Master(uint8_t ID, uint8_t type, uint8_t *data, uint16_t length)
+// stream : paced on the TX queue depth, returns without waiting for the line (more frames follow)
+static int write_Bytes_Salve_Master(uint8_t ID, uint8_t type, uint8_t *data, uint16_t length, bool stream)
 {
+    if (stream)
+        tx_queue_wait();
     rs485_transmission_enable();
     UARTFrame frame = {
         .sof_low = UART_SOF_L,
@@ -58,12 +168,22 @@ static int write_Bytes_Salve_Master(uint8_t ID, uint8_t type, uint8_t *data, uin
     frame.crc = crc32_update(frame.crc, data, length);
 
     temp_len += sizeof(frame.sof_low) + sizeof(frame.sof_high);
-    writeBytes((uint8_t *)&frame, temp_len);
-    writeBytes((uint8_t *)data, length);
-    writeBytes((uint8_t *)&frame.crc, sizeof(frame.crc) + sizeof(frame.eof));
-    usleep(750);
-    tcdrain(serial_fd);
-
+    uint64_t span = trace_begin();
+    size_t size = temp_len + length + sizeof(frame.crc) + sizeof(frame.eof);
+    if (tx_cobs)
+        writeBytes(cobs_tx_buf, size = cobs_frame(&frame, data, length));
+    else
+    {
+        writeBytes((uint8_t *)&frame, temp_len);
+        writeBytes((uint8_t *)data, length);
+        writeBytes((uint8_t *)&frame.crc, sizeof(frame.crc) + sizeof(frame.eof));
+    }
+    trace_end_arg("frame_tx", span, "type", type);
+    metrics_inc(METRIC_FRAMES_TX);
+    metrics_add(METRIC_BYTES_TX, size);
+    if (stream)
+        return 0;
+    tx_turnaround();
     rs485_transmission_disable();
     return 0;
 }
@@ -73,105 +193,337 @@ int Write_Command_to_Slave(uint8_t Slave_ID, uint8_t cmd)
 }
 int Write_Info_to_Slave(uint8_t Slave_ID, uint8_t InfoType, uint8_t *data, uint16_t length)
 {
-    return write_Bytes_Salve_Master(Slave_ID, InfoType, data, length);
+    return write_Bytes_Salve_Master(Slave_ID, InfoType, data, length, false);
+}
+int Write_Stream_to_Slave(uint8_t Slave_ID, uint8_t InfoType, uint8_t *data, uint16_t length)
+{
+    return write_Bytes_Salve_Master(Slave_ID, InfoType, data, length, true);
 }
 
 int Write_Info_to_Master(uint8_t Slave_ID, uint8_t data)
 {
     return write_Byte_Salve_Master(Slave_ID, UART_DATA_FRAME, data);
 }
+int Write_Data_to_Master(uint8_t Slave_ID, uint8_t InfoType, uint8_t *data, uint16_t length)
+{
+    return write_Bytes_Salve_Master(Slave_ID, InfoType, data, length, false);
+}
 int tryGetResquestFromSlave(uint8_t Slave_ID)
 {
-    return tryGetResquestFromMaster(Slave_ID);
+    uint64_t start_us = metrics_now_us();
+    uint64_t span = trace_begin();
+    int ret = tryGetResquestFromMaster(Slave_ID);
+    trace_end_arg("wait_response", span, "ret", ret);
+    if (ret == 0)
+        metrics_inc(METRIC_RESPONSE_TIMEOUTS);
+    else if (ret > 0)
+        metrics_observe_us(METRIC_HIST_RESPONSE_US, metrics_now_us() - start_us);
+    return ret;
 }
 
-typedef enum
+void frame_parser_init(FRAME_PARSER *parser, uint8_t my_ID)
 {
-    FRAME_RECEIVE_SOF_LOW_BYTE = 0, // Start of Frame - Low Byte
-    FRAME_RECEIVE_SOF_HIGH_BYTE,    // Start of Frame - High Byte
-    FRAME_RECEIVE_DEVICE_ID,        // Device ID
-    FRAME_RECEIVE_TYPE,             // Frame Type
-    FRAME_RECEIVE_LENGTH_LOW_BYTE,  // Length of Data - Low Byte
-    FRAME_RECEIVE_LENGTH_HIGH_BYTE, // Length of Data - High Byte
-    FRAME_RECEIVE_DATA_CONTENT,     // Data Content
-    FRAME_RECEIVE_CRC_BYTE_0,       // CRC Byte 0 (least significant byte)
-    FRAME_RECEIVE_CRC_BYTE_1,       // CRC Byte 1
-    FRAME_RECEIVE_CRC_BYTE_2,       // CRC Byte 2
-    FRAME_RECEIVE_CRC_BYTE_3,       // CRC Byte 3 (most significant byte)
-    FRAME_RECEIVE_EOF,              // End of Frame
-} FRAME_RECEIVE_STATE;
+    memset(parser, 0, offsetof(FRAME_PARSER, cobs_buf)); // the buffer content is not state
+    parser->my_ID = my_ID;
+    parser->state = FRAME_RECEIVE_SOF_LOW_BYTE;
+    parser->cobs = tx_cobs || rx_cobs; // expect the framing in use
+}
 
-int tryGetResquestFromMaster(uint8_t my_ID)
+bool frame_parser_idle(const FRAME_PARSER *parser)
 {
-    uint16_t index = 0, length = 0, len_i = 0;
-    uint8_t data = 0x00;
-    uint32_t rec_crc32 = 0, calc_crc = 0;
-    FRAME_RECEIVE_STATE switch_case = FRAME_RECEIVE_SOF_LOW_BYTE;
-    while (1)
+    return parser->state == FRAME_RECEIVE_SOF_LOW_BYTE && parser->lookback_pos >= parser->lookback_len;
+}
+
+// COBS frame ended by a delimiter in cobs_buf : 1 valid (copied to uart_buf), -1 other ID, -3 CRC,
+// 0 not a frame (noise, or 0x00 bytes of SOF framed traffic)
+static int cobs_parse(FRAME_PARSER *parser)
+{
+    UARTFrame *frame = (UARTFrame *)uart_buf;
+    const uint16_t header = sizeof(frame->id) + sizeof(frame->type) + sizeof(frame->len);
+    int size = cobs_decode(parser->cobs_buf, parser->cobs_fill, parser->cobs_buf, sizeof(parser->cobs_buf));
+    if (size < header + (int)sizeof(frame->crc))
+        return 0;
+    uint16_t length = parser->cobs_buf[2] | (parser->cobs_buf[3] << 8);
+    if (size != header + length + (int)sizeof(frame->crc))
+        return 0;
+    uint32_t rec_crc32;
+    memcpy(&rec_crc32, parser->cobs_buf + header + length, sizeof(rec_crc32));
+    uint64_t crc_span = trace_begin();
+    uint32_t calc_crc = crc_32(parser->cobs_buf, header + length);
+    trace_end("crc_check", crc_span);
+    if (calc_crc != rec_crc32)
     {
-        if (readBytes(&data, 1, UART_TIMEOUT_MILLISECONDS, 0) <= 0)
-            return 0;
-        switch (switch_case)
+        metrics_inc(METRIC_CRC_ERRORS);
+        return -3;
+    }
+    if (parser->cobs_buf[0] != parser->my_ID)
+    {
+        metrics_inc(METRIC_ID_MISMATCHES);
+        return -1;
+    }
+    // same layout as a SOF framed frame
+    uart_buf[0] = UART_SOF_L;
+    uart_buf[1] = UART_SOF_H;
+    memcpy(&uart_buf[2], parser->cobs_buf, size);
+    uart_buf[2 + size] = UART_EOF_H;
+    metrics_inc(METRIC_FRAMES_RX);
+    return 1;
+}
+
+// One byte through the SOF framing state machine : 1 frame, -1 valid frame for another ID, -2 oversize, -3 CRC
+static int sof_parser_step(FRAME_PARSER *parser, uint8_t data)
+{
+    int ret = 0;
+    uint64_t crc_span;
+    switch (parser->state)
+    {
+    case FRAME_RECEIVE_SOF_LOW_BYTE:
+        parser->state = (data == UART_SOF_L) ? FRAME_RECEIVE_SOF_HIGH_BYTE : FRAME_RECEIVE_SOF_LOW_BYTE;
+        parser->index = 0;
+        if (data == UART_SOF_L)
+            parser->rx_span = trace_begin();
+        break;
+    case FRAME_RECEIVE_SOF_HIGH_BYTE:
+        parser->state = (data == UART_SOF_H) ? FRAME_RECEIVE_DEVICE_ID : FRAME_RECEIVE_SOF_LOW_BYTE;
+        break;
+    case FRAME_RECEIVE_DEVICE_ID: // checked with the CRC : a corrupted ID is a false SOF, not a frame to skip
+        parser->state = FRAME_RECEIVE_TYPE;
+        break;
+    case FRAME_RECEIVE_TYPE:
+        parser->state = FRAME_RECEIVE_LENGTH_LOW_BYTE;
+        break;
+    case FRAME_RECEIVE_LENGTH_LOW_BYTE:
+        parser->remaining = data;
+        parser->state = FRAME_RECEIVE_LENGTH_HIGH_BYTE;
+        break;
+    case FRAME_RECEIVE_LENGTH_HIGH_BYTE:
+        parser->remaining += data << 8;
+        if (parser->remaining > MAX_UART_DATA_PAYLOAD_SIZE)
         {
-        case FRAME_RECEIVE_SOF_LOW_BYTE:
-            switch_case = (data == UART_SOF_L) ? FRAME_RECEIVE_SOF_HIGH_BYTE : FRAME_RECEIVE_SOF_LOW_BYTE;
-            index = 0;
-            break;
-        case FRAME_RECEIVE_SOF_HIGH_BYTE:
-            switch_case = (data == UART_SOF_H) ? FRAME_RECEIVE_DEVICE_ID : FRAME_RECEIVE_SOF_LOW_BYTE;
+            ret = -2;
             break;
-        case FRAME_RECEIVE_DEVICE_ID:
-            if (data != my_ID)
-                return -1;
-            switch_case = FRAME_RECEIVE_TYPE;
+        }
+        parser->length = parser->remaining;
+        parser->state = FRAME_RECEIVE_DATA_CONTENT;
+        break;
+    case FRAME_RECEIVE_DATA_CONTENT:
+        if (--parser->remaining <= 0)
+            parser->state = FRAME_RECEIVE_CRC_BYTE_0;
+        break;
+    case FRAME_RECEIVE_CRC_BYTE_0:
+        parser->rec_crc32 = data;
+        parser->state = FRAME_RECEIVE_CRC_BYTE_1;
+        break;
+    case FRAME_RECEIVE_CRC_BYTE_1:
+        parser->rec_crc32 += data << 8;
+        parser->state = FRAME_RECEIVE_CRC_BYTE_2;
+        break;
+    case FRAME_RECEIVE_CRC_BYTE_2:
+        parser->rec_crc32 += data << 16;
+        parser->state = FRAME_RECEIVE_CRC_BYTE_3;
+        break;
+    case FRAME_RECEIVE_CRC_BYTE_3:
+        parser->rec_crc32 += (uint32_t)data << 24;
+        uint16_t byte2calc = parser->length + 4; // 4= sizeof(ID)+ sizeof(type)+ sizeof(length)
+        crc_span = trace_begin();
+        parser->calc_crc = crc_32(&uart_buf[2], byte2calc); // 2 is to skip sof_low and sof_high
+        trace_end("crc_check", crc_span);
+        parser->state = FRAME_RECEIVE_EOF;
+        break;
+    case FRAME_RECEIVE_EOF: // EOF
+        if (parser->calc_crc != parser->rec_crc32)
+        {
+            trace_end("frame_rx_crc_error", parser->rx_span);
+            ret = -3;
             break;
-        case FRAME_RECEIVE_TYPE:
-            switch_case = FRAME_RECEIVE_LENGTH_LOW_BYTE;
+        }
+        if (uart_buf[2] != parser->my_ID)
+        {
+            ret = -1;
             break;
-        case FRAME_RECEIVE_LENGTH_LOW_BYTE:
-            len_i = data;
-            switch_case = FRAME_RECEIVE_LENGTH_HIGH_BYTE;
+        }
+        metrics_inc(METRIC_FRAMES_RX);
+        trace_end_arg("frame_rx", parser->rx_span, "len", parser->length);
+        ret = 1;
+        break;
+    default:
+        break;
+    }
+    if (ret == 0)
+        uart_buf[parser->index++] = data;
+    else
+        parser->state = FRAME_RECEIVE_SOF_LOW_BYTE; // frame done (or dropped), next byte starts a new one
+    return ret;
+}
+
+// The candidate frame in uart_buf (then data) failed the length or CRC check : its SOF was noise.
+// Its bytes after the SOF are scanned again, ahead of the lookback bytes not parsed yet
+static void sof_parser_backtrack(FRAME_PARSER *parser, uint8_t data)
+{
+    uint16_t rescan = parser->index; // uart_buf[1 .. index) + data
+    uint16_t rest = parser->lookback_len - parser->lookback_pos;
+    if (rescan + rest > sizeof(parser->lookback)) // cannot happen : the bytes all come from one candidate frame
+        rest = sizeof(parser->lookback) - rescan;
+    memmove(parser->lookback + rescan, parser->lookback + parser->lookback_pos, rest);
+    memcpy(parser->lookback, &uart_buf[1], rescan - 1);
+    parser->lookback[rescan - 1] = data;
+    parser->lookback_pos = 0;
+    parser->lookback_len = rescan + rest;
+}
+
+// SOF framing : the lookback bytes then count bytes (count may be 0), consumed gets the bytes of "bytes" used.
+// Length and CRC failures are rescanned and only remembered in parser->rejected
+static int sof_parser_feed(FRAME_PARSER *parser, const uint8_t *bytes, uint16_t count, uint16_t *consumed)
+{
+    uint16_t i = 0;
+    int ret = 0;
+    while (ret == 0)
+    {
+        uint8_t data;
+        if (parser->lookback_pos < parser->lookback_len)
+            data = parser->lookback[parser->lookback_pos++];
+        else if (i < count)
+        {
+            data = bytes[i++];
+            metrics_inc(METRIC_BYTES_RX);
+        }
+        else
             break;
-        case FRAME_RECEIVE_LENGTH_HIGH_BYTE:
-            len_i += data << 8;
-            if (len_i > MAX_UART_DATA_PAYLOAD_SIZE)
+        ret = sof_parser_step(parser, data);
+        if (ret != -2 && ret != -3)
+            continue;
+        if (!parser->cobs) // in COBS traffic SOF like patterns are expected
+        {
+            if (ret == -2)
             {
                 LOG_ERROR("Data Payload size is larger than expected");
-                return -2;
+                metrics_inc(METRIC_OVERSIZE_FRAMES);
             }
-            length = len_i;
-            switch_case = FRAME_RECEIVE_DATA_CONTENT;
-            break;
-        case FRAME_RECEIVE_DATA_CONTENT:
-            if (--len_i <= 0)
-                switch_case = FRAME_RECEIVE_CRC_BYTE_0;
-            break;
-        case FRAME_RECEIVE_CRC_BYTE_0:
-            rec_crc32 = data;
-            switch_case = FRAME_RECEIVE_CRC_BYTE_1;
-            break;
-        case FRAME_RECEIVE_CRC_BYTE_1:
-            rec_crc32 += data << 8;
-            switch_case = FRAME_RECEIVE_CRC_BYTE_2;
-            break;
-        case FRAME_RECEIVE_CRC_BYTE_2:
-            rec_crc32 += data << 16;
-            switch_case = FRAME_RECEIVE_CRC_BYTE_3;
-            break;
-        case FRAME_RECEIVE_CRC_BYTE_3:
-            rec_crc32 += data << 24;
-            uint16_t byte2calc = length + 4;            // 4= sizeof(ID)+ sizeof(type)+ sizeof(length)
-            calc_crc = crc_32(&uart_buf[2], byte2calc); // 2 is to skip sof_low and sof_high
-            switch_case = FRAME_RECEIVE_EOF;
-            break;
-        case FRAME_RECEIVE_EOF: // EOF
-            if (calc_crc != rec_crc32)
-                return -3;
-            return 1;
-        default:
-            break;
+            else
+                metrics_inc(METRIC_CRC_ERRORS);
+            parser->rejected = ret;
         }
-        uart_buf[index++] = data;
+        sof_parser_backtrack(parser, data);
+        ret = 0;
+    }
+    *consumed = i;
+    return ret;
+}
+
+int frame_parser_feed(FRAME_PARSER *parser, const uint8_t *bytes, uint16_t count, uint16_t *consumed)
+{
+    uint16_t i = 0;
+    int ret = 0;
+    do
+    {
+        // up to the next delimiter : a single memchr, the SOF parser sees the same bytes
+        const uint8_t *delimiter = (i < count) ? memchr(bytes + i, COBS_DELIMITER, count - i) : NULL;
+        uint16_t end = delimiter ? (uint16_t)(delimiter - bytes) + 1 : count;
+        uint16_t used = 0;
+        ret = sof_parser_feed(parser, bytes + i, end - i, &used);
+        if (ret < 0 && parser->cobs)
+            ret = 0; // COBS traffic : a SOF pattern inside encoded bytes is not a frame
+        else if (ret == -1)
+            metrics_inc(METRIC_ID_MISMATCHES);
+        bool at_delimiter = delimiter && i + used == end;
+        uint16_t cobs_bytes = used - (at_delimiter ? 1 : 0);
+        if (!parser->cobs_fill && cobs_bytes)
+            parser->cobs_span = trace_begin();
+        if (parser->cobs_fill + cobs_bytes <= sizeof(parser->cobs_buf))
+        {
+            memcpy(parser->cobs_buf + parser->cobs_fill, bytes + i, cobs_bytes);
+            parser->cobs_fill += cobs_bytes;
+        }
+        else
+            parser->cobs_fill = sizeof(parser->cobs_buf) + 1; // longer than any frame : dropped at the delimiter
+        i += used;
+        if (ret == 1)
+            parser->cobs = false;
+        if (ret != 0 || !at_delimiter)
+        {
+            if (ret != 0)
+                parser->cobs_fill = 0;
+            continue;
+        }
+        if (parser->cobs_fill && parser->cobs_fill <= sizeof(parser->cobs_buf))
+            ret = cobs_parse(parser);
+        parser->cobs_fill = 0;
+        if (ret == 1)
+        {
+            parser->cobs = true;
+            parser->state = FRAME_RECEIVE_SOF_LOW_BYTE; // the SOF parser only saw encoded bytes
+            parser->lookback_pos = parser->lookback_len = 0;
+            trace_end_arg("frame_rx", parser->cobs_span, "len", uart_buf[4] | (uart_buf[5] << 8));
+        }
+        else if (ret < 0)
+            trace_end("frame_rx_crc_error", parser->cobs_span);
+    } while (i < count && ret == 0);
+    if (ret == 1)
+    {
+        rx_cobs = parser->cobs;
+        parser->rejected = 0;
+    }
+    // a rejected frame is reported once nothing that could still be a frame is left
+    if (ret == 0 && parser->rejected && frame_parser_idle(parser))
+    {
+        ret = parser->rejected;
+        parser->rejected = 0;
+    }
+    if (consumed)
+        *consumed = i;
+    return ret;
+}
+
+int frame_parser_expire(FRAME_PARSER *parser)
+{
+    int ret = 0;
+    while (ret == 0 && parser->state != FRAME_RECEIVE_SOF_LOW_BYTE)
+    {
+        // same rescan as a failed length or CRC check : uart_buf[1 .. index) ahead of the lookback bytes left
+        uint16_t rescan = parser->index ? parser->index - 1 : 0;
+        uint16_t rest = parser->lookback_len - parser->lookback_pos;
+        if (rescan + rest > sizeof(parser->lookback))
+            rest = sizeof(parser->lookback) - rescan;
+        memmove(parser->lookback + rescan, parser->lookback + parser->lookback_pos, rest);
+        memcpy(parser->lookback, &uart_buf[1], rescan);
+        parser->lookback_pos = 0;
+        parser->lookback_len = rescan + rest;
+        parser->state = FRAME_RECEIVE_SOF_LOW_BYTE;
+        ret = frame_parser_feed(parser, NULL, 0, NULL);
+    }
+    return ret;
+}
+
+int tryGetResquestFromMaster(uint8_t my_ID)
+{
+    // kept between calls : the bytes read after a frame (and those of the lookback) are parsed by the next call
+    static FRAME_PARSER parser;
+    static uint8_t rx[RX_READ_BUFFER_SIZE];
+    static uint16_t rx_pos, rx_len;
+    int ret;
+    if (parser.my_ID != my_ID) // a partial frame or lookback bytes left are parsed on
+        frame_parser_init(&parser, my_ID);
+    while (1)
+    {
+        uint16_t used = 0;
+        ret = frame_parser_feed(&parser, rx + rx_pos, rx_len - rx_pos, &used);
+        rx_pos += used;
+        if (ret != 0)
+            return ret;
+        // every byte parsed : wait for the next one, then take all those already received with it
+        rx_pos = rx_len = 0;
+        if (readBytes_us(rx, 1, UART_TIMEOUT_MICROSECONDS) <= 0)
+        {
+            if (!frame_parser_idle(&parser))
+            {
+                metrics_inc(METRIC_PARTIAL_TIMEOUTS);
+                if ((ret = frame_parser_expire(&parser)) != 0) // a frame behind a false SOF
+                    return ret;
+            }
+            frame_parser_init(&parser, my_ID);
+            return 0;
+        }
+        int more = readAvailable(rx + 1, sizeof(rx) - 1);
+        rx_len = 1 + (more > 0 ? more : 0);
     }
-    return 0;
 }
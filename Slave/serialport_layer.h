@@ -18,10 +18,16 @@ extern "C"
 #endif
 #include "serialport.h"
 #include "stdint.h"
-#define UART_TIMEOUT_MILLISECONDS 100
-#define MAX_UART_DATA_PAYLOAD_SIZE (1024 + 3)                                        /* max count of data in the frame that master will send ("1024" in case CHUNK_MAX_PLD_LENGTH_1024B , "3" = UARTChunk:[uint8_t ChLen+uint16_t ChunkIdx]; */
+#include "cobs.h"
+#define UART_TIMEOUT_MICROSECONDS 100000 /* inter-byte timeout of the frame receiver */
+#define RX_READ_BUFFER_SIZE 512          /* bytes pulled from the serial port per read by tryGetResquestFromMaster() */
+#define TX_GUARD_US 750                  /* pause after a frame before the line is turned around (userspace direction control) */
+#define TX_QUEUE_TARGET_US 2000          /* streamed frames : line time kept queued in the driver (TIOCOUTQ) */
+#define TX_QUEUE_POLL_US 200             /* shortest sleep while the TX queue drains */
+#define MAX_UART_DATA_PAYLOAD_SIZE (4096 + 6)                                        /* max count of data in the frame that master will send ("4096" in case CHUNK_MAX_PLD_LENGTH_4096B , "6" = FEC_PARITY header, UARTChunk:[uint8_t ChLen+uint16_t ChunkIdx] is 3; */
 #define UART_FRAME_OVERHEAD_BYTES 11                                                 /* including sof_l,sof_h,id,type,length,crc32,eof*/
 #define MAX_UART_FRAME_SIZE (MAX_UART_DATA_PAYLOAD_SIZE + UART_FRAME_OVERHEAD_BYTES) /*total maximum size of a UART frame */
+#define MAX_UART_COBS_FRAME_SIZE (COBS_MAX_ENCODED_SIZE(MAX_UART_FRAME_SIZE) + 2)    /* COBS framing : encoded id..crc between two 0x00 delimiters */
 
     typedef enum
     {
@@ -35,6 +41,12 @@ extern "C"
         UART_CMD_FRAME = 0x00,    // Frame containing a command
         UART_HEADER_FRAME = 0x01, // Frame containing file information (CRC, length, MD5 sum)
         UART_DATA_FRAME = 0x02,   // Frame containing a chunk of file data
+        UART_SESSION_FRAME = 0x03, // Session open request / answer (SESSION_OPEN_REQUEST, SESSION_OPEN_RESPONSE)
+        UART_LINK_FRAME = 0x04,    // Baud rate change : switch / probe / commit (LINK_REQUEST)
+        UART_FEC_FRAME = 0x05,     // Parity of a group of chunks (FEC_PARITY)
+        UART_FILL_FRAME = 0x06,    // Run of chunks holding a single byte value (FILL_CHUNKS)
+        UART_CACHE_FRAME = 0x07,   // Chunks held in the slave's block cache (CACHE_QUERY, CACHE_ANSWER)
+        UART_HASH_FRAME = 0x08,    // Hash tree nodes of the received file (HASH_QUERY, HASH_ANSWER)
     } UARTFrameType;
 
     typedef enum
@@ -63,16 +75,88 @@ extern "C"
         uint8_t eof;      // End of Frame
     } __attribute__((packed)) UARTFrame;
 
+    typedef enum
+    {
+        FRAME_RECEIVE_SOF_LOW_BYTE = 0, // Start of Frame - Low Byte
+        FRAME_RECEIVE_SOF_HIGH_BYTE,    // Start of Frame - High Byte
+        FRAME_RECEIVE_DEVICE_ID,        // Device ID
+        FRAME_RECEIVE_TYPE,             // Frame Type
+        FRAME_RECEIVE_LENGTH_LOW_BYTE,  // Length of Data - Low Byte
+        FRAME_RECEIVE_LENGTH_HIGH_BYTE, // Length of Data - High Byte
+        FRAME_RECEIVE_DATA_CONTENT,     // Data Content
+        FRAME_RECEIVE_CRC_BYTE_0,       // CRC Byte 0 (least significant byte)
+        FRAME_RECEIVE_CRC_BYTE_1,       // CRC Byte 1
+        FRAME_RECEIVE_CRC_BYTE_2,       // CRC Byte 2
+        FRAME_RECEIVE_CRC_BYTE_3,       // CRC Byte 3 (most significant byte)
+        FRAME_RECEIVE_EOF,              // End of Frame
+    } FRAME_RECEIVE_STATE;
+
+    /*
+     * COBS framing (CAP_CODEC_COBS) : the same ID, TYPE, LENGTH, DATA, CRC bytes, COBS encoded and
+     * sent between 0x00 delimiters, SOF and EOF are left out.
+     *  _____________________________________________________
+     * | 0x00 | COBS( ID | TYPE | LENGTH | DATA | CRC ) | 0x00 |
+     * -------------------------------------------------------
+     * A received frame is stored in uart_buf with the UARTFrame layout of the SOF framing.
+     */
+
+    /* Incremental frame receiver : bytes are pushed as they arrive, the frame is assembled in uart_buf.
+       Both framings are recognized, whichever completes a valid frame first wins */
+    typedef struct
+    {
+        uint8_t my_ID;
+        FRAME_RECEIVE_STATE state;
+        uint16_t index;     // write position in uart_buf
+        uint16_t length;    // payload length of the current frame
+        uint16_t remaining; // payload bytes still expected
+        uint32_t rec_crc32;
+        uint32_t calc_crc;
+        uint64_t rx_span;
+        int8_t rejected;        // -2 / -3 : a candidate frame failed since the last report
+        uint16_t lookback_pos;  // next byte of lookback to parse
+        uint16_t lookback_len;
+        uint8_t lookback[MAX_UART_FRAME_SIZE]; // bytes of a failed candidate frame, scanned again from the byte after its SOF
+        bool cobs;          // COBS framing in use (last frame received) : SOF framing errors are not reported
+        uint16_t cobs_fill; // encoded bytes since the last delimiter
+        uint64_t cobs_span;
+        uint8_t cobs_buf[MAX_UART_COBS_FRAME_SIZE];
+    } FRAME_PARSER;
+
+    void frame_parser_init(FRAME_PARSER *parser, uint8_t my_ID);
+    // True if no frame is partially received
+    bool frame_parser_idle(const FRAME_PARSER *parser);
+    /* The line went idle inside a candidate frame : its SOF may have been noise in front of a real frame, the bytes
+       after it are scanned again before the parser is reset. Same returns as frame_parser_feed() */
+    int frame_parser_expire(FRAME_PARSER *parser);
+    /* Push count bytes, stops after the first complete (1) or rejected frame (-1 : other ID, -2 : oversize, -3 : CRC),
+       returns 0 when every byte was consumed without completing a frame. consumed (may be NULL) gets the bytes used.
+       A candidate frame failing the length or CRC check is scanned again from the byte after its SOF, its error is
+       returned only once every byte was parsed without finding a frame. count 0 parses the lookback bytes left */
+    int frame_parser_feed(FRAME_PARSER *parser, const uint8_t *bytes, uint16_t count, uint16_t *consumed);
+
+    // Framing of the frames written from now on (false : SOF / length / EOF)
+    void frame_tx_cobs(bool enable);
+    // Pause before the line is turned around after a frame (default TX_GUARD_US)
+    void frame_tx_guard_us(uint32_t us);
+    // Framing of the last frame received by tryGetResquestFromMaster()
+    bool frame_rx_cobs(void);
+
     inline char openSerialPort(const char *Device, const unsigned int Bauds)
     {
         return openDevice(Device, Bauds);
     }
+    /* Receive errors of the driver (overrun, tty buffer overrun, framing, parity, break) since the previous call,
+       also added to the metrics. The first call sets the baseline and returns 0, as does a driver without counters */
+    uint32_t uart_errors_poll(void);
     int tryGetResquestFromMaster(uint8_t my_ID);
     int tryGetResquestFromSlave(uint8_t Slave_ID);
 
     int Write_Command_to_Slave(uint8_t Slave_ID, uint8_t cmd);
     int Write_Info_to_Slave(uint8_t Slave_ID, uint8_t InfoType, uint8_t *data, uint16_t length);
+    // Frame followed by more frames : no drain / turnaround, paced on the TX queue depth instead
+    int Write_Stream_to_Slave(uint8_t Slave_ID, uint8_t InfoType, uint8_t *data, uint16_t length);
     int Write_Info_to_Master(uint8_t Slave_ID, uint8_t data);
+    int Write_Data_to_Master(uint8_t Slave_ID, uint8_t InfoType, uint8_t *data, uint16_t length);
 #ifdef __cplusplus
 }
 #endif
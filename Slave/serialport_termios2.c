@@ -0,0 +1,55 @@
+/**
+ * @file serialport_termios2.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-26
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "serialport_termios2.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+unsigned int termios2_set_baud(int fd, unsigned int baud)
+{
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) != 0)
+        return 0;
+    // BOTHER : the rate is taken as is from c_ispeed / c_ospeed
+    tio.c_cflag &= ~CBAUD;
+    tio.c_cflag |= BOTHER;
+    tio.c_cflag &= ~(CBAUD << IBSHIFT);
+    tio.c_cflag |= BOTHER << IBSHIFT;
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+    if (ioctl(fd, TCSETSW2, &tio) != 0)
+        return 0;
+    return termios2_get_baud(fd);
+}
+
+unsigned int termios2_get_baud(int fd)
+{
+    // the driver writes back the rate its divisor really gives
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) != 0)
+        return 0;
+    return tio.c_ospeed;
+}
+#else
+unsigned int termios2_set_baud(int fd, unsigned int baud)
+{
+    (void)fd;
+    (void)baud;
+    return 0;
+}
+
+unsigned int termios2_get_baud(int fd)
+{
+    (void)fd;
+    return 0;
+}
+#endif
@@ -0,0 +1,30 @@
+/**
+ * @file serialport_termios2.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Arbitrary baud rates on Linux (termios2 + BOTHER).
+ *         Kept in its own translation unit : <asm/termbits.h> conflicts with <termios.h>.
+ * @version 0.1
+ * @date 2023-12-26
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef SERIALPORT_TERMIOS2_HEADER_H_
+#define SERIALPORT_TERMIOS2_HEADER_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define BAUD_TOLERANCE_PERCENT 2 /* largest gap between the requested and the achieved rate */
+
+    // Program baud on fd (pending output is sent first), returns the rate reported by the driver, 0 on error
+    unsigned int termios2_set_baud(int fd, unsigned int baud);
+    // Rate the driver runs fd at, 0 on error
+    unsigned int termios2_get_baud(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // SERIALPORT_TERMIOS2_HEADER_H_
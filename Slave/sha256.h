@@ -0,0 +1,40 @@
+/**
+ * @file sha256.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  SHA-256 (FIPS 180-4)
+ * @version 0.1
+ * @date 2023-12-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef SHA256_HEADER_H_
+#define SHA256_HEADER_H_
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define SHA256_DIGEST_SIZE 32
+
+    typedef struct
+    {
+        uint32_t state[8];
+        uint64_t length; // bytes hashed
+        uint8_t block[64];
+        uint8_t fill;    // bytes in block
+    } SHA256_CTX;
+
+    void sha256_init(SHA256_CTX *ctx);
+    void sha256_update(SHA256_CTX *ctx, const void *data, size_t length);
+    void sha256_final(SHA256_CTX *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+    // Digest of length bytes in one call
+    void sha256(const void *data, size_t length, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // SHA256_HEADER_H_
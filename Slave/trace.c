@@ -0,0 +1,73 @@
+/**
+ * @file trace.c
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-12-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include "trace.h"
+#include "metrics.h"
+#include "log.h"
+
+#define TRACE_FILE_BUFFER_SIZE (64 * 1024)
+
+static FILE *trace_file = NULL;
+static int trace_pid;
+
+/* The JSON Array Format is used: the closing ']' is optional,
+ * so a trace cut short by a crash is still loadable. */
+int trace_open(const char *path, const char *process_name)
+{
+    trace_file = fopen(path, "w");
+    if (!trace_file)
+    {
+        LOG_ERROR("Error opening trace file %s", path);
+        return -1;
+    }
+    setvbuf(trace_file, NULL, _IOFBF, TRACE_FILE_BUFFER_SIZE);
+    trace_pid = (int)getpid();
+    fprintf(trace_file, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            trace_pid, trace_pid, process_name);
+    return 1;
+}
+
+void trace_close(void)
+{
+    if (!trace_file)
+        return;
+    fprintf(trace_file, "\n]\n");
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+bool trace_enabled(void)
+{
+    return trace_file != NULL;
+}
+
+uint64_t trace_begin(void)
+{
+    return trace_file ? metrics_now_us() : 0;
+}
+
+void trace_end(const char *name, uint64_t start_us)
+{
+    if (!trace_file || !start_us)
+        return;
+    fprintf(trace_file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,\"dur\":%llu}",
+            name, trace_pid, trace_pid, (unsigned long long)start_us, (unsigned long long)(metrics_now_us() - start_us));
+}
+
+void trace_end_arg(const char *name, uint64_t start_us, const char *arg_name, long arg)
+{
+    if (!trace_file || !start_us)
+        return;
+    fprintf(trace_file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,\"args\":{\"%s\":%ld}}",
+            name, trace_pid, trace_pid, (unsigned long long)start_us, (unsigned long long)(metrics_now_us() - start_us),
+            arg_name, arg);
+}
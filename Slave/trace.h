@@ -0,0 +1,40 @@
+/**
+ * @file trace.h
+ * @author abdo daood (abdo.daood94@gmail.com)
+ * @brief  Optional span tracing in Chrome trace / Perfetto JSON format.
+ *         Timestamps come from CLOCK_MONOTONIC, so the master and slave traces
+ *         recorded on the same host line up and can be loaded together.
+ * @version 0.1
+ * @date 2023-12-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef TRACE_HEADER_H_
+#define TRACE_HEADER_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+    // Start tracing into path, process_name labels the track ("master" / "slave")
+    int trace_open(const char *path, const char *process_name);
+    // Flush and close the trace file
+    void trace_close(void);
+    bool trace_enabled(void);
+
+    // Returns the span start timestamp (0 when tracing is disabled)
+    uint64_t trace_begin(void);
+    // Record a complete span [start_us, now], name must be a string literal
+    void trace_end(const char *name, uint64_t start_us);
+    // Same with one integer argument shown in the span details
+    void trace_end_arg(const char *name, uint64_t start_us, const char *arg_name, long arg);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // TRACE_HEADER_H_
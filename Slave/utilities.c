@@ -8,6 +8,11 @@
  * @copyright Copyright (c) 2023
  *
  */
+#define _GNU_SOURCE // fallocate()
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "utilities.h"
 #include "log.h"
 #include "main.h"
@@ -16,6 +21,7 @@
 
 extern BINARY_FILE_INFO binaryinfo;
 FILE *BinFile = NULL;
+static const char *ReceiveFilePath = BINARY_FILE_PATH;
 
 void close_binary_file()
 {
@@ -25,23 +31,57 @@ void close_binary_file()
     BinFile = NULL;
     return;
 }
-int check_space_by_writing_temp_file(size_t requiredSize)
+
+void select_receive_file(const char *path)
+{
+    close_binary_file();
+    ReceiveFilePath = path;
+}
+
+const char *receive_file_path(void)
+{
+    return ReceiveFilePath;
+}
+
+FILE *open_receive_file(void)
 {
     if (BinFile == NULL)
     {
-        BinFile = fopen(BINARY_FILE_PATH, "r+b"); // Open for reading and writing. The file must exist.
+        BinFile = fopen(ReceiveFilePath, "r+b"); // Open for reading and writing. The file must exist.
         if (BinFile == NULL)
         {
             // If the file doesn't exist, you might want to open it with "w+b" instead
-            BinFile = fopen(BINARY_FILE_PATH, "w+b");
+            BinFile = fopen(ReceiveFilePath, "w+b");
             if (BinFile == NULL)
-            {
                 LOG_ERROR("Error opening file");
-                return -1;
-            }
         }
     }
+    return BinFile;
+}
+
+int trim_receive_file(uint32_t size)
+{
+    struct stat st;
+    close_binary_file();
+    if (stat(ReceiveFilePath, &st) != 0 || st.st_size <= (off_t)size)
+        return 1;
+    if (truncate(ReceiveFilePath, size) != 0)
+    {
+        LOG_ERROR("Error truncating %s", ReceiveFilePath);
+        return -1;
+    }
+    return 1;
+}
 
+int check_space_by_writing_temp_file(size_t requiredSize)
+{
+    if (open_receive_file() == NULL)
+        return -1;
+
+    // reserve the blocks without writing them (a mostly empty image is not written twice)
+    if (fallocate(fileno(BinFile), 0, 0, requiredSize) == 0)
+        return 1;
+    // no fallocate on this file system : write zeros
     char buffer[1024] = {0};
     size_t writtenSize = 0;
 
@@ -111,7 +151,9 @@ typedef enum
     CHUNK_MAX_PLD_LENGTH_128B = 0x00, // MAX CHUNK Payload Length 128 bytes
     CHUNK_MAX_PLD_LENGTH_256B,        // MAX CHUNK Payload Length 256 bytes
     CHUNK_MAX_PLD_LENGTH_512B,        // MAX CHUNK Payload Length 512 bytes
-    CHUNK_MAX_PLD_LENGTH_1024B        // MAX CHUNK Payload Length 1024 bytes (1 KB)
+    CHUNK_MAX_PLD_LENGTH_1024B,       // MAX CHUNK Payload Length 1024 bytes (1 KB)
+    CHUNK_MAX_PLD_LENGTH_2048B,       // MAX CHUNK Payload Length 2048 bytes (2 KB)
+    CHUNK_MAX_PLD_LENGTH_4096B        // MAX CHUNK Payload Length 4096 bytes (4 KB)
 } ChunkMaxDataLength;
 
 int StoreDataIntoFile(uint8_t *ChunkStartPtr, uint16_t ChunkLength)
@@ -121,11 +163,73 @@ int StoreDataIntoFile(uint8_t *ChunkStartPtr, uint16_t ChunkLength)
     uint16_t offsetIdx = UARTChunkPtr->ChunkIdx;
 
     uint16_t ChunkPayloadLength = ChunkLength - sizeof(UARTChunkPtr->ChLen) - sizeof(UARTChunkPtr->ChunkIdx);
-    uint32_t ChunkStepConstant = decode_chunk_payload_max_size(UARTChunkPtr->ChLen);
+    uint32_t ChunkStepConstant = decode_chunk_payload_max_size(UARTChunkPtr->ChLen & CHUNK_LEN_CODE_MASK);
 
     size_t offsetAddress = offsetIdx * ChunkStepConstant;
+    // the file is closed at verify : chunks sent again by a repair reopen it
+    if (open_receive_file() == NULL)
+        return -1;
     return write_file_with_offset(BinFile, UARTChunkPtr->ChunkPayload, ChunkPayloadLength, offsetAddress);
 }
+int StorePayloadIntoFile(uint32_t offset, const uint8_t *buf, uint16_t length)
+{
+    if (open_receive_file() == NULL)
+        return -1;
+    return write_file_with_offset(BinFile, buf, length, offset);
+}
+int LoadPayloadFromFile(uint32_t offset, uint8_t *buf, uint16_t length)
+{
+    if (open_receive_file() == NULL)
+        return -1;
+    if (fseek(BinFile, offset, SEEK_SET) != 0)
+    {
+        LOG_ERROR("Error seeking in file");
+        return -2;
+    }
+    if (fread(buf, 1, length, BinFile) != length)
+    {
+        LOG_ERROR("Error reading file");
+        return -3;
+    }
+    return 1;
+}
+int FillFileRange(uint32_t offset, uint32_t length, uint8_t value)
+{
+    if (open_receive_file() == NULL)
+        return -1;
+    if (fflush(BinFile) != 0) // nothing buffered may land on the range afterwards
+    {
+        LOG_ERROR("Error writing to file");
+        return -3;
+    }
+    if (value == 0)
+    {
+        int fd = fileno(BinFile);
+        struct stat st;
+        uint64_t end = (uint64_t)offset + length;
+        if (fstat(fd, &st) == 0)
+        {
+            // zeros : the part past the end of the file is added sparse, the blocks already written are deallocated
+            uint64_t size = st.st_size;
+            bool extended = size >= end || ftruncate(fd, end) == 0;
+            uint64_t punch_end = (size < end) ? size : end;
+            if (extended && (punch_end <= offset || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, punch_end - offset) == 0))
+                return 1;
+        }
+        // no sparse files on this file system : the zeros are written
+    }
+    uint8_t buf[4096];
+    memset(buf, value, sizeof(buf));
+    for (uint32_t done = 0; done < length;)
+    {
+        uint32_t size = (length - done < sizeof(buf)) ? length - done : sizeof(buf);
+        int ret = write_file_with_offset(BinFile, buf, size, offset + done);
+        if (ret <= 0)
+            return ret;
+        done += size;
+    }
+    return 1;
+}
 uint32_t decode_chunk_payload_max_size(uint8_t ChLen)
 {
 
@@ -144,6 +248,12 @@ uint32_t decode_chunk_payload_max_size(uint8_t ChLen)
     case CHUNK_MAX_PLD_LENGTH_1024B:
         ChunkStepConstant = 1024;
         break;
+    case CHUNK_MAX_PLD_LENGTH_2048B:
+        ChunkStepConstant = 2048;
+        break;
+    case CHUNK_MAX_PLD_LENGTH_4096B:
+        ChunkStepConstant = 4096;
+        break;
     default:
         ChunkStepConstant = 512;
         break;
@@ -168,6 +278,12 @@ uint8_t encode_chunk_payload_max_size(uint32_t PLD_LENGTH_XXXX)
     case 1024:
         ChLen = CHUNK_MAX_PLD_LENGTH_1024B;
         break;
+    case 2048:
+        ChLen = CHUNK_MAX_PLD_LENGTH_2048B;
+        break;
+    case 4096:
+        ChLen = CHUNK_MAX_PLD_LENGTH_4096B;
+        break;
     default:
         ChLen = CHUNK_MAX_PLD_LENGTH_512B;
         break;
@@ -175,6 +291,22 @@ uint8_t encode_chunk_payload_max_size(uint32_t PLD_LENGTH_XXXX)
     return ChLen;
 }
 
+uint32_t chunk_payload_floor(uint32_t size)
+{
+    uint32_t payload = 4096;
+    while (payload > 128 && payload > size)
+        payload /= 2;
+    return payload;
+}
+
+void link_probe_pattern(uint8_t *buf, uint16_t length, uint8_t seq)
+{
+    // long runs of 0x00 / 0xFF and alternating bits, the patterns a marginal rate gets wrong first
+    static const uint8_t stress[] = {0x00, 0xFF, 0x55, 0xAA, 0x0F, 0xF0, 0x01, 0x80};
+    for (uint16_t i = 0; i < length; i++)
+        buf[i] = (i & 1) ? (uint8_t)(i + seq) : stress[(i / 2 + seq) % sizeof(stress)];
+}
+
 uint8_t encode_bootloader_version(uint8_t major, uint8_t minor)
 {
     // Ensure that major and minor versions fit into 4 bits
@@ -213,6 +345,31 @@ int calculate_file_crc_and_length(const char *filename, uint32_t *crc, uint32_t
     return 0;
 }
 
+char *map_binary_file(const char *filename, size_t *size)
+{
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    void *contents = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (contents == MAP_FAILED)
+        return NULL;
+    madvise(contents, st.st_size, MADV_SEQUENTIAL); // the kernel reads ahead of the chunks sent
+    *size = st.st_size;
+    return contents;
+}
+
+void unmap_binary_file(char *contents, size_t size)
+{
+    munmap(contents, size);
+}
+
 char *read_binary_file(const char *filename, size_t *size)
 {
     FILE *file;
@@ -237,7 +394,7 @@ char *read_binary_file(const char *filename, size_t *size)
     if (!buffer)
     {
         fclose(file);
-        LOG_ERROR("Memory allocation failed\n");
+        LOG_ERROR("Memory allocation failed");
         return NULL;
     }
 
@@ -246,7 +403,7 @@ char *read_binary_file(const char *filename, size_t *size)
     {
         fclose(file);
         free(buffer);
-        LOG_ERROR("Error reading file\n");
+        LOG_ERROR("Error reading file");
         return NULL;
     }
 
@@ -20,6 +20,9 @@ extern "C"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include "caps.h"
+#include "sha256.h"
+#include "hash_tree.h"
     typedef struct
     {
         uint8_t major;
@@ -35,8 +38,124 @@ extern "C"
     {
         uint8_t ChLen;              //  CHUNK_MAX_PLD_LENGTH_XXXX indicator
         uint16_t ChunkIdx;          // Chunk index
-        uint8_t ChunkPayload[1024]; // Chunk data payload
+        uint8_t ChunkPayload[4096]; // Chunk data payload
     } __attribute__((packed)) UARTChunk;
+#define CHUNK_LEN_CODE_MASK 0x3F /* ChLen : CHUNK_MAX_PLD_LENGTH_XXXX code */
+#define CHUNK_CACHE_REF 0x40     /* ChLen flag : the payload is the SHA-256 of the chunk, the slave copies it from its block cache (CAP_CODEC_CACHE) */
+#define CHUNK_ACK_REQUEST 0x80   /* ChLen flag : checkpoint, answer with a STREAM_ACK (last chunk of a burst, every chunk in stop and wait) */
+
+    /* Checkpoint answer of the slave (UART_DATA_FRAME), slaves of the 3 step setup answer a single ACK / NACK byte */
+    typedef struct
+    {
+        uint8_t status;         // UART_RESPOND_NACK : a chunk could not be stored
+        uint16_t next_expected; // first chunk not stored yet (in chunks of the checkpoint size), the master goes back to it
+        uint16_t rx_errors;     // driver receive errors (overrun, framing, parity, break) since the previous checkpoint
+        uint8_t lost;           // chunks of the burst missing at the checkpoint, before FEC recovery
+        uint8_t recovered;      // chunks of the burst rebuilt from parity frames
+        uint16_t checkpoint;    // ChunkIdx of the checkpoint answered (last chunk of the burst) : tells a late answer apart
+    } __attribute__((packed)) STREAM_ACK;
+
+    /* UART_FEC_FRAME : parity row of the group of chunks first_idx .. first_idx + data_count - 1 (fec.h).
+       It follows the data chunks of the burst, the last parity frame is the checkpoint */
+    typedef struct
+    {
+        uint8_t ChLen;              // chunk size code of the group, CHUNK_ACK_REQUEST on the last parity frame
+        uint16_t first_idx;         // first chunk of the group
+        uint8_t data_count;         // chunks in the group
+        uint8_t parity_count;       // parity frames of the group
+        uint8_t row;                // parity row carried (0 .. parity_count - 1)
+        uint8_t parity[4096];       // chunk size bytes
+    } __attribute__((packed)) FEC_PARITY;
+    /* UART_FILL_FRAME : chunks first_idx .. first_idx + count - 1 all hold value (the last chunk of the file may be
+       shorter), sent instead of their data. It is a burst of its own : CHUNK_ACK_REQUEST is always set */
+    typedef struct
+    {
+        uint8_t ChLen;      // chunk size code of the run, CHUNK_ACK_REQUEST
+        uint16_t first_idx; // first chunk of the run
+        uint16_t count;     // chunks in the run
+        uint8_t value;      // byte value of every byte of the run
+    } __attribute__((packed)) FILL_CHUNKS;
+    /* UART_CACHE_FRAME from the master : which of the chunks first_idx .. first_idx + count - 1 (SHA-256 of each)
+       the slave holds in its block cache. The answer (CACHE_ANSWER) echoes ChLen, first_idx and count */
+#define CACHE_QUERY_MAX 64 /* chunks per query (bits of CACHE_ANSWER.have) */
+    typedef struct
+    {
+        uint8_t ChLen;                                   // chunk size code of the chunks named
+        uint16_t first_idx;                              // first chunk
+        uint8_t count;                                   // chunks named
+        uint8_t hashes[CACHE_QUERY_MAX][SHA256_DIGEST_SIZE]; // count hashes
+    } __attribute__((packed)) CACHE_QUERY;
+
+    typedef struct
+    {
+        uint8_t ChLen;
+        uint16_t first_idx;
+        uint8_t count;
+        uint64_t have; // bit i : chunk first_idx + i is held, it may be sent as a CHUNK_CACHE_REF
+    } __attribute__((packed)) CACHE_ANSWER;
+
+    /* UART_HASH_FRAME from the master (after a failed verify) : nodes first .. first + count - 1 of a level of the
+       hash tree of the received file, built when its verify failed. The answer (HASH_ANSWER) echoes the query */
+    typedef struct
+    {
+        uint8_t level;  // 0 : the leaves (HASH_TREE_LEAF bytes of the file each)
+        uint16_t first; // first node of the level
+        uint8_t count;  // nodes (up to HASH_TREE_FANOUT)
+    } __attribute__((packed)) HASH_QUERY;
+
+    typedef struct
+    {
+        HASH_QUERY query;
+        uint8_t hashes[HASH_TREE_FANOUT][SHA256_DIGEST_SIZE]; // count hashes
+    } __attribute__((packed)) HASH_ANSWER;
+
+    /* UART_SESSION_FRAME from the master : everything the slave needs to accept a transfer */
+    typedef struct
+    {
+        BINARY_FILE_INFO file;  // size and crc32 of the file to be sent
+        uint16_t chunk_payload; // largest chunk payload the master would like to send
+        PROTOCOL_CAPS caps;     // what the master supports
+    } __attribute__((packed)) SESSION_OPEN_REQUEST;
+
+    /* Follows SESSION_OPEN_REQUEST when the master offers CAP_CODEC_PATCH : the file announced is a patch (patch.h)
+       turning the slave's current file, base, into target. The slave answers with CAP_CODEC_PATCH only if its
+       current file is base, the master then sends the file itself in a new session */
+    typedef struct
+    {
+        BINARY_FILE_INFO base;   // size and crc32 of the file the patch applies to
+        BINARY_FILE_INFO target; // size and crc32 of the patched file
+    } __attribute__((packed)) PATCH_INFO;
+
+    /* UART_SESSION_FRAME answer of the slave */
+    typedef struct
+    {
+        uint8_t bl_status;      // UART_RESPOND_ACK : running the bootloader
+        uint8_t bl_version;     // encode_bootloader_version()
+        uint8_t space;          // UART_RESPOND_ACK : enough space for the file
+        uint16_t chunk_payload; // chunk payload size to use for this session (0 : no common configuration)
+        PROTOCOL_CAPS caps;     // configuration both sides support (caps_negotiate())
+    } __attribute__((packed)) SESSION_OPEN_RESPONSE;
+
+#define LINK_PROBE_BYTES 256     /* test pattern carried by each probe frame */
+#define LINK_PROBE_FRAMES 4      /* probes that must all be acknowledged before the commit */
+#define LINK_REVERT_MS 300       /* slave : back to the start rate if the switch is not committed in time */
+#define LINK_IDLE_REVERT_MS 1000 /* both : back to the start rate after this long without a valid frame */
+
+    /* UART_LINK_FRAME operations */
+    typedef enum
+    {
+        LINK_OP_SWITCH = 0x01, // ACK at the current rate, then move to LINK_REQUEST.baud
+        LINK_OP_PROBE = 0x02,  // LINK_REQUEST followed by LINK_PROBE_BYTES of link_probe_pattern(seq)
+        LINK_OP_COMMIT = 0x03, // the new rate works, keep it
+    } LINK_OP;
+
+    typedef struct
+    {
+        uint8_t op;    // LINK_OP
+        uint8_t seq;   // probe number
+        uint32_t baud; // target rate of LINK_OP_SWITCH
+    } __attribute__((packed)) LINK_REQUEST;
+
     typedef enum
     {
         UART_CMD_GET_BL_VERSION,     // Get bootloader version
@@ -52,10 +171,32 @@ extern "C"
     int check_space_by_writing_temp_file(size_t requiredSize);
 
     void processMasterCommand(uint8_t cmd_type);
+    // Handle a UART_SESSION_FRAME (bootloader entry + file info + space check in one exchange)
+    void processSessionOpen(const uint8_t *data, uint16_t length);
+    void processChunk(uint8_t *data, uint16_t length);
+    // Handle a UART_FEC_FRAME, the last parity frame of a group is a checkpoint
+    void processParity(const uint8_t *data, uint16_t length);
+    // Handle a UART_FILL_FRAME, answered with a STREAM_ACK
+    void processFill(const uint8_t *data, uint16_t length);
+    // Handle a UART_CACHE_FRAME, answered with a CACHE_ANSWER
+    void processCacheQuery(const uint8_t *data, uint16_t length);
+    // Handle a UART_HASH_FRAME, answered with a HASH_ANSWER
+    void processHashQuery(const uint8_t *data, uint16_t length);
+    // Handle a UART_LINK_FRAME (runtime baud rate change)
+    void processLinkRequest(const uint8_t *data, uint16_t length);
+    // Test pattern of the link probe number seq
+    void link_probe_pattern(uint8_t *buf, uint16_t length, uint8_t seq);
+    // Largest supported chunk payload size (128 .. 4096) not above size
+    uint32_t chunk_payload_floor(uint32_t size);
     
     uint8_t encode_bootloader_version(uint8_t major, uint8_t minor);
     // Funcation takes a pointer to start of chunk in frame and chunk length
     int StoreDataIntoFile(uint8_t *ChunkStartPtr, uint16_t ChunkLength);
+    // Write / read back length bytes of the received file at offset (FEC recovery), 1 on success
+    int StorePayloadIntoFile(uint32_t offset, const uint8_t *buf, uint16_t length);
+    int LoadPayloadFromFile(uint32_t offset, uint8_t *buf, uint16_t length);
+    // Set length bytes of the received file at offset to value (zeros : hole punched where the file system allows), 1 on success
+    int FillFileRange(uint32_t offset, uint32_t length, uint8_t value);
 
     uint32_t decode_chunk_payload_max_size(uint8_t ChLen);
     uint8_t encode_chunk_payload_max_size(uint32_t PLD_LENGTH_XXXX);
@@ -64,9 +205,19 @@ extern "C"
 
     // function that reads a binary file and stores its contents in a buffer
     char *read_binary_file(const char *filename, size_t *size);
+    // Map a regular non empty file read only, its pages are read as they are used (NULL : use read_binary_file())
+    char *map_binary_file(const char *filename, size_t *size);
+    void unmap_binary_file(char *contents, size_t size);
 
     // Close Binary File
     void close_binary_file();
+    // File the chunks are stored in from now on (default BINARY_FILE_PATH), the current one is closed
+    void select_receive_file(const char *path);
+    const char *receive_file_path(void);
+    // Open the file the chunks are stored in (again after a verify closed it : repair), NULL on error
+    FILE *open_receive_file(void);
+    // Cut the received file to size bytes if it is longer (left from a larger file received earlier), 1 on success
+    int trim_receive_file(uint32_t size);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,256 @@
+/**
+ * @file main.c
+ * @author Abdo Daood (abdo.daood94@gmail.com)
+ * @brief  uartcap : decode and replay the wire captures recorded with "-c"
+ * @version 0.1
+ * @date 2023-12-21
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../Slave/serialport_layer.h"
+#include "../Slave/utilities.h"
+#include "../Slave/checksum.h"
+#include "../Slave/capture.h"
+#include "../Slave/metrics.h"
+#include "../Slave/log.h"
+
+BINARY_FILE_INFO binaryinfo;
+extern int serial_fd;
+
+static const char *DIR_NAMES[] = {"RX", "TX"};
+static const char *ROLE_NAMES[] = {"master", "slave"};
+
+/* Frame extractor for one direction of the capture.
+ * Bytes are kept with the timestamp of the record they came from. */
+typedef struct
+{
+    uint8_t buf[2 * MAX_UART_FRAME_SIZE];
+    uint64_t ts[2 * MAX_UART_FRAME_SIZE];
+    size_t n;
+    uint64_t last_frame_end_ns;
+    uint32_t frames, crc_errors, garbage_bytes;
+} FRAME_DECODER;
+
+static void drop_bytes(FRAME_DECODER *dec, size_t count)
+{
+    memmove(dec->buf, dec->buf + count, dec->n - count);
+    memmove(dec->ts, dec->ts + count, (dec->n - count) * sizeof(dec->ts[0]));
+    dec->n -= count;
+}
+
+// frame : UARTFrame layout, wire bytes received from start to end
+static void print_frame(int direction, FRAME_DECODER *dec, const UARTFrame *frame, uint64_t start, uint64_t end, bool crc_ok, bool cobs)
+{
+    double gap_us = dec->last_frame_end_ns ? (start - dec->last_frame_end_ns) / 1e3 : 0.0;
+    printf("%12.3f ms  %s  id=%02X type=%02X len=%5u  dur=%9.1f us  gap=%9.1f us  %s",
+           start / 1e6, DIR_NAMES[direction], frame->id, frame->type, frame->len, (end - start) / 1e3, gap_us,
+           crc_ok ? "crc ok " : "CRC BAD");
+    if (frame->type == UART_DATA_FRAME && frame->len > 3)
+        printf("  chunk=%u", ((UARTChunk *)&frame->data)->ChunkIdx);
+    else if (frame->len == 1)
+        printf("  data=%02X", frame->data);
+    if (cobs)
+        printf("  cobs");
+    printf("\n");
+    dec->last_frame_end_ns = end;
+}
+
+// COBS frame starting with the delimiter in buf[0] : 1 printed and dropped (up to its closing delimiter),
+// 0 more bytes needed, -1 not a COBS frame
+static int decode_cobs_frame(int direction, FRAME_DECODER *dec)
+{
+    static uint8_t frame_buf[MAX_UART_FRAME_SIZE];
+    const uint8_t *end = memchr(dec->buf + 1, COBS_DELIMITER, dec->n - 1);
+    if (!end)
+        return (dec->n < sizeof(dec->buf)) ? 0 : -1;
+    size_t encoded = end - (dec->buf + 1);
+    if (!encoded) // delimiter closing the previous frame
+    {
+        drop_bytes(dec, 1);
+        return 1;
+    }
+    UARTFrame *frame = (UARTFrame *)frame_buf;
+    int size = cobs_decode(dec->buf + 1, encoded, frame_buf + 2, sizeof(frame_buf) - 3);
+    if (size < 8 || size != frame->len + 8) // id type len(2) data crc(4)
+        return -1;
+    uint32_t rec_crc;
+    memcpy(&rec_crc, &frame_buf[2 + 4 + frame->len], sizeof(rec_crc));
+    bool crc_ok = crc_32(&frame_buf[2], frame->len + 4) == rec_crc;
+    print_frame(direction, dec, frame, dec->ts[0], dec->ts[encoded + 1], crc_ok, true);
+    if (crc_ok)
+        dec->frames++;
+    else
+        dec->crc_errors++;
+    drop_bytes(dec, encoded + 1); // the closing delimiter may open the next frame
+    return 1;
+}
+
+static void decoder_feed(int direction, FRAME_DECODER *dec, const uint8_t *data, uint32_t len, uint64_t time_ns)
+{
+    while (len)
+    {
+        size_t part = sizeof(dec->buf) - dec->n;
+        if (part > len)
+            part = len;
+        memcpy(dec->buf + dec->n, data, part);
+        for (size_t i = 0; i < part; i++)
+            dec->ts[dec->n + i] = time_ns;
+        dec->n += part;
+        data += part;
+        len -= part;
+
+        while (dec->n >= 2)
+        {
+            if (dec->buf[0] == COBS_DELIMITER)
+            {
+                int ret = decode_cobs_frame(direction, dec);
+                if (ret == 0)
+                    break;
+                if (ret > 0)
+                    continue;
+            }
+            if (dec->buf[0] != UART_SOF_L || dec->buf[1] != UART_SOF_H)
+            {
+                dec->garbage_bytes++;
+                drop_bytes(dec, 1);
+                continue;
+            }
+            if (dec->n < 6)
+                break;
+            UARTFrame *frame = (UARTFrame *)dec->buf;
+            if (frame->len > MAX_UART_DATA_PAYLOAD_SIZE)
+            {
+                dec->garbage_bytes++;
+                drop_bytes(dec, 1);
+                continue;
+            }
+            size_t frame_len = frame->len + UART_FRAME_OVERHEAD_BYTES;
+            if (dec->n < frame_len)
+                break;
+            uint32_t rec_crc;
+            memcpy(&rec_crc, &dec->buf[6 + frame->len], sizeof(rec_crc));
+            bool crc_ok = crc_32(&dec->buf[2], frame->len + 4) == rec_crc;
+            print_frame(direction, dec, frame, dec->ts[0], dec->ts[frame_len - 1], crc_ok, false);
+            if (!crc_ok)
+            {
+                dec->crc_errors++;
+                drop_bytes(dec, 1); // rescan from the byte after the SOF
+                continue;
+            }
+            dec->frames++;
+            drop_bytes(dec, frame_len);
+        }
+    }
+}
+
+static int decode_capture(const char *path)
+{
+    static CAPTURE_READER reader;
+    static FRAME_DECODER decoders[2];
+    CAPTURE_RECORD rec;
+    uint64_t bytes[2] = {0, 0};
+    int ret;
+    if ((ret = capture_reader_open(&reader, path)) <= 0)
+    {
+        fprintf(stderr, "cannot open capture %s (%d)\n", path, ret);
+        return EXIT_FAILURE;
+    }
+    printf("capture recorded by the %s\n", ROLE_NAMES[reader.role & 1]);
+    while ((ret = capture_reader_next(&reader, &rec)) > 0)
+    {
+        bytes[rec.direction & 1] += rec.len;
+        decoder_feed(rec.direction & 1, &decoders[rec.direction & 1], rec.data, rec.len, rec.time_ns);
+    }
+    if (ret < 0)
+        fprintf(stderr, "truncated capture (%d)\n", ret);
+    for (int d = 0; d < 2; d++)
+        printf("%s: %llu bytes, %u frames, %u CRC errors, %u garbage bytes\n", DIR_NAMES[d], (unsigned long long)bytes[d],
+               decoders[d].frames, decoders[d].crc_errors, decoders[d].garbage_bytes);
+    printf("duration: %.3f ms\n", reader.time_ns / 1e6);
+    capture_reader_close(&reader);
+    return EXIT_SUCCESS;
+}
+
+/* Replay the master -> slave byte stream into the slave parser, as fast as it can go */
+static int replay_capture(const char *path, uint8_t slave_id)
+{
+    static CAPTURE_READER reader;
+    CAPTURE_RECORD rec;
+    int ret;
+    if ((ret = capture_reader_open(&reader, path)) <= 0)
+    {
+        fprintf(stderr, "cannot open capture %s (%d)\n", path, ret);
+        return EXIT_FAILURE;
+    }
+    // what the slave received is the RX side of a slave capture, or the TX side of a master capture
+    uint8_t to_slave = (reader.role == CAPTURE_ROLE_SLAVE) ? CAPTURE_DIR_RX : CAPTURE_DIR_TX;
+    FILE *stream = tmpfile();
+    if (!stream)
+    {
+        capture_reader_close(&reader);
+        return EXIT_FAILURE;
+    }
+    uint64_t total = 0;
+    while ((ret = capture_reader_next(&reader, &rec)) > 0)
+    {
+        if (rec.direction != to_slave)
+            continue;
+        fwrite(rec.data, 1, rec.len, stream);
+        total += rec.len;
+    }
+    capture_reader_close(&reader);
+    fflush(stream);
+    serial_fd = fileno(stream);
+    lseek(serial_fd, 0, SEEK_SET);
+
+    uint32_t frames = 0, errors = 0;
+    uint64_t start_us = metrics_now_us(), last_frame_us = start_us;
+    while (1)
+    {
+        ret = tryGetResquestFromMaster(slave_id);
+        if (ret > 0)
+        {
+            frames++;
+            last_frame_us = metrics_now_us();
+        }
+        else if (ret < 0)
+            errors++;
+        else if (lseek(serial_fd, 0, SEEK_CUR) >= (off_t)total)
+            break; // timeout at the end of the stream
+    }
+    fclose(stream);
+    double elapsed_s = (last_frame_us - start_us) / 1e6;
+    printf("replayed %llu bytes: %u frames, %u errors (crc %llu, id %llu, oversize %llu)\n", (unsigned long long)total, frames,
+           errors, (unsigned long long)metrics_get(METRIC_CRC_ERRORS), (unsigned long long)metrics_get(METRIC_ID_MISMATCHES),
+           (unsigned long long)metrics_get(METRIC_OVERSIZE_FRAMES));
+    if (elapsed_s > 0)
+        printf("parser: %.3f ms, %.0f frames/s, %.2f MB/s\n", elapsed_s * 1e3, frames / elapsed_s, total / elapsed_s / 1e6);
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *app)
+{
+    printf("Usage: %s decode <capture_file>\n", app);
+    printf("       %s replay <capture_file> [slave_id]\n", app);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "decode") == 0)
+        return decode_capture(argv[2]);
+    if (strcmp(argv[1], "replay") == 0)
+        return replay_capture(argv[2], (argc > 3) ? (uint8_t)strtoul(argv[3], NULL, 0) : 0x01);
+    usage(argv[0]);
+    return 1;
+}